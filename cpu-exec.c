@@ -52,6 +52,11 @@ int tb_invalidated_flag;
 
 int qemu_cpu_has_work(CPUState *env)
 {
+#if defined(TARGET_Z80)
+    /* a halted Z80 still has to run up to its next cycle timer */
+    if (env->cycle_timers)
+        return 1;
+#endif
     return cpu_has_work(env);
 }
 
@@ -251,7 +256,8 @@ int cpu_exec(CPUState *env1)
 #elif defined(TARGET_SH4)
 #elif defined(TARGET_CRIS)
 #elif defined(TARGET_Z80)
-    /* XXXXX */
+    /* F is always explicitly computed outside of translated code */
+    CC_OP = CC_OP_FLAGS;
 #else
 #error unsupported target CPU
 #endif
@@ -358,6 +364,13 @@ int cpu_exec(CPUState *env1)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+#if defined(TARGET_Z80)
+                /* run expired cycle timers before looking at interrupts,
+                   they usually raise one */
+                if (unlikely(env->tstates >= env->tstate_deadline)) {
+                    cpu_z80_run_cycle_timers(env);
+                }
+#endif
                 interrupt_request = env->interrupt_request;
                 if (unlikely(interrupt_request)) {
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
@@ -714,7 +727,9 @@ int cpu_exec(CPUState *env1)
 #elif defined(TARGET_ALPHA)
 #elif defined(TARGET_CRIS)
 #elif defined(TARGET_Z80)
-    /* XXXXX */
+    /* restore flags in standard format */
+    F = cpu_z80_cc_compute_all(env, CC_OP);
+    CC_OP = CC_OP_FLAGS;
 #else
 #error unsupported target CPU
 #endif
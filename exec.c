@@ -61,6 +61,11 @@
 #endif
 
 #define SMC_BITMAP_USE_THRESHOLD 10
+/* a page whose code has been invalidated by this many CPU writes, each
+   less than SMC_QUIET_TBS translations after the previous one, has its
+   blocks translated with CF_SMC until it stays quiet that long */
+#define SMC_HOT_THRESHOLD 16
+#define SMC_QUIET_TBS 1024
 
 #if defined(TARGET_SPARC64)
 #define TARGET_PHYS_ADDR_SPACE_BITS 41
@@ -144,6 +149,13 @@ typedef struct PageDesc {
        of lookups we do to a given page to use a bitmap */
     unsigned int code_write_count;
     uint8_t *code_bitmap;
+#ifdef TARGET_HAS_SMC_OPERANDS
+    /* bytes that only CF_SMC blocks use as operands */
+    uint8_t *operand_bitmap;
+    unsigned int smc_count;
+    unsigned int smc_stamp; /* smc_clock of the last write to code */
+    int smc_hot;
+#endif
 #if defined(CONFIG_USER_ONLY)
     unsigned long flags;
 #endif
@@ -199,6 +211,11 @@ static int log_append = 0;
 static int tlb_flush_count;
 static int tb_flush_count;
 static int tb_phys_invalidate_count;
+#ifdef TARGET_HAS_SMC_OPERANDS
+static unsigned int smc_clock; /* translations so far */
+static int smc_hot_pages;
+static int smc_avoided_count;
+#endif
 
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
@@ -578,6 +595,12 @@ static inline void invalidate_page_bitmap(PageDesc *p)
         qemu_free(p->code_bitmap);
         p->code_bitmap = NULL;
     }
+#ifdef TARGET_HAS_SMC_OPERANDS
+    if (p->operand_bitmap) {
+        qemu_free(p->operand_bitmap);
+        p->operand_bitmap = NULL;
+    }
+#endif
     p->code_write_count = 0;
 }
 
@@ -617,6 +640,9 @@ void tb_flush(CPUState *env1)
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+#if defined(TARGET_Z80)
+        memset(env->loop_heads, 0, sizeof(env->loop_heads));
+#endif
     }
 
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
@@ -839,6 +865,9 @@ static inline void set_bits(uint8_t *tab, int start, int len)
 static void build_page_bitmap(PageDesc *p)
 {
     int n, tb_start, tb_end;
+#ifdef TARGET_HAS_SMC_OPERANDS
+    int i;
+#endif
     TranslationBlock *tb;
 
     p->code_bitmap = qemu_mallocz(TARGET_PAGE_SIZE / 8);
@@ -859,11 +888,491 @@ static void build_page_bitmap(PageDesc *p)
             tb_start = 0;
             tb_end = ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
+#ifdef TARGET_HAS_SMC_OPERANDS
+        /* the operands of a CF_SMC block are all in its first page */
+        if (n == 0 && tb->smc_operands) {
+            if (!p->operand_bitmap)
+                p->operand_bitmap = qemu_mallocz(TARGET_PAGE_SIZE / 8);
+            for (i = 0; tb_start + i < tb_end; i++) {
+                if (i < 64 && ((tb->smc_operands >> i) & 1))
+                    set_bits(p->operand_bitmap, tb_start + i, 1);
+                else
+                    set_bits(p->code_bitmap, tb_start + i, 1);
+            }
+        } else
+#endif
         set_bits(p->code_bitmap, tb_start, tb_end - tb_start);
         tb = tb->page_next[n];
     }
 }
 
+#ifdef TARGET_HAS_SMC_OPERANDS
+/* true if the bytes of [start;end[ that tb covers are all operands it
+   loads at run time */
+static inline int tb_smc_operands_only(TranslationBlock *tb,
+                                       target_ulong tb_start,
+                                       target_ulong tb_end,
+                                       target_phys_addr_t start,
+                                       target_phys_addr_t end)
+{
+    target_ulong addr, i;
+
+    if (!tb->smc_operands)
+        return 0;
+    if (start < tb_start)
+        start = tb_start;
+    if (end > tb_end)
+        end = tb_end;
+    for (addr = start; addr < end; addr++) {
+        i = addr - tb_start;
+        if (i >= 64 || !((tb->smc_operands >> i) & 1))
+            return 0;
+    }
+    return 1;
+}
+
+/* a CPU write to the page invalidated some code */
+static void smc_page_invalidated(PageDesc *p)
+{
+    if (smc_clock - p->smc_stamp > SMC_QUIET_TBS)
+        p->smc_count = 0;
+    p->smc_stamp = smc_clock;
+    if (++p->smc_count >= SMC_HOT_THRESHOLD && !p->smc_hot) {
+        p->smc_hot = 1;
+        smc_hot_pages++;
+    }
+}
+
+/* CF_SMC for a block starting in the page, unless the page went quiet:
+   its blocks are then translated normally again as they get replaced */
+static int smc_page_cflags(target_phys_addr_t phys_pc)
+{
+    PageDesc *p;
+
+    p = page_find(phys_pc >> TARGET_PAGE_BITS);
+    if (!p || !p->smc_hot)
+        return 0;
+    if (smc_clock - p->smc_stamp > SMC_QUIET_TBS) {
+        p->smc_hot = 0;
+        p->smc_count = 0;
+        smc_hot_pages--;
+        return 0;
+    }
+    return CF_SMC;
+}
+#endif
+
+#if !defined(CONFIG_USER_ONLY) && defined(TCG_TARGET_HAS_code_relocs) && \
+    defined(__linux__)
+#define USE_TB_CACHE
+#endif
+
+#ifdef USE_TB_CACHE
+/* Persistent translation cache: the code translated from ROM is saved
+   when QEMU exits and loaded back into the code buffer at the next
+   start, so that the firmware does not have to be translated again.
+
+   The generated code calls helpers at fixed addresses, so a cache file
+   is only used with the same binary, machine and CPU model.  Each
+   block also keeps the guest code it was translated from and is
+   dropped when the ROM no longer contains it. */
+
+#define TB_CACHE_MAGIC 0x31435442554d4551ULL /* "QEMUTBC1" */
+
+typedef struct TBCacheKey {
+    uint64_t magic;
+    uint64_t exe_hash;
+    uint64_t text_addr;         /* detects a relocated binary */
+    uint64_t prologue_addr;
+    int32_t use_icount;
+    int32_t singlestep;
+    char machine[32];
+    char cpu_model[32];
+} TBCacheKey;
+
+typedef struct TBCacheEntry {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t phys_pc;
+    uint64_t phys_page2;
+    uint64_t tc_ptr;            /* where the code was generated */
+    uint64_t tb;
+    uint32_t flags;
+    uint32_t cflags;            /* CF_LIVE or 0 */
+    uint32_t size;              /* guest code size */
+    uint32_t code_size;         /* host code size */
+    uint32_t nb_relocs;
+    uint16_t tb_next_offset[2]; /* direct jumps, reset when installed */
+    uint16_t tb_jmp_offset[4];
+} TBCacheEntry;
+
+/* an entry followed by its relocations, host code and guest code */
+typedef struct TBCacheItem {
+    TBCacheEntry e;
+    uint8_t *data;
+} TBCacheItem;
+
+static const char *tb_cache_filename;
+static TBCacheKey tb_cache_key;
+static TBCacheItem *tb_cache_items;
+static int tb_cache_nb_items;
+static int tb_cache_max_items;
+static int tb_cache_dirty;
+
+static int tb_cache_data_size(const TBCacheEntry *e)
+{
+    return e->nb_relocs * sizeof(TCGCodeReloc) + e->code_size + e->size;
+}
+
+/* whether the code page at 'addr' is ROM. Its TLB entry is valid right
+   after get_phys_addr_code(). */
+static int tb_cache_is_rom(CPUState *env, target_ulong addr)
+{
+    int mmu_idx, index;
+    target_phys_addr_t iotlb;
+
+    mmu_idx = cpu_mmu_index(env);
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    if (env->tlb_table[mmu_idx][index].addr_code != (addr & TARGET_PAGE_MASK))
+        return 0;
+    iotlb = env->iotlb[mmu_idx][index] + (addr & TARGET_PAGE_MASK);
+    return (iotlb & ~TARGET_PAGE_MASK) == IO_MEM_ROM;
+}
+
+/* copy the guest code of a block. phys_pc and phys_page2 are offsets
+   in the RAM blocks, like in the TranslationBlock. */
+static int tb_cache_guest_code(uint8_t *buf, const TBCacheEntry *e)
+{
+    int len;
+
+    len = TARGET_PAGE_SIZE - (e->phys_pc & ~TARGET_PAGE_MASK);
+    if (len > e->size)
+        len = e->size;
+    if (e->phys_pc + len > last_ram_offset)
+        return 0;
+    memcpy(buf, qemu_get_ram_ptr(e->phys_pc), len);
+    if (len < e->size) {
+        if (e->phys_page2 == (target_ulong)-1 ||
+            e->phys_page2 + e->size - len > last_ram_offset)
+            return 0;
+        memcpy(buf + len, qemu_get_ram_ptr(e->phys_page2), e->size - len);
+    }
+    return 1;
+}
+
+/* A Z80 ROM trap is compiled into the blocks that cover its pc, and
+   whether there is one depends on the command line.  Such blocks are
+   neither saved nor installed while a trap is set, so that the same
+   cache serves the runs with and without it. */
+static int tb_cache_covers_trap(CPUState *env, target_ulong pc, uint32_t size)
+{
+#if defined(TARGET_Z80)
+    return env->trap_fn != NULL && (target_ulong)(env->trap_pc - pc) < size;
+#else
+    return 0;
+#endif
+}
+
+static void tb_cache_add(const TBCacheEntry *e, uint8_t *data)
+{
+    if (tb_cache_nb_items >= tb_cache_max_items) {
+        tb_cache_max_items = tb_cache_max_items ? tb_cache_max_items * 2 : 256;
+        tb_cache_items = qemu_realloc(tb_cache_items, tb_cache_max_items *
+                                      sizeof(TBCacheItem));
+    }
+    tb_cache_items[tb_cache_nb_items].e = *e;
+    tb_cache_items[tb_cache_nb_items].data = data;
+    tb_cache_nb_items++;
+}
+
+/* remember a block translated from ROM */
+static void tb_cache_record(CPUState *env, TranslationBlock *tb,
+                            int code_size)
+{
+    TCGContext *s = &tcg_ctx;
+    TBCacheEntry e;
+    uint8_t *data;
+    int relocs_size;
+
+    if ((tb->cflags & ~CF_LIVE) != 0 || s->nb_code_relocs < 0 ||
+        tb_cache_covers_trap(env, tb->pc, tb->size))
+        return;
+#ifndef USE_DIRECT_JUMP
+    /* the jumps go through tb->tb_next[], which is not relocated */
+    if (tb->tb_next_offset[0] != 0xffff || tb->tb_next_offset[1] != 0xffff)
+        return;
+#endif
+    if (!tb_cache_is_rom(env, tb->pc) ||
+        (tb->page_addr[1] != -1 &&
+         !tb_cache_is_rom(env, tb->pc + tb->size - 1)))
+        return;
+
+    e.pc = tb->pc;
+    e.cs_base = tb->cs_base;
+    e.phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    e.phys_page2 = tb->page_addr[1];
+    e.tc_ptr = (unsigned long)tb->tc_ptr;
+    e.tb = (unsigned long)tb;
+    e.flags = tb->flags;
+    e.cflags = tb->cflags;
+    e.size = tb->size;
+    e.code_size = code_size;
+    e.nb_relocs = s->nb_code_relocs;
+    memcpy(e.tb_next_offset, tb->tb_next_offset, sizeof(e.tb_next_offset));
+    memset(e.tb_jmp_offset, 0xff, sizeof(e.tb_jmp_offset));
+#ifdef USE_DIRECT_JUMP
+    memcpy(e.tb_jmp_offset, tb->tb_jmp_offset, sizeof(e.tb_jmp_offset));
+#endif
+
+    relocs_size = e.nb_relocs * sizeof(TCGCodeReloc);
+    data = qemu_malloc(tb_cache_data_size(&e));
+    tb_cache_guest_code(data + relocs_size + code_size, &e);
+    memcpy(data, s->code_relocs, relocs_size);
+    memcpy(data + relocs_size, tb->tc_ptr, code_size);
+    tb_cache_add(&e, data);
+    tb_cache_dirty = 1;
+}
+
+/* copy a cached block into the code buffer. Return 0 if it is full. */
+static int tb_cache_install(const TBCacheItem *it)
+{
+    const TBCacheEntry *e = &it->e;
+    TranslationBlock *tb;
+    TCGCodeReloc *r;
+    uint8_t *code, *p;
+    long delta;
+    int i;
+
+    tb = tb_alloc(e->pc);
+    if (!tb)
+        return 0;
+    code = code_gen_ptr;
+    tb->tc_ptr = code;
+    tb->cs_base = e->cs_base;
+    tb->flags = e->flags;
+    tb->cflags = e->cflags;
+    tb->size = e->size;
+    memcpy(tb->tb_next_offset, e->tb_next_offset, sizeof(e->tb_next_offset));
+#ifdef USE_DIRECT_JUMP
+    memcpy(tb->tb_jmp_offset, e->tb_jmp_offset, sizeof(e->tb_jmp_offset));
+#endif
+
+    r = (TCGCodeReloc *)it->data;
+    memcpy(code, it->data + e->nb_relocs * sizeof(TCGCodeReloc), e->code_size);
+    delta = (long)code - (long)e->tc_ptr;
+    for (i = 0; i < e->nb_relocs; i++, r++) {
+        p = code + r->offset;
+        switch (r->type) {
+        case TCG_CODE_RELOC_PCREL32:
+            *(int32_t *)p -= delta;
+            break;
+        case TCG_CODE_RELOC_TB64:
+            *(uint64_t *)p += (unsigned long)tb - e->tb;
+            break;
+        }
+    }
+    flush_icache_range((unsigned long)code,
+                       (unsigned long)code + e->code_size);
+    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + e->code_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+
+    tb_link_phys(tb, e->phys_pc, e->phys_page2);
+    return 1;
+}
+
+/* the jump offsets are patched when the block is installed */
+static int tb_cache_jumps_valid(const TBCacheEntry *e)
+{
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        if (e->tb_next_offset[i] != 0xffff &&
+            e->tb_next_offset[i] >= e->code_size)
+            return 0;
+    }
+    for (i = 0; i < 4; i++) {
+        if (e->tb_jmp_offset[i] != 0xffff &&
+            e->tb_jmp_offset[i] + 4 > e->code_size)
+            return 0;
+    }
+    return 1;
+}
+
+static void tb_cache_load(void)
+{
+    TBCacheKey key;
+    TBCacheEntry e;
+    uint8_t *data, *guest;
+    uint32_t i, n;
+    int full, loaded;
+    FILE *f;
+
+    f = fopen(tb_cache_filename, "rb");
+    if (!f)
+        return;
+    /* anything we cannot use is replaced on exit */
+    tb_cache_dirty = 1;
+    if (fread(&key, sizeof(key), 1, f) != 1 ||
+        memcmp(&key, &tb_cache_key, sizeof(key)) != 0 ||
+        fread(&n, sizeof(n), 1, f) != 1)
+        goto done;
+
+    guest = qemu_malloc(2 * TARGET_PAGE_SIZE);
+    full = 0;
+    loaded = 0;
+    for (i = 0; i < n; i++) {
+        if (fread(&e, sizeof(e), 1, f) != 1 ||
+            e.size == 0 || e.size > 2 * TARGET_PAGE_SIZE ||
+            e.code_size > code_gen_max_block_size() ||
+            e.nb_relocs > TCG_MAX_CODE_RELOCS ||
+            !tb_cache_jumps_valid(&e))
+            break;
+        data = qemu_malloc(tb_cache_data_size(&e));
+        if (fread(data, tb_cache_data_size(&e), 1, f) != 1) {
+            qemu_free(data);
+            break;
+        }
+        /* the ROM has changed since the block was translated */
+        if (!tb_cache_guest_code(guest, &e) ||
+            memcmp(guest, data + tb_cache_data_size(&e) - e.size,
+                   e.size) != 0) {
+            qemu_free(data);
+            continue;
+        }
+        tb_cache_add(&e, data);
+        /* kept for the runs without the trap */
+        if (tb_cache_covers_trap(first_cpu, e.pc, e.size))
+            continue;
+        if (!full && !tb_cache_install(&tb_cache_items[tb_cache_nb_items - 1]))
+            full = 1;
+        else
+            loaded++;
+    }
+    qemu_free(guest);
+    if (i == n && loaded == n)
+        tb_cache_dirty = 0;
+ done:
+    fclose(f);
+}
+
+static int tb_cache_cmp(const void *p1, const void *p2)
+{
+    const TBCacheEntry *e1 = &((const TBCacheItem *)p1)->e;
+    const TBCacheEntry *e2 = &((const TBCacheItem *)p2)->e;
+
+    if (e1->phys_pc != e2->phys_pc)
+        return e1->phys_pc < e2->phys_pc ? -1 : 1;
+    if (e1->pc != e2->pc)
+        return e1->pc < e2->pc ? -1 : 1;
+    if (e1->flags != e2->flags)
+        return e1->flags < e2->flags ? -1 : 1;
+    if (e1->cs_base != e2->cs_base)
+        return e1->cs_base < e2->cs_base ? -1 : 1;
+    return 0;
+}
+
+static void tb_cache_save(void)
+{
+    char tmp_filename[1024];
+    uint32_t i, n;
+    FILE *f;
+
+    if (!tb_cache_dirty)
+        return;
+
+    /* blocks translated again after a flush are only kept once */
+    qsort(tb_cache_items, tb_cache_nb_items, sizeof(TBCacheItem),
+          tb_cache_cmp);
+    n = 0;
+    for (i = 0; i < tb_cache_nb_items; i++) {
+        if (n > 0 && tb_cache_cmp(&tb_cache_items[n - 1],
+                                  &tb_cache_items[i]) == 0) {
+            qemu_free(tb_cache_items[i].data);
+            continue;
+        }
+        tb_cache_items[n++] = tb_cache_items[i];
+    }
+    tb_cache_nb_items = n;
+
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.%d",
+             tb_cache_filename, (int)getpid());
+    f = fopen(tmp_filename, "wb");
+    if (!f)
+        return;
+    if (fwrite(&tb_cache_key, sizeof(tb_cache_key), 1, f) != 1 ||
+        fwrite(&n, sizeof(n), 1, f) != 1)
+        goto fail;
+    for (i = 0; i < n; i++) {
+        TBCacheItem *it = &tb_cache_items[i];
+        if (fwrite(&it->e, sizeof(it->e), 1, f) != 1 ||
+            fwrite(it->data, tb_cache_data_size(&it->e), 1, f) != 1)
+            goto fail;
+    }
+    if (fclose(f) != 0 || rename(tmp_filename, tb_cache_filename) != 0) {
+        unlink(tmp_filename);
+        return;
+    }
+    tb_cache_dirty = 0;
+    return;
+ fail:
+    fclose(f);
+    unlink(tmp_filename);
+}
+
+/* FNV-1a hash of the running binary */
+static int tb_cache_hash_exe(uint64_t *hash)
+{
+    uint8_t buf[65536];
+    uint64_t h;
+    size_t len, i;
+    FILE *f;
+
+    f = fopen("/proc/self/exe", "rb");
+    if (!f)
+        return 0;
+    h = 0xcbf29ce484222325ULL;
+    while ((len = fread(buf, 1, sizeof(buf), f)) > 0) {
+        for (i = 0; i < len; i++) {
+            h ^= buf[i];
+            h *= 0x100000001b3ULL;
+        }
+    }
+    fclose(f);
+    *hash = h;
+    return 1;
+}
+
+void tb_cache_init(const char *filename, const char *machine,
+                   const char *cpu_model)
+{
+    TBCacheKey *key = &tb_cache_key;
+
+    memset(key, 0, sizeof(*key));
+    key->magic = TB_CACHE_MAGIC;
+    if (!tb_cache_hash_exe(&key->exe_hash)) {
+        fprintf(stderr, "qemu: cannot read the QEMU binary, "
+                "translation cache disabled\n");
+        return;
+    }
+    key->text_addr = (unsigned long)tb_cache_init;
+    key->prologue_addr = (unsigned long)code_gen_prologue;
+    key->use_icount = use_icount;
+    key->singlestep = singlestep;
+    pstrcpy(key->machine, sizeof(key->machine), machine);
+    pstrcpy(key->cpu_model, sizeof(key->cpu_model),
+            cpu_model ? cpu_model : "");
+
+    tb_cache_filename = filename;
+    tb_cache_load();
+    atexit(tb_cache_save);
+}
+#else
+void tb_cache_init(const char *filename, const char *machine,
+                   const char *cpu_model)
+{
+    fprintf(stderr, "qemu: translation cache not supported on this host\n");
+}
+#endif
+
 TranslationBlock *tb_gen_code(CPUState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
@@ -874,6 +1383,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
     int code_gen_size;
 
     phys_pc = get_phys_addr_code(env, pc);
+#ifdef TARGET_HAS_SMC_OPERANDS
+    cflags |= smc_page_cflags(phys_pc);
+    smc_clock++;
+#endif
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
@@ -898,6 +1411,10 @@ TranslationBlock *tb_gen_code(CPUState *env,
         phys_page2 = get_phys_addr_code(env, virt_page2);
     }
     tb_link_phys(tb, phys_pc, phys_page2);
+#ifdef USE_TB_CACHE
+    if (tb_cache_filename)
+        tb_cache_record(env, tb, code_gen_size);
+#endif
     return tb;
 }
 
@@ -914,6 +1431,9 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
     target_ulong tb_start, tb_end;
     PageDesc *p;
     int n;
+#ifdef TARGET_HAS_SMC_OPERANDS
+    int invalidated = 0;
+#endif
 #ifdef TARGET_HAS_PRECISE_SMC
     int current_tb_not_found = is_cpu_write_access;
     TranslationBlock *current_tb = NULL;
@@ -927,8 +1447,11 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
     if (!p)
         return;
     if (!p->code_bitmap &&
-        ++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD &&
-        is_cpu_write_access) {
+        (++p->code_write_count >= SMC_BITMAP_USE_THRESHOLD
+#ifdef TARGET_HAS_SMC_OPERANDS
+         || p->smc_hot
+#endif
+         ) && is_cpu_write_access) {
         /* build code bitmap */
         build_page_bitmap(p);
     }
@@ -951,6 +1474,16 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
             tb_end = tb_start + ((tb->pc + tb->size) & ~TARGET_PAGE_MASK);
         }
         if (!(tb_end <= start || tb_start >= end)) {
+#ifdef TARGET_HAS_SMC_OPERANDS
+            if (n == 0 &&
+                tb_smc_operands_only(tb, tb_start, tb_end, start, end)) {
+                smc_avoided_count++;
+                p->smc_stamp = smc_clock;
+                tb = tb_next;
+                continue;
+            }
+            invalidated = 1;
+#endif
 #ifdef TARGET_HAS_PRECISE_SMC
             if (current_tb_not_found) {
                 current_tb_not_found = 0;
@@ -991,6 +1524,10 @@ void tb_invalidate_phys_page_range(target_phys_addr_t start, target_phys_addr_t
         }
         tb = tb_next;
     }
+#ifdef TARGET_HAS_SMC_OPERANDS
+    if (invalidated && is_cpu_write_access)
+        smc_page_invalidated(p);
+#endif
 #if !defined(CONFIG_USER_ONLY)
     /* if no code remaining, no need to continue to use slow writes */
     if (!p->first_tb) {
@@ -1033,12 +1570,40 @@ static inline void tb_invalidate_phys_page_fast(target_phys_addr_t start, int le
         b = p->code_bitmap[offset >> 3] >> (offset & 7);
         if (b & ((1 << len) - 1))
             goto do_invalidate;
+#ifdef TARGET_HAS_SMC_OPERANDS
+        if (p->operand_bitmap &&
+            ((p->operand_bitmap[offset >> 3] >> (offset & 7)) &
+             ((1 << len) - 1))) {
+            smc_avoided_count++;
+            p->smc_stamp = smc_clock;
+        }
+#endif
     } else {
     do_invalidate:
+#if defined(TARGET_Z80)
+        if (unlikely(z80_prof_active)) {
+            cpu_z80_prof_smc(cpu_single_env);
+        }
+#endif
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
 }
 
+#if !defined(CONFIG_USER_ONLY)
+/* the code write check of a RAM write, for the write handlers of
+   devices that watch RAM through an IO_MEM_ROMD region */
+void tb_invalidate_phys_write(ram_addr_t ram_addr, int len)
+{
+    if (cpu_physical_memory_get_dirty(ram_addr, CODE_DIRTY_FLAG))
+        return;
+    if (cpu_single_env) {
+        tb_invalidate_phys_page_fast(ram_addr, len);
+    } else {
+        tb_invalidate_phys_page_range(ram_addr, ram_addr + len, 0);
+    }
+}
+#endif
+
 #if !defined(CONFIG_SOFTMMU)
 static void tb_invalidate_phys_page(target_phys_addr_t addr,
                                     unsigned long pc, void *puc)
@@ -1167,6 +1732,9 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+#ifdef TARGET_HAS_SMC_OPERANDS
+    tb->smc_operands = 0;
+#endif
     return tb;
 }
 
@@ -1544,6 +2112,11 @@ void cpu_interrupt(CPUState *env, int mask)
 
     old_mask = env->interrupt_request;
     env->interrupt_request |= mask;
+#if defined(TARGET_Z80)
+    /* loop regions jump back inside their TB, and only leave it when a
+       cycle timer is due */
+    env->tstate_deadline = 0;
+#endif
 
 #ifndef CONFIG_USER_ONLY
     /*
@@ -1577,6 +2150,9 @@ void cpu_reset_interrupt(CPUState *env, int mask)
 void cpu_exit(CPUState *env)
 {
     env->exit_request = 1;
+#if defined(TARGET_Z80)
+    env->tstate_deadline = 0;
+#endif
     cpu_unlink_tb(env);
 }
 
@@ -3752,6 +4328,11 @@ void dump_exec_info(FILE *f,
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+#ifdef TARGET_HAS_SMC_OPERANDS
+    /* writes to code that only changed operands of CF_SMC blocks */
+    cpu_fprintf(f, "SMC hot pages       %d\n", smc_hot_pages);
+    cpu_fprintf(f, "SMC avoided count   %d\n", smc_avoided_count);
+#endif
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
@@ -1345,7 +1345,7 @@ static int cpu_gdb_write_register(CPUState *env, uint8_t *mem_buf, int n)
       case R_AX:
       case R_FX:
           // printf("%d | writereg8\n", n);
-          env->regs[n]=tmp;
+          env->regs[n]=tmp & 0xff;
           return 1;
       case R_PC:
           // printf("%s about to change PC: %x -> %x \n", __PRETTY_FUNCTION__, env->pc, tmp);
@@ -1353,7 +1353,7 @@ static int cpu_gdb_write_register(CPUState *env, uint8_t *mem_buf, int n)
           return 2;
       default:
           // printf("%d | writereg16\n", n);
-          env->regs[n]=tmp;
+          env->regs[n]=tmp & 0xffff;
           return 2; // es 2
       }
 }
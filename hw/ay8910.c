@@ -0,0 +1,397 @@
+/*
+ * General Instrument AY-3-8910/8912 and Yamaha YM2149 PSG emulation
+ *
+ * This code is licensed under the GPL version 2
+ */
+#include "hw.h"
+#include "audio/audio.h"
+#include "ay8910.h"
+
+/* Nothing is generated when a register is written.  The audio callback
+   renders the whole block it asks for from the current registers, so the
+   cost does not depend on how often the guest writes to the chip.
+
+   The generators are stepped at clock / 8, which is the rate of the tone
+   counters; the noise and envelope counters run at half that rate.  Each
+   output sample is the average of the chip output over the time it
+   covers, which keeps the high tones from aliasing into the audible
+   range. */
+
+#define AY_SAMPLE_RATE 44100
+#define AY_BUF_SAMPLES 512
+
+enum {
+    AY_TONE_A_LO,
+    AY_TONE_A_HI,
+    AY_TONE_B_LO,
+    AY_TONE_B_HI,
+    AY_TONE_C_LO,
+    AY_TONE_C_HI,
+    AY_NOISE,
+    AY_ENABLE,
+    AY_AMP_A,
+    AY_AMP_B,
+    AY_AMP_C,
+    AY_ENV_LO,
+    AY_ENV_HI,
+    AY_ENV_SHAPE,
+    AY_PORT_A,
+    AY_PORT_B,
+};
+
+/* bits that exist in each register */
+static const uint8_t ay_reg_mask[16] = {
+    0xff, 0x0f, 0xff, 0x0f, 0xff, 0x0f, 0x1f, 0xff,
+    0x1f, 0x1f, 0x1f, 0xff, 0xff, 0x0f, 0xff, 0xff,
+};
+
+/* the DAC is logarithmic, about 3 dB per step; a third of the 16-bit
+   range per channel */
+static const uint16_t ay_volume[16] = {
+    0, 150, 224, 318, 462, 675, 925, 1495,
+    1847, 2891, 3852, 4914, 6230, 7507, 9264, 10922,
+};
+
+typedef struct {
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+    ay8910_port_read_fn port_read;
+    ay8910_port_write_fn port_write;
+    void *opaque;
+
+    uint8_t reg;
+    uint8_t regs[16];
+
+    /* periods in clock / 8 ticks, never 0 */
+    uint32_t tone_period[3];
+    uint32_t noise_period;
+    uint32_t env_period;
+
+    uint32_t tone_count[3];
+    uint8_t tone_out[3];
+    uint32_t noise_count;
+    uint32_t noise_rng;
+    uint8_t noise_out;
+    uint32_t env_count;
+    int env_step;
+    uint8_t env_attack;
+    uint8_t env_hold;
+    uint8_t env_alternate;
+    uint8_t env_holding;
+
+    /* length of an output sample in 1/65536 ticks, and how much of the
+       current tick has been rendered already */
+    uint32_t tick_step;
+    uint32_t tick_frac;
+
+    int16_t buf[AY_BUF_SAMPLES];
+} AY8910State;
+
+static void ay_update_periods(AY8910State *s)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        s->tone_period[i] = s->regs[AY_TONE_A_LO + 2 * i] |
+                            (s->regs[AY_TONE_A_HI + 2 * i] << 8);
+        if (s->tone_period[i] == 0) {
+            s->tone_period[i] = 1;
+        }
+    }
+    s->noise_period = s->regs[AY_NOISE] ? s->regs[AY_NOISE] * 2 : 2;
+    s->env_period = (s->regs[AY_ENV_LO] | (s->regs[AY_ENV_HI] << 8)) * 2;
+    if (s->env_period == 0) {
+        s->env_period = 2;
+    }
+}
+
+/* shapes 0-7 fall to 0 and stay there, which is the same as holding with
+   the direction flipped back to falling */
+static void ay_env_restart(AY8910State *s)
+{
+    uint8_t shape = s->regs[AY_ENV_SHAPE];
+
+    s->env_attack = (shape & 0x04) ? 0x0f : 0;
+    if (shape & 0x08) {
+        s->env_hold = shape & 0x01;
+        s->env_alternate = shape & 0x02;
+    } else {
+        s->env_hold = 1;
+        s->env_alternate = s->env_attack;
+    }
+    s->env_step = 0x0f;
+    s->env_count = 0;
+    s->env_holding = 0;
+}
+
+static inline void ay_tick(AY8910State *s)
+{
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        if (++s->tone_count[i] >= s->tone_period[i]) {
+            s->tone_count[i] = 0;
+            s->tone_out[i] ^= 1;
+        }
+    }
+
+    if (++s->noise_count >= s->noise_period) {
+        s->noise_count = 0;
+        /* 17-bit LFSR */
+        s->noise_rng = (s->noise_rng >> 1) |
+                       (((s->noise_rng ^ (s->noise_rng >> 3)) & 1) << 16);
+        s->noise_out = s->noise_rng & 1;
+    }
+
+    if (!s->env_holding && ++s->env_count >= s->env_period) {
+        s->env_count = 0;
+        if (--s->env_step < 0) {
+            if (s->env_hold) {
+                if (s->env_alternate) {
+                    s->env_attack ^= 0x0f;
+                }
+                s->env_holding = 1;
+                s->env_step = 0;
+            } else {
+                if (s->env_alternate) {
+                    s->env_attack ^= 0x0f;
+                }
+                s->env_step = 0x0f;
+            }
+        }
+    }
+}
+
+static inline int ay_level(AY8910State *s)
+{
+    uint8_t enable = s->regs[AY_ENABLE];
+    int i, level = 0;
+    uint8_t amp;
+
+    for (i = 0; i < 3; i++) {
+        /* the enable bits are active low, a disabled source reads as 1 */
+        if ((s->tone_out[i] | (enable >> i)) &
+            (s->noise_out | (enable >> (i + 3))) & 1) {
+            amp = s->regs[AY_AMP_A + i];
+            if (amp & 0x10) {
+                amp = s->env_step ^ s->env_attack;
+            }
+            level += ay_volume[amp & 0x0f];
+        }
+    }
+    return level;
+}
+
+/* no channel can be heard; the generators are left where they are */
+static inline int ay_silent(AY8910State *s)
+{
+    return !s->regs[AY_AMP_A] && !s->regs[AY_AMP_B] && !s->regs[AY_AMP_C];
+}
+
+static void ay_render(AY8910State *s, int16_t *buf, int samples)
+{
+    uint32_t left, part;
+    uint64_t acc;
+    int i;
+
+    if (ay_silent(s)) {
+        memset(buf, 0, samples * sizeof(*buf));
+        return;
+    }
+
+    for (i = 0; i < samples; i++) {
+        acc = 0;
+        left = s->tick_step;
+        while (left) {
+            part = 0x10000 - s->tick_frac;
+            if (part > left) {
+                part = left;
+            }
+            acc += (uint64_t)ay_level(s) * part;
+            left -= part;
+            s->tick_frac += part;
+            if (s->tick_frac == 0x10000) {
+                s->tick_frac = 0;
+                ay_tick(s);
+            }
+        }
+        buf[i] = acc / s->tick_step;
+    }
+}
+
+static void ay_callback(void *opaque, int free)
+{
+    AY8910State *s = opaque;
+    int samples, n;
+
+    samples = free / sizeof(int16_t);
+    while (samples > 0) {
+        n = audio_MIN(samples, AY_BUF_SAMPLES);
+        ay_render(s, s->buf, n);
+        n = AUD_write(s->voice, s->buf, n * sizeof(int16_t)) /
+            sizeof(int16_t);
+        if (!n) {
+            break;
+        }
+        samples -= n;
+    }
+}
+
+/* port A is register 14 and is an output when enable bit 6 is set; port
+   B is register 15 and bit 7 */
+static inline int ay_port_output(AY8910State *s, int port)
+{
+    return s->regs[AY_ENABLE] & (0x40 << port);
+}
+
+uint32_t ay8910_read(void *opaque, uint32_t addr)
+{
+    AY8910State *s = opaque;
+    int port;
+
+    if (addr != 2) {
+        return 0xff;
+    }
+    switch (s->reg) {
+    case AY_PORT_A:
+    case AY_PORT_B:
+        port = s->reg - AY_PORT_A;
+        if (!ay_port_output(s, port)) {
+            return s->port_read ? s->port_read(s->opaque, port) : 0xff;
+        }
+        return s->regs[s->reg];
+    default:
+        return s->regs[s->reg];
+    }
+}
+
+void ay8910_write(void *opaque, uint32_t addr, uint32_t value)
+{
+    AY8910State *s = opaque;
+    uint8_t old;
+    int port;
+
+    switch (addr) {
+    case 0:
+        s->reg = value & 0x0f;
+        break;
+    case 1:
+        old = s->regs[s->reg];
+        s->regs[s->reg] = value & ay_reg_mask[s->reg];
+        switch (s->reg) {
+        case AY_TONE_A_LO ... AY_NOISE:
+        case AY_ENV_LO:
+        case AY_ENV_HI:
+            ay_update_periods(s);
+            break;
+        case AY_ENABLE:
+            for (port = 0; port < 2 && s->port_write; port++) {
+                if (ay_port_output(s, port) && !(old & (0x40 << port))) {
+                    s->port_write(s->opaque, port,
+                                  s->regs[AY_PORT_A + port]);
+                }
+            }
+            break;
+        case AY_ENV_SHAPE:
+            /* writing the shape restarts the envelope, even unchanged */
+            ay_env_restart(s);
+            break;
+        case AY_PORT_A:
+        case AY_PORT_B:
+            port = s->reg - AY_PORT_A;
+            if (ay_port_output(s, port) && s->port_write) {
+                s->port_write(s->opaque, port, s->regs[s->reg]);
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void ay8910_reset(void *opaque)
+{
+    AY8910State *s = opaque;
+    int i;
+
+    s->reg = 0;
+    memset(s->regs, 0, sizeof(s->regs));
+    ay_update_periods(s);
+    for (i = 0; i < 3; i++) {
+        s->tone_count[i] = 0;
+        s->tone_out[i] = 0;
+    }
+    s->noise_count = 0;
+    s->noise_rng = 1;
+    s->noise_out = 0;
+    ay_env_restart(s);
+    s->tick_frac = 0;
+}
+
+/* the generator phases are not saved; they cannot be told apart after a
+   few samples */
+static void ay_save(QEMUFile *f, void *opaque)
+{
+    AY8910State *s = opaque;
+
+    qemu_put_8s(f, &s->reg);
+    qemu_put_buffer(f, s->regs, sizeof(s->regs));
+    qemu_put_sbe32(f, s->env_step);
+    qemu_put_8s(f, &s->env_attack);
+    qemu_put_8s(f, &s->env_holding);
+}
+
+static int ay_load(QEMUFile *f, void *opaque, int version_id)
+{
+    AY8910State *s = opaque;
+    int port;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+    qemu_get_8s(f, &s->reg);
+    qemu_get_buffer(f, s->regs, sizeof(s->regs));
+    ay_update_periods(s);
+    ay_env_restart(s);
+    s->env_step = qemu_get_sbe32(f) & 0x0f;
+    qemu_get_8s(f, &s->env_attack);
+    qemu_get_8s(f, &s->env_holding);
+
+    /* the board state driven by the ports follows the registers */
+    for (port = 0; port < 2 && s->port_write; port++) {
+        if (ay_port_output(s, port)) {
+            s->port_write(s->opaque, port, s->regs[AY_PORT_A + port]);
+        }
+    }
+    return 0;
+}
+
+void *ay8910_init(const char *name, uint32_t clock,
+                  ay8910_port_read_fn port_read,
+                  ay8910_port_write_fn port_write, void *opaque)
+{
+    AY8910State *s = qemu_mallocz(sizeof(*s));
+    struct audsettings as = {AY_SAMPLE_RATE, 1, AUD_FMT_S16,
+                             AUDIO_HOST_ENDIANNESS};
+
+    s->port_read = port_read;
+    s->port_write = port_write;
+    s->opaque = opaque;
+    s->tick_step = muldiv64(clock / 8, 0x10000, AY_SAMPLE_RATE);
+
+    AUD_register_card(name, &s->card);
+    s->voice = AUD_open_out(&s->card, s->voice, name, s, ay_callback, &as);
+    if (!s->voice) {
+        AUD_log(name, "Could not open voice\n");
+    } else {
+        AUD_set_active_out(s->voice, 1);
+    }
+
+    ay8910_reset(s);
+    qemu_register_reset(ay8910_reset, 0, s);
+    register_savevm(name, 0, 1, ay_save, ay_load, s);
+    return s;
+}
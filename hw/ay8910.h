@@ -0,0 +1,20 @@
+#ifndef HW_AY8910_H
+#define HW_AY8910_H
+/* General Instrument AY-3-8910/8912 and Yamaha YM2149 PSG */
+
+/* Called for register 14 (port A, port = 0) and 15 (port B, port = 1).
+   port_read is used while the port is an input; port_write whenever the
+   port is an output and its register is written, or the port is turned
+   into an output. */
+typedef uint32_t (*ay8910_port_read_fn)(void *opaque, int port);
+typedef void (*ay8910_port_write_fn)(void *opaque, int port, uint32_t value);
+
+void *ay8910_init(const char *name, uint32_t clock,
+                  ay8910_port_read_fn port_read,
+                  ay8910_port_write_fn port_write, void *opaque);
+void ay8910_reset(void *opaque);
+/* addr 0 latches the register number, 1 writes it and 2 reads it */
+uint32_t ay8910_read(void *opaque, uint32_t addr);
+void ay8910_write(void *opaque, uint32_t addr, uint32_t value);
+
+#endif
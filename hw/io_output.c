@@ -0,0 +1,261 @@
+/*
+ * OUT instruction logging
+ *
+ * This code is licensed under the GPL version 2
+ */
+#include "hw.h"
+#include "qemu-timer.h"
+#include "io_output.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+/* An OUT only touches memory.  The port table is written to its file by
+   a timer when it changed, and the log records go to a ring that a
+   thread empties into the log file, so the CPU never waits for the disk
+   unless the ring fills up.  Both files are brought up to date at exit.
+
+   The log starts with an 8-byte header, "Z80OUT" and the format version
+   as a 16-bit little-endian number, followed by 16-byte records:
+
+       0   T-state of the OUT, 64 bits
+       8   PC of the OUT, 16 bits
+      10   port, 16 bits
+      12   value, 8 bits
+      13   reserved, 3 bytes of 0
+
+   all little-endian. */
+
+#define OUTLOG_VERSION  1
+#define OUTLOG_REC_SIZE 16
+#define OUTLOG_RING     65536           /* records, a power of two */
+#define OUTLOG_BATCH    1024            /* records per fwrite */
+#define PORTS_FLUSH_MS  100
+
+typedef struct {
+    uint64_t tstates;
+    uint16_t pc;
+    uint16_t port;
+    uint8_t value;
+} OutLogRecord;
+
+typedef struct {
+    uint8_t ports[256];
+    const char *ports_file;
+    int ports_dirty;
+    QEMUTimer *ports_timer;
+
+    FILE *log;
+    OutLogRecord ring[OUTLOG_RING];
+    /* head is only written by the CPU, tail by the writer */
+    volatile unsigned int head;
+    volatile unsigned int tail;
+#ifndef _WIN32
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t more;        /* the ring is half full, or exit */
+    pthread_cond_t space;       /* the writer made room */
+    int quit;
+#endif
+    uint8_t buf[OUTLOG_BATCH * OUTLOG_REC_SIZE];
+} IOOutputState;
+
+static IOOutputState io_output;
+
+static void ports_flush(IOOutputState *s)
+{
+    FILE *f;
+    int p;
+
+    s->ports_dirty = 0;
+    f = fopen(s->ports_file, "w+");
+    if (!f) {
+        fprintf(stderr, "ERROR at %s: failed to open file %s for writing.\n", __PRETTY_FUNCTION__, s->ports_file);
+        perror(__PRETTY_FUNCTION__);
+        return;
+    }
+    for (p = 0; p < 256; p++) {
+        fprintf(f, "OUT Port 0x%02X:   0x%02X\r\n", p, s->ports[p]);
+    }
+    fclose(f);
+}
+
+static void ports_timer_cb(void *opaque)
+{
+    IOOutputState *s = opaque;
+
+    if (s->ports_dirty) {
+        ports_flush(s);
+    }
+    qemu_mod_timer(s->ports_timer, qemu_get_clock(rt_clock) + PORTS_FLUSH_MS);
+}
+
+/* write out the records from tail to head: from the writer thread, or
+   from the CPU on hosts without threads */
+static void outlog_drain(IOOutputState *s)
+{
+    unsigned int head = s->head, tail = s->tail;
+    OutLogRecord *r;
+    uint8_t *p;
+    int n;
+
+    while (tail != head) {
+        p = s->buf;
+        for (n = 0; n < OUTLOG_BATCH && tail != head; n++, tail++) {
+            r = &s->ring[tail % OUTLOG_RING];
+            stq_le_p(p, r->tstates);
+            stw_le_p(p + 8, r->pc);
+            stw_le_p(p + 10, r->port);
+            p[12] = r->value;
+            p[13] = p[14] = p[15] = 0;
+            p += OUTLOG_REC_SIZE;
+        }
+        fwrite(s->buf, OUTLOG_REC_SIZE, n, s->log);
+        /* the records must be read before the room is handed back */
+        __sync_synchronize();
+        s->tail = tail;
+#ifndef _WIN32
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->space);
+        pthread_mutex_unlock(&s->lock);
+#endif
+    }
+    fflush(s->log);
+}
+
+#ifndef _WIN32
+static void *outlog_thread(void *opaque)
+{
+    IOOutputState *s = opaque;
+    struct timespec ts;
+    sigset_t set;
+    int quit;
+
+    /* the signals are meant for the main thread */
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&s->lock);
+        if (s->head - s->tail < OUTLOG_RING / 2 && !s->quit) {
+            /* a quiet guest still gets its log written every 100 ms */
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_nsec += 100000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_nsec -= 1000000000;
+                ts.tv_sec++;
+            }
+            pthread_cond_timedwait(&s->more, &s->lock, &ts);
+        }
+        quit = s->quit;
+        pthread_mutex_unlock(&s->lock);
+        outlog_drain(s);
+        if (quit) {
+            return NULL;
+        }
+    }
+}
+#endif
+
+static void outlog_put(IOOutputState *s, uint32_t pc, uint32_t port,
+                       uint32_t value)
+{
+    unsigned int head = s->head;
+    OutLogRecord *r;
+
+    if (head - s->tail == OUTLOG_RING) {
+#ifndef _WIN32
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->more);
+        while (head - s->tail == OUTLOG_RING) {
+            pthread_cond_wait(&s->space, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+#else
+        outlog_drain(s);
+#endif
+    }
+    r = &s->ring[head % OUTLOG_RING];
+    r->tstates = first_cpu->tstates;
+    r->pc = pc;
+    r->port = port;
+    r->value = value;
+    /* the record must be complete before the writer can see it */
+    __sync_synchronize();
+    s->head = head + 1;
+#ifndef _WIN32
+    if (head + 1 - s->tail == OUTLOG_RING / 2) {
+        pthread_mutex_lock(&s->lock);
+        pthread_cond_signal(&s->more);
+        pthread_mutex_unlock(&s->lock);
+    }
+#endif
+}
+
+void io_output_write(uint32_t pc, uint32_t port, uint32_t value)
+{
+    IOOutputState *s = &io_output;
+
+    if (s->ports_file && s->ports[port & 0xff] != (uint8_t)value) {
+        s->ports[port & 0xff] = value;
+        s->ports_dirty = 1;
+    }
+    if (s->log) {
+        outlog_put(s, pc, port, value);
+    }
+}
+
+static void io_output_cleanup(void)
+{
+    IOOutputState *s = &io_output;
+
+    if (s->ports_file) {
+        ports_flush(s);
+    }
+    if (s->log) {
+#ifndef _WIN32
+        pthread_mutex_lock(&s->lock);
+        s->quit = 1;
+        pthread_cond_signal(&s->more);
+        pthread_mutex_unlock(&s->lock);
+        pthread_join(s->thread, NULL);
+#else
+        outlog_drain(s);
+#endif
+        fclose(s->log);
+    }
+}
+
+void io_output_init(const char *ports_file, const char *log_file)
+{
+    IOOutputState *s = &io_output;
+    static const uint8_t header[8] = {
+        'Z', '8', '0', 'O', 'U', 'T', OUTLOG_VERSION, 0
+    };
+
+    if (ports_file) {
+        s->ports_file = ports_file;
+        ports_flush(s);
+        s->ports_timer = qemu_new_timer(rt_clock, ports_timer_cb, s);
+        qemu_mod_timer(s->ports_timer,
+                       qemu_get_clock(rt_clock) + PORTS_FLUSH_MS);
+    }
+    if (log_file) {
+        s->log = fopen(log_file, "wb");
+        if (!s->log) {
+            fprintf(stderr, "ERROR at %s: failed to open file %s for writing.\n", __PRETTY_FUNCTION__, log_file);
+            perror(__PRETTY_FUNCTION__);
+        } else {
+            fwrite(header, 1, sizeof(header), s->log);
+#ifndef _WIN32
+            pthread_mutex_init(&s->lock, NULL);
+            pthread_cond_init(&s->more, NULL);
+            pthread_cond_init(&s->space, NULL);
+            pthread_create(&s->thread, NULL, outlog_thread, s);
+#endif
+        }
+    }
+    atexit(io_output_cleanup);
+}
@@ -0,0 +1,11 @@
+#ifndef HW_IO_OUTPUT_H
+#define HW_IO_OUTPUT_H
+/* OUT instructions to files, for test harnesses */
+
+/* ports_file gets the last value written to each port, rewritten from
+   time to time and at exit; log_file gets every OUT, in the binary
+   format read by z80-outlog.pl.  Either may be NULL. */
+void io_output_init(const char *ports_file, const char *log_file);
+void io_output_write(uint32_t pc, uint32_t port, uint32_t value);
+
+#endif
@@ -12,6 +12,10 @@
 #include "isa.h"
 #include "console.h"
 #include "msx.h"
+#include "ay8910.h"
+
+/* the PSG is clocked at half the CPU clock */
+#define MSX_PSG_CLOCK 1789772
 
 typedef struct {
     void *mmu;
@@ -274,6 +278,25 @@ static void ppi_reset(void *opaque)
     memset(s->keystate, 0xff, sizeof(s->keystate));
 }
 
+/* keystate follows the host keyboard and is not saved */
+static void ppi_save(QEMUFile *f, void *opaque)
+{
+    PPIState *s = (PPIState *)opaque;
+    qemu_put_buffer(f, s->port, sizeof(s->port));
+    qemu_put_8s(f, &s->control);
+}
+
+static int ppi_load(QEMUFile *f, void *opaque, int version_id)
+{
+    PPIState *s = (PPIState *)opaque;
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, s->port, sizeof(s->port));
+    qemu_get_8s(f, &s->control);
+    return 0;
+}
+
 static void *ppi_init(void *mmu, void *vdp)
 {
     PPIState *s = qemu_mallocz(sizeof(*s));
@@ -281,178 +304,43 @@ static void *ppi_init(void *mmu, void *vdp)
     s->vdp = vdp;
     ppi_reset(s);
     qemu_add_kbd_event_handler(ppi_key_event, s);
+    register_savevm("msx_ppi", 0, 1, ppi_save, ppi_load, s);
     return s;
 }
 
 typedef struct {
-    uint8_t reg;
+    CPUState *cpu;
+    qemu_irq *irq;
+    void *mmu;
+    void *vdp;
+    void *ppi;
+    void *psg;
 
-    uint8_t enable;
-    
-    struct {
-        int period;
-        int amplitude;
-        int fixed_amp;
-    } tone[3];
-    int noise_period;
-    int envelope_period;
-    int envelope_shape;
-    
+    /* joystick port selected by PSG port B, and the state of the two
+       joystick ports */
     uint8_t stick;
     uint8_t stickstate[2];
-} PSGState;
-
-static uint32_t psg_read(void *opaque, uint32_t addr)
-{
-    uint32_t result = 0xff;
-    if (addr == 2) {
-        PSGState *s = (PSGState *)opaque;
-        switch (s->reg) {
-            case 0 ... 5: /* tone generator control */
-                if (s->reg & 1) {
-                    result = s->tone[s->reg >> 1].period >> 8;
-                } else {
-                    result = s->tone[s->reg >> 1].period & 0xff;
-                }
-                break;
-            case 6: /* noise generator control */
-                result = s->noise_period;
-                break;
-            case 7: /* mixer control / io enable */
-                result = s->enable;
-                break;
-            case 8 ... 10: /* amplitude control */
-                result = (s->tone[s->reg - 8].fixed_amp ? 0 : 0x10) |
-                         s->tone[s->reg - 8].amplitude;
-                break;
-            case 11: /* envelope period control lsb */
-                result = s->envelope_period & 0xff;
-                break;
-            case 12: /* envelope period control msb */
-                result = s->envelope_period >> 8;
-                break;
-            case 13: /* envelope shape/cycle control */
-                result = s->envelope_shape;
-                break;
-            case 14: /* io port a */
-                if (s->enable & 0x40) {
-                    /* TODO: io port a input mode operation */
-                } else {
-                    result = s->stickstate[s->stick] & 0x3f;
-                }
-                break;
-            case 15: /* io port b */
-                if (s->enable & 0x80) {
-                    result = (s->stick << 6) | 0x8f;
-                } else {
-                    /* TODO: io port b output mode operation */
-                }
-                break;
-            default:
-                break;
-        }
-    }
-    return result;
-}
+} MSXState;
 
-static void psg_write(void *opaque, uint32_t addr, uint32_t value)
+/* stickstate follows the host joystick and is not saved; the PSG
+   restores stick through its port B */
+static uint32_t msx_psg_port_read(void *opaque, int port)
 {
-    PSGState *s = (PSGState *)opaque;
-    switch (addr) {
-        case 0:
-            s->reg = value & 0x0f;
-            break;
-        case 1:
-            switch (s->reg) {
-                case 0 ... 5: /* tone generator control */
-                    {
-                        int n = s->reg >> 1;
-                        int p = s->tone[n].period;
-                        if (s->reg & 1) {
-                            p = (p & 0xff) | ((value & 0x0f) << 8);
-                        } else {
-                            p = (p & ~0xff) | value;
-                        }
-                        s->tone[n].period = p;
-                    }
-                    break;
-                case 6: /* noise generator control */
-                    s->noise_period = value & 0x1f;
-                    break;
-                case 7: /* mixer control / io enable */
-                    s->enable = value;
-                    break;
-                case 8 ... 10: /* amplitude control */
-                    s->tone[s->reg - 8].fixed_amp = !(value & 0x10);
-                    s->tone[s->reg - 8].amplitude = value & 0x0f;
-                    break;
-                case 11: /* envelope period control lsb */
-                    s->envelope_period = (s->envelope_period & ~0xff) | value;
-                    break;
-                case 12: /* envelope period control msb */
-                    s->envelope_period = (s->envelope_period & 0xff) | (value << 8);
-                    break;
-                case 13: /* envelope shape/cycle control */
-                    s->envelope_shape = value & 0x0f;
-                    break;
-                case 14: /* io port a */
-                    if (s->enable & 0x40) {
-                        /* TODO: io port a input mode operation */
-                    } else {
-                        /* TODO: io port a output mode operation */
-                    }
-                    break;
-                case 15: /* io port b */
-                    if (s->enable & 0x80) {
-                        s->stick = (value >> 6) & 1;
-                    } else {
-                        /* TODO: io port b output mode operation */
-                    }
-                    break;
-                default:
-                    break;
-            }
-            break;
-        default:
-            break;
+    MSXState *s = (MSXState *)opaque;
+    if (port == 0) {
+        return s->stickstate[s->stick] & 0x3f;
     }
+    return 0xff;
 }
 
-static void psg_reset(void *opaque)
+static void msx_psg_port_write(void *opaque, int port, uint32_t value)
 {
-    PSGState *s = (PSGState *)opaque;
-    s->enable = 0xbd;
-    int i;
-    for (i = 0; i < 3; i++) {
-        s->tone[i].period = 0;
-        s->tone[i].amplitude = 0;
-        s->tone[i].fixed_amp = 0;
+    MSXState *s = (MSXState *)opaque;
+    if (port == 1) {
+        s->stick = (value >> 6) & 1;
     }
-    s->noise_period = 0;
-    s->envelope_period = 0;
-    s->envelope_shape = 0;
-    
-    s->stick = 0;
-    s->stickstate[0] = 0x3f;
-    s->stickstate[1] = 0x3f;
 }
 
-static void *psg_init(void)
-{
-    PSGState *s = qemu_mallocz(sizeof(*s));
-    psg_reset(s);
-    return s;
-}
-
-typedef struct {
-    CPUState *cpu;
-    qemu_irq *irq;
-    void *mmu;
-    void *vdp;
-    void *ppi;
-    void *psg;
-} MSXState;
-
 static void msx_interrupt(void *opaque, int source, int level)
 {
     if (level) {
@@ -476,7 +364,7 @@ static uint32_t msx_io_read(void *opaque, uint32_t addr)
             result = v9918_read(s->vdp, addr - 0x98);
             break;
         case 0xa0 ... 0xa2: /* audio */
-            result = psg_read(s->psg, addr - 0xa0);
+            result = ay8910_read(s->psg, addr - 0xa0);
             break;
         case 0xa8 ... 0xab: /* peripheral interface */
             result = ppi_read(s->ppi, addr - 0xa8);
@@ -500,7 +388,7 @@ static void msx_io_write(void *opaque, uint32_t addr, uint32_t value)
             v9918_write(s->vdp, addr - 0x98, value);
             break;
         case 0xa0 ... 0xa2: /* audio */
-            psg_write(s->psg, addr - 0xa0, value);
+            ay8910_write(s->psg, addr - 0xa0, value);
             break;
         case 0xa8 ... 0xab: /* peripheral interface */
             ppi_write(s->ppi, addr - 0xa8, value);
@@ -518,7 +406,7 @@ static void msx_reset(void *opaque)
     cpu_reset(s->cpu);
     msx_mmu_reset(s->mmu);
     ppi_reset(s->ppi);
-    psg_reset(s->psg);
+    s->stick = 0;
     v9918_reset(s->vdp);
 }
 
@@ -542,7 +430,10 @@ static void msx_init(ram_addr_t ram_size,
     
     s->vdp = v9918_init(s->irq[0]);
     s->ppi = ppi_init(s->mmu, s->vdp);
-    s->psg = psg_init();
+    s->stickstate[0] = 0x3f;
+    s->stickstate[1] = 0x3f;
+    s->psg = ay8910_init("ay8910", MSX_PSG_CLOCK, msx_psg_port_read,
+                         msx_psg_port_write, s);
     
     msx_mmu_load_rom(s->mmu, 0, 0, "msx.rom", 0x8000);
     
@@ -550,7 +441,7 @@ static void msx_init(ram_addr_t ram_size,
         msx_mmu_load_cartridge(s->mmu, 1, kernel_filename);
     }
     
-    register_savevm("cpu", 0, 4, cpu_save, cpu_load, s->cpu);
+    register_savevm("cpu", 0, CPU_SAVE_VERSION, cpu_save, cpu_load, s->cpu);
     qemu_register_reset(msx_reset, 0, s);
     msx_reset(s);
 }
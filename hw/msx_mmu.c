@@ -5,6 +5,7 @@
  *
  * This code is licensed under the GPL version 2
  */
+#include "hw.h"
 #include "sysemu.h"
 #include "msx.h"
 
@@ -16,6 +17,11 @@
 #define CARTPAGES_PER_SLOTPAGE (SLOT_PAGESIZE / CART_PAGESIZE)
 #define NUMSLOTS 4
 
+/* Every slot has its own 64K of physical address space, above the CPU's;
+   the CPU sees the slots selected for its four pages through mapaddr, so
+   selecting a slot only has to flush that page from the TLB. */
+#define SLOT_PHYS(slot) (((slot) + 1) * ADDRSPACE)
+
 typedef struct MMUMegaCart MMUMegaCart;
 
 typedef CPUWriteMemoryFunc **(*msx_mapper_fn_t)(MMUMegaCart *s, int cart_page);
@@ -59,9 +65,8 @@ static CPUReadMemoryFunc *msx_dummy_read_ops[] = {
     msx_dummy_read,
 };
 
-static void msx_mmu_megacart_map(MMUMegaCart *s, int addr)
+static void msx_mmu_megacart_map(MMUMegaCart *s, int cpage)
 {
-    int cpage = addr / CART_PAGESIZE;
     int cartpnum = s->mapper[cpage].cart_pagenum;
     TRACE("[0x%04x] -> cart page %d [0x%08x]", cpage * CART_PAGESIZE, cartpnum,
           (cpage >= 0 && cpage < s->pagecount)
@@ -82,8 +87,9 @@ static void msx_mmu_megacart_map(MMUMegaCart *s, int addr)
         } else {
             ptr |= IO_MEM_ROM;
         }
-        cpu_register_physical_memory(cpage * CART_PAGESIZE, CART_PAGESIZE,
-                                     ptr);
+        cpu_register_physical_memory(SLOT_PHYS(s->slotnum)
+                                     + cpage * CART_PAGESIZE,
+                                     CART_PAGESIZE, ptr);
     }
 }
 
@@ -91,38 +97,44 @@ static inline void msx_mmu_megacart_remap(MMUMegaCartMapper *m, int pnum)
 {
     if (pnum != m->cart_pagenum) {
         m->cart_pagenum = pnum;
-        if (m->megacart->mmu->slot_for_page[m->phys_addr / SLOT_PAGESIZE]
-            == m->megacart->slotnum) {
-            cpu_register_physical_memory(m->phys_addr, CART_PAGESIZE,
-                                         IO_MEM_UNASSIGNED);
-            msx_mmu_megacart_map(m->megacart, m->phys_addr);
-        }
+        cpu_register_physical_memory(m->phys_addr, CART_PAGESIZE,
+                                     IO_MEM_UNASSIGNED);
+        msx_mmu_megacart_map(m->megacart,
+                             (m->phys_addr % ADDRSPACE) / CART_PAGESIZE);
     }
 }
 
+/* register the contents of a slot page in the slot's address space */
 static void msx_mmu_remap(void *opaque, int addr, int slot)
 {
-    cpu_register_physical_memory(addr & ~(SLOT_PAGESIZE - 1),
-                                 SLOT_PAGESIZE,
-                                 IO_MEM_UNASSIGNED);
     MMUState *s = (MMUState *)opaque;
     MMUMegaCart *mc = s->slot[slot].megacart;
+    target_phys_addr_t base = SLOT_PHYS(slot) + (addr & ~(SLOT_PAGESIZE - 1));
+    cpu_register_physical_memory(base, SLOT_PAGESIZE, IO_MEM_UNASSIGNED);
     TRACE("[0x%04x] -> slot%d (%s)", addr, slot,
           mc ? "megacart"
           : s->slot[slot].page[addr / SLOT_PAGESIZE] == IO_MEM_UNASSIGNED
           ? "unmapped" : "mapped");
     if (mc) {
         int i;
-        for (i = 0; i < CARTPAGES_PER_SLOTPAGE; i++, addr += CART_PAGESIZE) {
-            msx_mmu_megacart_map(mc, addr);
+        int cpage = (addr & ~(SLOT_PAGESIZE - 1)) / CART_PAGESIZE;
+        for (i = 0; i < CARTPAGES_PER_SLOTPAGE; i++) {
+            msx_mmu_megacart_map(mc, cpage + i);
         }
     } else {
-        cpu_register_physical_memory(addr & ~(SLOT_PAGESIZE - 1),
-                                     SLOT_PAGESIZE,
+        cpu_register_physical_memory(base, SLOT_PAGESIZE,
                                      s->slot[slot].page[addr / SLOT_PAGESIZE]);
     }
 }
 
+static MMUState *msx_mmu;
+
+static target_ulong msx_mmu_mapaddr(target_ulong addr)
+{
+    int page = (addr / SLOT_PAGESIZE) % SLOT_NUMPAGES;
+    return SLOT_PHYS(msx_mmu->slot_for_page[page]) + (addr % ADDRSPACE);
+}
+
 static void msx_konami_noscc_write(void *opaque,
                                    target_phys_addr_t addr,
                                    uint32_t value)
@@ -267,9 +279,10 @@ void msx_mmu_load_rom(void *opaque, int addr, int slot,
         }
         s->slot[slot].page[page] = msx_mmu_alloc_page(SLOT_PAGESIZE)
                                    | IO_MEM_ROM;
-        msx_mmu_remap(s, i, slot);
+        msx_mmu_remap(s, page * SLOT_PAGESIZE, slot);
     }
-    if (load_image_targphys(path, addr, rom_size) != rom_size) {
+    if (load_image_targphys(path, SLOT_PHYS(slot) + addr, rom_size)
+        != rom_size) {
         hw_error("%s: unable to load MSX ROM '%s'\n", __FUNCTION__, path);
     }
     qemu_free(path);
@@ -309,10 +322,11 @@ static void msx_mmu_load_plain_cartridge(void *opaque, int slot, int fd,
     switch (rom_size / CART_PAGESIZE) {
         case 0 ... 2:
         case 5 ... 7:
-            loadcount = read_targphys(fd, 0, rom_size);
+            loadcount = read_targphys(fd, SLOT_PHYS(slot), rom_size);
             break;
         case 3 ... 4:
-            loadcount = read_targphys(fd, SLOT_PAGESIZE, rom_size);
+            loadcount = read_targphys(fd, SLOT_PHYS(slot) + SLOT_PAGESIZE,
+                                      rom_size);
             break;
     }
     if (loadcount != rom_size) {
@@ -321,10 +335,11 @@ static void msx_mmu_load_plain_cartridge(void *opaque, int slot, int fd,
     if (rom_size / CART_PAGESIZE < CARTPAGES_PER_SLOTPAGE) {
         /* mirror sub-slotpagesize cart */
         void *page = qemu_malloc(CART_PAGESIZE);
-        cpu_physical_memory_read(0, page, CART_PAGESIZE);
+        cpu_physical_memory_read(SLOT_PHYS(slot), page, CART_PAGESIZE);
         int i;
         for (i = CART_PAGESIZE; i < SLOT_PAGESIZE; i += CART_PAGESIZE) {
-            cpu_physical_memory_write_rom(i, page, CART_PAGESIZE);
+            cpu_physical_memory_write_rom(SLOT_PHYS(slot) + i, page,
+                                          CART_PAGESIZE);
         }
         qemu_free(page);
     }
@@ -345,19 +360,21 @@ static void msx_mmu_load_mega_cartridge(void *opaque, int slot, int fd,
     mc->slotnum = slot;
     uint32_t i, j;
     int lastfirst = 1;
+    /* load the pages one by one through the slot's first page */
+    target_phys_addr_t base = SLOT_PHYS(slot);
     for (i = 0, j = 0; i < rom_size; i += CART_PAGESIZE, j++) {
-        cpu_register_physical_memory(0x4000, CART_PAGESIZE, IO_MEM_UNASSIGNED);
+        cpu_register_physical_memory(base, CART_PAGESIZE, IO_MEM_UNASSIGNED);
         ram_addr_t page = msx_mmu_alloc_page(CART_PAGESIZE);
         mc->pages[j] = page;
-        cpu_register_physical_memory(0x4000, CART_PAGESIZE, page | IO_MEM_ROM);
+        cpu_register_physical_memory(base, CART_PAGESIZE, page | IO_MEM_ROM);
         uint32_t count = (rom_size - i) > CART_PAGESIZE
                          ? CART_PAGESIZE : (rom_size - i);
-        if (read_targphys(fd, 0x4000, count) != count) {
+        if (read_targphys(fd, base, count) != count) {
             hw_error("%s: error while reading cartridge file\n", __FUNCTION__);
         }
         if (!i) {
             uint8_t signature[2];
-            cpu_physical_memory_read(0x4000, signature, 2);
+            cpu_physical_memory_read(base, signature, 2);
             if (signature[0] == 'A' && signature[1] == 'B') {
                 lastfirst = 0;
             }
@@ -365,7 +382,7 @@ static void msx_mmu_load_mega_cartridge(void *opaque, int slot, int fd,
     }
     for (i = 0; i < CART_NUMPAGES; i++) {
         mc->mapper[i].cart_pagenum = -1;
-        mc->mapper[i].phys_addr = i * CART_PAGESIZE;
+        mc->mapper[i].phys_addr = base + i * CART_PAGESIZE;
         mc->mapper[i].io_index = -1;
         mc->mapper[i].megacart = mc;
     }
@@ -381,6 +398,9 @@ static void msx_mmu_load_mega_cartridge(void *opaque, int slot, int fd,
         mc->mapper[5].cart_pagenum = 3;
     }
     mmu->slot[slot].megacart = mc;
+    for (i = 0; i < SLOT_NUMPAGES; i++) {
+        msx_mmu_remap(mmu, i * SLOT_PAGESIZE, slot);
+    }
 }
 
 static int msx_is_mega_cartridge(int fd, uint32_t size)
@@ -444,8 +464,9 @@ void msx_mmu_reset(void *opaque)
     MMUState *mmu = (MMUState *)opaque;
     int page;
     for (page = 0; page < SLOT_NUMPAGES; page++) {
-        msx_mmu_remap(mmu, page * SLOT_PAGESIZE, 0);
+        mmu->slot_for_page[page] = 0;
     }
+    cpu_z80_remap(mmu->cpu, 0, ADDRSPACE);
 }
 
 void msx_mmu_slot_select(void *opaque, uint32_t value)
@@ -455,12 +476,61 @@ void msx_mmu_slot_select(void *opaque, uint32_t value)
     for (page = 0; page < SLOT_NUMPAGES; page++, value >>= 2) {
         int slot = value & 3;
         if (s->slot_for_page[page] != slot) {
-            msx_mmu_remap(s, page * SLOT_PAGESIZE, slot);
             s->slot_for_page[page] = slot;
+            cpu_z80_remap(s->cpu, page * SLOT_PAGESIZE, SLOT_PAGESIZE);
         }
     }
 }
 
+static void msx_mmu_save(QEMUFile *f, void *opaque)
+{
+    MMUState *s = (MMUState *)opaque;
+    int page, slot, i;
+    for (page = 0; page < SLOT_NUMPAGES; page++) {
+        qemu_put_be32(f, s->slot_for_page[page]);
+    }
+    for (slot = 0; slot < NUMSLOTS; slot++) {
+        if (s->slot[slot].megacart) {
+            for (i = 0; i < CART_NUMPAGES; i++) {
+                qemu_put_be32(f, s->slot[slot].megacart->mapper[i].cart_pagenum);
+            }
+        }
+    }
+}
+
+static int msx_mmu_load(QEMUFile *f, void *opaque, int version_id)
+{
+    MMUState *s = (MMUState *)opaque;
+    int page, slot, i;
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+    for (page = 0; page < SLOT_NUMPAGES; page++) {
+        s->slot_for_page[page] = qemu_get_be32(f) & (NUMSLOTS - 1);
+    }
+    for (slot = 0; slot < NUMSLOTS; slot++) {
+        MMUMegaCart *mc = s->slot[slot].megacart;
+        if (mc) {
+            for (i = 0; i < CART_NUMPAGES; i++) {
+                int pnum = qemu_get_be32(f);
+                if (pnum >= mc->pagecount) {
+                    pnum = -1;
+                }
+                mc->mapper[i].cart_pagenum = pnum;
+            }
+        }
+    }
+    for (slot = 0; slot < NUMSLOTS; slot++) {
+        if (s->slot[slot].megacart) {
+            for (page = 0; page < SLOT_NUMPAGES; page++) {
+                msx_mmu_remap(s, page * SLOT_PAGESIZE, slot);
+            }
+        }
+    }
+    tlb_flush(s->cpu, 1);
+    return 0;
+}
+
 void *msx_mmu_init(CPUState *cpu, int ramslot)
 {
     MMUState *s = qemu_mallocz(sizeof(*s));
@@ -473,6 +543,12 @@ void *msx_mmu_init(CPUState *cpu, int ramslot)
             : IO_MEM_UNASSIGNED;
         }
     }
+    for (page = 0; page < SLOT_NUMPAGES; page++) {
+        msx_mmu_remap(s, page * SLOT_PAGESIZE, ramslot);
+    }
+    msx_mmu = s;
+    cpu->mapaddr = msx_mmu_mapaddr;
     msx_mmu_reset(s);
+    register_savevm("msx_mmu", 0, 1, msx_mmu_save, msx_mmu_load, s);
     return s;
 }
@@ -56,6 +56,11 @@ static target_ulong sam_mapaddr(target_ulong addr) {
 
 static void map_memory(void)
 {
+    int old_tab[4];
+    int i;
+
+    memcpy(old_tab, page_tab, sizeof(old_tab));
+
     if (!(lmpr & 0x20)) {
         page_tab[0] = 0x20; /* ROM 0 */
     } else {
@@ -72,8 +77,11 @@ static void map_memory(void)
 
     /* TODO: if lmpr bit 7 is set, page 0 is write-protected */
 
-    cpu_interrupt(first_cpu, CPU_INTERRUPT_EXITTB);
-    tlb_flush(first_cpu, 1);
+    for (i = 0; i < 4; i++) {
+        if (page_tab[i] != old_tab[i]) {
+            cpu_z80_remap(first_cpu, i << 14, 0x4000);
+        }
+    }
 }
 
 static uint32_t io_pen_read(void *opaque, uint32_t addr)
@@ -208,6 +216,28 @@ static void zx_timer_init(void)
     qemu_mod_timer(zx_ula_timer, t);
 }
 
+static void sam_save(QEMUFile *f, void *opaque)
+{
+    qemu_put_be32(f, lmpr);
+    qemu_put_be32(f, hmpr);
+    qemu_put_be32(f, vmpr);
+    qemu_put_timer(f, zx_ula_timer);
+}
+
+static int sam_load(QEMUFile *f, void *opaque, int version_id)
+{
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    lmpr = qemu_get_be32(f);
+    hmpr = qemu_get_be32(f);
+    vmpr = qemu_get_be32(f);
+    qemu_get_timer(f, zx_ula_timer);
+    map_memory();
+    return 0;
+}
+
 /* ZX Spectrum initialisation */
 static void sam_coupe_init(ram_addr_t ram_size,
                            const char *boot_device,
@@ -230,7 +260,7 @@ static void sam_coupe_init(ram_addr_t ram_size,
     }
     env = cpu_init(cpu_model);
     sam_env = env; // XXX
-    register_savevm("cpu", 0, 4, cpu_save, cpu_load, env);
+    register_savevm("cpu", 0, CPU_SAVE_VERSION, cpu_save, cpu_load, env);
     qemu_register_reset(main_cpu_reset, 0, env);
     main_cpu_reset(env);
 
@@ -294,6 +324,7 @@ static void sam_coupe_init(ram_addr_t ram_size,
 
     sam_keyboard_init();
     zx_timer_init();
+    register_savevm("sam_coupe", 0, 1, sam_save, sam_load, NULL);
 }
 
 static QEMUMachine sam_machine = {
@@ -15,10 +15,12 @@
 #define SCREEN_WIDTH 256
 #define SCREEN_HEIGHT 192
 #define BORDER_SIZE 16
+#define SCREEN_LINES (SCREEN_HEIGHT + 2 * BORDER_SIZE)
 
 #define VRAM_SIZE 0x4000
 #define VRAM_ADDR(addr) ((addr) & (VRAM_SIZE - 1))
 #define VRAM_ADDR_INC(addr) addr = VRAM_ADDR(addr + 1)
+#define VRAM_DIRTY(s, a) ((s)->vram_dirty[(a) >> 3] & (1 << ((a) & 7)))
 
 typedef struct {
     qemu_irq irq;
@@ -26,6 +28,7 @@ typedef struct {
     int invalidate;
     int render_dirty;
     int vdp_dirty;
+    int full_dirty;
     int zoom;
     QEMUTimer *timer;
     
@@ -38,6 +41,15 @@ typedef struct {
     uint8_t data;
     uint8_t status;
     uint8_t ctrl[8];
+
+    /* Only the lines whose VRAM bytes or sprites changed are rendered
+       again.  vram_dirty has a bit for each byte written with a new value
+       since the last render, spr_shadow is the sprite attribute table
+       as it was then, and update_lines are the lines rendered but not
+       yet passed to dpy_update.  A register change redraws everything. */
+    uint8_t vram_dirty[VRAM_SIZE / 8];
+    uint8_t spr_shadow[128];
+    uint8_t update_lines[SCREEN_LINES];
     
     struct {
         uint8_t plane;
@@ -50,6 +62,11 @@ static void v9918_ctrl(V9918State *s, uint8_t reg, uint8_t value)
     static const uint8_t mask[8] = {0x03, 0xfb, 0x0f, 0xff, 0x07, 0x7f, 0x07, 0xff};
     reg &= 0x07;
     value &= mask[reg];
+    /* the interrupt enable bit does not change the picture */
+    if ((s->ctrl[reg] ^ value) & (reg == 1 ? ~0x20 : 0xff)) {
+        s->full_dirty = 1;
+        s->vdp_dirty = 1;
+    }
     s->ctrl[reg] = value;
     if (reg == 1 && (s->status & 0x80)) {
         qemu_set_irq(s->irq, value & 0x20);
@@ -84,7 +101,6 @@ void v9918_write(void *opaque, uint32_t addr, uint32_t value)
             s->addr_seq = 1;
             if (value & 0x80) {
                 v9918_ctrl(s, value, s->addr_latch);
-                s->vdp_dirty = 1;
             } else {
                 s->addr = VRAM_ADDR((value << 8) + s->addr_latch);
                 s->addr_mode = value & 0x40;
@@ -97,14 +113,19 @@ void v9918_write(void *opaque, uint32_t addr, uint32_t value)
     } else {
         s->addr_seq = 1;
         if (s->addr_mode) {
-            s->vram[s->addr] = s->data = value;
-            VRAM_ADDR_INC(s->addr);
+            s->data = value;
         } else {
             s->data = s->vram[s->addr];
             VRAM_ADDR_INC(s->addr);
+        }
+        if (s->vram[s->addr] != (uint8_t)value) {
             s->vram[s->addr] = value;
+            s->vram_dirty[s->addr >> 3] |= 1 << (s->addr & 7);
+            s->vdp_dirty = 1;
+        }
+        if (s->addr_mode) {
+            VRAM_ADDR_INC(s->addr);
         }
-        s->vdp_dirty = 1;
     }
 }
 
@@ -328,20 +349,147 @@ static uint8_t *v9918_render_sprites(V9918State *s, int scanline)
 #include "pixel_ops.h"
 #include "v9918_render_template.h"
 
-static void v9918_render_screen(V9918State *s)
+/* render function index for the current mode, or -1 for the modes that
+ * are not emulated */
+static int v9918_screen_mode(V9918State *s)
 {
-    if (!is_graphic_console()) {
-        return;
-    }
-    
     int mode = ((s->ctrl[0] >> 1) & 1) | ((s->ctrl[1] >> 2) & 6);
     if (mode < 3) {
-        mode++;
-    } else if (mode == 4) {
-        mode = 0;
-    } else {
+        return mode + 1;
+    }
+    return mode == 4 ? 0 : -1;
+}
+
+/* the fifth sprite flag is set as if every line was rendered */
+static void v9918_sprite_overflow_check(V9918State *s)
+{
+    int mode = v9918_screen_mode(s);
+    int i;
+    if (mode < 1 || BLANK_ENABLE) {
         return;
     }
+    for (i = 0; i < SCREEN_HEIGHT && !(s->status & 0x40); i++) {
+        v9918_scan_sprites(s, i, 208, 4);
+    }
+}
+
+/* does the visible line read a changed name, pattern or colour byte;
+ * the addresses are those the render functions use */
+static int v9918_line_changed(V9918State *s, int mode, int scanline)
+{
+    int x, t, c;
+    if (mode == 0) {
+        const int src = CHRGEN(0, 0x800) + (scanline & 7);
+        const int m = ~CHRTAB_MSK(0, 10);
+        t = CHRTAB((scanline >> 3) * 40, 0, 0x400);
+        for (x = 40; x; x--) {
+            if (t & m) {
+                t = CHRTAB((scanline >> 3) * 40 + (40 - x), 0, 0x400);
+            }
+            c = src + ((int)s->vram[t] << 3);
+            if (VRAM_DIRTY(s, t) || VRAM_DIRTY(s, c)) {
+                return 1;
+            }
+            t++;
+        }
+        return 0;
+    }
+    const int clt = ((scanline & 0xc0) << 5) + (scanline & 7);
+    const int pgt = mode == 1 ? CHRGEN(0, 0x800) + (scanline & 7) :
+                    mode == 2 ? CHRGEN(clt, 0x2000) :
+                    CHRGEN(0, 0x800) + ((scanline >> 2) & 7);
+    const int coltab = COLTAB(0, 0x40);
+    t = CHRTAB((scanline & 0xf8) << 2, 0, 0x400);
+    for (x = 32; x--; t++) {
+        c = s->vram[t];
+        if (VRAM_DIRTY(s, t) || VRAM_DIRTY(s, pgt + (c << 3))) {
+            return 1;
+        }
+        if (mode == 1) {
+            c = coltab + (c >> 3);
+        } else if (mode == 2) {
+            c = COLTAB(clt + (c << 3), 0x2000);
+        } else {
+            continue;
+        }
+        if (VRAM_DIRTY(s, c)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* mark the visible lines a sprite at y covers, as v9918_scan_sprites
+ * finds them */
+static void v9918_sprite_lines(V9918State *s, uint8_t y, uint8_t *dirty)
+{
+    const uint8_t height = SPRITE_SIZE ? 16 : 8;
+    const uint8_t b = SPRITE_MAG;
+    int i;
+    for (i = 0; i < SCREEN_HEIGHT; i++) {
+        if ((uint8_t)((i - y) >> b) < height) {
+            dirty[BORDER_SIZE + i] = 1;
+        }
+    }
+}
+
+/* mark the lines to render again after VRAM writes: the lines reading a
+ * changed byte, and where a sprite was and is if its attributes or its
+ * pattern changed */
+static void v9918_dirty_lines(V9918State *s, int mode, uint8_t *dirty)
+{
+    int i;
+    if (BLANK_ENABLE || (mode == 0 && !FG_COLOR)) {
+        return;
+    }
+    for (i = 0; i < SCREEN_HEIGHT; i++) {
+        dirty[BORDER_SIZE + i] = v9918_line_changed(s, mode, i);
+    }
+    if (mode == 0) {
+        return;
+    }
+
+    const uint8_t *spr_tab = s->vram + SPRTAB(0, 0x80);
+    const int spr_gen = (int)s->ctrl[6] << 11;
+    const int size = SPRITE_SIZE ? 4 : 1;
+    const uint8_t h = SPRITE_SIZE ? 0xfc : 0xff;
+    int old_on = 1, new_on = 1;
+    for (i = 0; i < 32 && (old_on || new_on); i++) {
+        const uint8_t *o = s->spr_shadow + (i << 2);
+        const uint8_t *n = spr_tab + (i << 2);
+        old_on = old_on && o[0] != 208;
+        new_on = new_on && n[0] != 208;
+        int changed = old_on != new_on || memcmp(o, n, 4);
+        if (new_on && !changed) {
+            const uint8_t *d = s->vram_dirty + ((spr_gen + ((n[2] & h) << 3)) >> 3);
+            int k;
+            for (k = 0; k < size; k++) {
+                changed |= d[k];
+            }
+        }
+        if (changed) {
+            if (old_on && o[0] != 209) {
+                v9918_sprite_lines(s, o[0], dirty);
+            }
+            if (new_on && n[0] != 209) {
+                v9918_sprite_lines(s, n[0], dirty);
+            }
+        }
+    }
+}
+
+static void v9918_render_screen(V9918State *s, int full)
+{
+    uint8_t dirty[SCREEN_LINES];
+    
+    if (!is_graphic_console()) {
+        goto done;
+    }
+    
+    int mode = v9918_screen_mode(s);
+    if (mode < 0) {
+        goto done;
+    }
     
     v9918_render_fn_t render_fn = 0;
     if (s->zoom == 1) {
@@ -368,7 +516,7 @@ static void v9918_render_screen(V9918State *s)
     if (!render_fn || !fb || linesize < s->zoom * SCREEN_WIDTH ||
         ds_get_width(s->ds) < s->zoom * SCREEN_WIDTH ||
         ds_get_height(s->ds) < s->zoom * SCREEN_HEIGHT) {
-        return;
+        goto done;
     }
 
     int i = BG_COLOR * 3 ?: 3;
@@ -376,12 +524,26 @@ static void v9918_render_screen(V9918State *s)
     V9918Palette[1] = V9918Palette[i + 1];
     V9918Palette[2] = V9918Palette[i + 2];
     
-    for (i = 0; i < SCREEN_HEIGHT + 2 * BORDER_SIZE; i++) {
-        render_fn(s, i, fb, linesize);
+    if (full || s->full_dirty) {
+        memset(dirty, 1, sizeof(dirty));
+    } else {
+        memset(dirty, 0, sizeof(dirty));
+        v9918_dirty_lines(s, mode, dirty);
+    }
+    for (i = 0; i < SCREEN_LINES; i++) {
+        if (dirty[i]) {
+            render_fn(s, i, fb, linesize);
+            s->update_lines[i] = 1;
+            s->render_dirty = 1;
+        }
         fb += linesize * s->zoom;
     }
-    
-    s->render_dirty = 1;
+
+done:
+    /* an invalidate redraws the screen when it comes back */
+    memset(s->vram_dirty, 0, sizeof(s->vram_dirty));
+    memcpy(s->spr_shadow, s->vram + SPRTAB(0, 0x80), sizeof(s->spr_shadow));
+    s->full_dirty = 0;
 }
 
 static void v9918_vertical_retrace(V9918State *s)
@@ -390,7 +552,10 @@ static void v9918_vertical_retrace(V9918State *s)
         if (!(s->status & 0x20)) {
             v9918_sprite_collision_check(s);
         }
-        v9918_render_screen(s);
+        if (!(s->status & 0x40)) {
+            v9918_sprite_overflow_check(s);
+        }
+        v9918_render_screen(s, 0);
         s->vdp_dirty = 0;
     }
     s->status |= 0x80;
@@ -424,12 +589,23 @@ static void v9918_update_display(void *opaque)
                                 s->zoom * (SCREEN_WIDTH + 2 * BORDER_SIZE),
                                 s->zoom * (SCREEN_HEIGHT + 2 * BORDER_SIZE));
         }
-        v9918_render_screen(s);
+        v9918_render_screen(s, 1);
     }
 
     if (s->render_dirty) {
+        int i, n;
         s->render_dirty = 0;
-        dpy_update(s->ds, 0, 0, ds_get_width(s->ds), ds_get_height(s->ds));
+        for (i = 0; i < SCREEN_LINES; i += n) {
+            for (n = 0; i + n < SCREEN_LINES && s->update_lines[i + n]; n++) {
+                s->update_lines[i + n] = 0;
+            }
+            if (n) {
+                dpy_update(s->ds, 0, i * s->zoom, ds_get_width(s->ds),
+                           n * s->zoom);
+            } else {
+                n = 1;
+            }
+        }
     }
 }
 
@@ -455,6 +631,44 @@ void v9918_reset(void *opaque)
     s->status = 0;
     memset(s->ctrl, 0, sizeof(s->ctrl));
     memset(s->vram, 0, VRAM_SIZE);
+    s->full_dirty = 1;
+    s->vdp_dirty = 1;
+}
+
+static void v9918_save(QEMUFile *f, void *opaque)
+{
+    V9918State *s = (V9918State *)opaque;
+    qemu_put_be16s(f, &s->addr);
+    qemu_put_be32(f, s->addr_mode);
+    qemu_put_be32(f, s->addr_seq);
+    qemu_put_8s(f, &s->addr_latch);
+    qemu_put_8s(f, &s->data);
+    qemu_put_8s(f, &s->status);
+    qemu_put_buffer(f, s->ctrl, sizeof(s->ctrl));
+    qemu_put_buffer(f, s->vram, VRAM_SIZE);
+    qemu_put_timer(f, s->timer);
+}
+
+static int v9918_load(QEMUFile *f, void *opaque, int version_id)
+{
+    V9918State *s = (V9918State *)opaque;
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+    qemu_get_be16s(f, &s->addr);
+    s->addr = VRAM_ADDR(s->addr);
+    s->addr_mode = qemu_get_be32(f);
+    s->addr_seq = qemu_get_be32(f);
+    qemu_get_8s(f, &s->addr_latch);
+    qemu_get_8s(f, &s->data);
+    qemu_get_8s(f, &s->status);
+    qemu_get_buffer(f, s->ctrl, sizeof(s->ctrl));
+    qemu_get_buffer(f, s->vram, VRAM_SIZE);
+    qemu_get_timer(f, s->timer);
+    s->full_dirty = 1;
+    s->vdp_dirty = 1;
+    s->invalidate = 1;
+    return 0;
 }
 
 void *v9918_init(qemu_irq irq)
@@ -470,5 +684,6 @@ void *v9918_init(qemu_irq irq)
     s->timer = qemu_new_timer(vm_clock, v9918_timer, s);
     v9918_reset(s);
     qemu_mod_timer(s->timer, qemu_get_clock(vm_clock));
+    register_savevm("v9918", 0, 1, v9918_save, v9918_load, s);
     return s;
 }
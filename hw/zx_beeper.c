@@ -0,0 +1,247 @@
+/*
+ * ZX Spectrum Beeper Emulation
+ *
+ * This code is licensed under the GPL version 2
+ */
+#include <math.h>
+
+#include "hw.h"
+#include "audio/audio.h"
+#include "zx_beeper.h"
+
+/* Each change of the speaker level is put in a ring with the T-state it
+   happened at; nothing else is done at OUT time.  When the audio layer
+   asks for samples, the edges up to the time of the last sample are
+   turned into band-limited steps: a step at a fractional sample position
+   adds a windowed sinc impulse, scaled by the change of level, to the
+   pending deltas, and the samples are the running sum of these.  The cost
+   is per edge and per sample, whatever the rate at which the guest
+   toggles the speaker.
+
+   The ring is only written by zx_beeper_write() and only read by the
+   audio callback, which each own one of the two indexes. */
+
+#define BEEPER_RATE     44100
+#define BEEPER_RING     16384           /* edges, a power of two */
+#define BEEPER_BUF      512             /* samples per AUD_write */
+#define BLEP_PHASES     32
+#define BLEP_TAPS       16
+#define BLEP_SHIFT      15              /* a row of the kernel sums to 1 */
+
+/* samples the output may lag behind the CPU before it skips ahead */
+#define BEEPER_MAX_LAG  (BEEPER_RATE / 10)
+
+/* output for each combination of EAR (bit 1) and MIC (bit 0) */
+static const int beeper_level[4] = { 0, 1200, 11540, 12000 };
+
+typedef struct {
+    uint64_t t;                 /* T-state of the edge */
+    int level;
+} ZXBeeperEdge;
+
+typedef struct {
+    QEMUSoundCard card;
+    SWVoiceOut *voice;
+
+    ZXBeeperEdge ring[BEEPER_RING];
+    unsigned int head;          /* written by zx_beeper_write */
+    unsigned int tail;          /* written by the audio callback */
+    int level;                  /* last level written */
+
+    /* time of the next sample in 1/65536 T-states, and the length of a
+       sample in the same unit */
+    uint64_t pos;
+    uint64_t step;
+    int out_level;              /* level at pos */
+
+    /* pending deltas from pos on, and their running sum, both scaled
+       by 1 << BLEP_SHIFT */
+    int32_t delta[BEEPER_BUF + BLEP_TAPS];
+    int32_t sum;
+    /* DC blocker */
+    int32_t hp_in;
+    int32_t hp_out;
+
+    int16_t buf[BEEPER_BUF];
+} ZXBeeperState;
+
+static ZXBeeperState zx_beeper;
+static int16_t blep_kernel[BLEP_PHASES][BLEP_TAPS];
+
+/* each row is a windowed sinc, cut off below the Nyquist rate, sampled
+   at the taps for a step delayed by phase / BLEP_PHASES of a sample */
+static void blep_init(void)
+{
+    double h[BLEP_TAPS], x, sum;
+    int p, k, total;
+
+    for (p = 0; p < BLEP_PHASES; p++) {
+        sum = 0;
+        for (k = 0; k < BLEP_TAPS; k++) {
+            x = k - (BLEP_TAPS / 2 - 1) - (double)p / BLEP_PHASES;
+            h[k] = (x == 0) ? 1.0 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+            /* Blackman window over the kernel */
+            h[k] *= 0.42 + 0.5 * cos(M_PI * x / (BLEP_TAPS / 2)) +
+                    0.08 * cos(2 * M_PI * x / (BLEP_TAPS / 2));
+            if (fabs(x) >= BLEP_TAPS / 2) {
+                h[k] = 0;
+            }
+            sum += h[k];
+        }
+        total = 0;
+        for (k = 0; k < BLEP_TAPS; k++) {
+            blep_kernel[p][k] = lrint(h[k] / sum * (1 << BLEP_SHIFT));
+            total += blep_kernel[p][k];
+        }
+        /* rounding must not leave a DC step behind */
+        blep_kernel[p][BLEP_TAPS / 2 - 1] += (1 << BLEP_SHIFT) - total;
+    }
+}
+
+void zx_beeper_write(uint32_t data)
+{
+    ZXBeeperState *s = &zx_beeper;
+    int level = beeper_level[(data >> 3) & 3];
+    unsigned int head;
+
+    if (level == s->level) {
+        return;
+    }
+    s->level = level;
+    head = s->head;
+    if (head - s->tail == BEEPER_RING) {
+        /* nobody is playing; the callback starts again from s->level */
+        return;
+    }
+    s->ring[head % BEEPER_RING].t = first_cpu->tstates;
+    s->ring[head % BEEPER_RING].level = level;
+    s->head = head + 1;
+}
+
+/* drop the edges before pos, when the output has fallen too far behind
+   the CPU or the T-state counter went back (loadvm) */
+static void beeper_skip(ZXBeeperState *s, uint64_t pos)
+{
+    ZXBeeperEdge *e;
+
+    while (s->tail != s->head) {
+        e = &s->ring[s->tail % BEEPER_RING];
+        if ((e->t << 16) >= pos) {
+            break;
+        }
+        s->out_level = e->level;
+        s->tail++;
+    }
+    if (s->tail == s->head) {
+        /* edges may have been lost while the ring was full */
+        s->out_level = s->level;
+    }
+    s->pos = pos;
+    memset(s->delta, 0, sizeof(s->delta));
+    s->sum = s->out_level << BLEP_SHIFT;
+}
+
+static void beeper_add_edge(ZXBeeperState *s, ZXBeeperEdge *e)
+{
+    uint64_t t = e->t << 16;
+    uint64_t offset, idx;
+    int phase, k, d;
+
+    offset = t > s->pos ? t - s->pos : 0;
+    idx = offset / s->step;
+    phase = (offset % s->step) * BLEP_PHASES / s->step;
+    d = e->level - s->out_level;
+    s->out_level = e->level;
+    for (k = 0; k < BLEP_TAPS; k++) {
+        s->delta[idx + k] += d * blep_kernel[phase][k];
+    }
+}
+
+static void beeper_render(ZXBeeperState *s, int samples)
+{
+    uint64_t end = s->pos + samples * s->step;
+    ZXBeeperEdge *e;
+    int32_t in;
+    int i;
+
+    while (s->tail != s->head) {
+        e = &s->ring[s->tail % BEEPER_RING];
+        if ((e->t << 16) >= end) {
+            break;
+        }
+        beeper_add_edge(s, e);
+        s->tail++;
+    }
+
+    for (i = 0; i < samples; i++) {
+        s->sum += s->delta[i];
+        /* the speaker level is never negative; take the DC away so that
+           a silent speaker is silent whatever its level */
+        in = s->sum >> BLEP_SHIFT;
+        s->hp_out = in - s->hp_in + ((s->hp_out * 32604) >> 15);
+        s->hp_in = in;
+        s->buf[i] = s->hp_out;
+    }
+    memmove(s->delta, s->delta + samples,
+            (BEEPER_BUF + BLEP_TAPS - samples) * sizeof(s->delta[0]));
+    memset(s->delta + BEEPER_BUF + BLEP_TAPS - samples, 0,
+           samples * sizeof(s->delta[0]));
+    s->pos = end;
+}
+
+/* the samples never get ahead of the CPU, so that no edge arrives for a
+   time that has been played already */
+static void zx_beeper_callback(void *opaque, int free)
+{
+    ZXBeeperState *s = opaque;
+    uint64_t now = first_cpu->tstates;
+    int64_t avail;
+    int samples, n;
+
+    if ((now << 16) < s->pos) {
+        s->tail = s->head;
+        beeper_skip(s, now << 16);
+        return;
+    }
+    avail = ((now << 16) - s->pos) / s->step;
+    samples = free / sizeof(int16_t);
+    if (avail > samples + BEEPER_MAX_LAG) {
+        /* play the latest samples */
+        beeper_skip(s, (now << 16) - samples * s->step);
+        avail = samples;
+    }
+    if (samples > avail) {
+        samples = avail;
+    }
+
+    while (samples > 0) {
+        n = audio_MIN(samples, BEEPER_BUF);
+        beeper_render(s, n);
+        n = AUD_write(s->voice, s->buf, n * sizeof(int16_t)) /
+            sizeof(int16_t);
+        if (!n) {
+            break;
+        }
+        samples -= n;
+    }
+}
+
+void zx_beeper_init(uint32_t cpu_freq)
+{
+    ZXBeeperState *s = &zx_beeper;
+    struct audsettings as = {BEEPER_RATE, 1, AUD_FMT_S16,
+                             AUDIO_HOST_ENDIANNESS};
+
+    blep_init();
+    s->step = ((uint64_t)cpu_freq << 16) / BEEPER_RATE;
+    beeper_skip(s, first_cpu->tstates << 16);
+
+    AUD_register_card("zx_beeper", &s->card);
+    s->voice = AUD_open_out(&s->card, s->voice, "zx_beeper", s,
+                            zx_beeper_callback, &as);
+    if (!s->voice) {
+        AUD_log("zx_beeper", "Could not open voice\n");
+        return;
+    }
+    AUD_set_active_out(s->voice, 1);
+}
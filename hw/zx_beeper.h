@@ -0,0 +1,10 @@
+#ifndef HW_ZX_BEEPER_H
+#define HW_ZX_BEEPER_H
+/* ZX Spectrum Beeper */
+
+/* cpu_freq is the CPU clock, which the T-state timestamps count */
+void zx_beeper_init(uint32_t cpu_freq);
+/* the EAR and MIC bits of a write to port 0xfe */
+void zx_beeper_write(uint32_t data);
+
+#endif
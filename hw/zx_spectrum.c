@@ -29,7 +29,16 @@
 #include "sysemu.h"
 #include "zx_video.h"
 #include "zx_keyboard.h"
+#include "zx_beeper.h"
+#include "zx_tape.h"
+#include "io_output.h"
+#include "ay8910.h"
 #include "boards.h"
+#include "qemu-char.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
 
 #ifdef CONFIG_LIBSPECTRUM
 #include <libspectrum.h>
@@ -39,20 +48,40 @@
 #define ROM_FILENAME_128 "zx-rom128.bin"
 
 static int page_tab[4];
+static int pagebyte;
+static int zx_paging;
+
+/* the 128K's AY-3-8912, clocked at half the CPU clock */
+#define ZX_AY_CLOCK 1773400
+static void *zx_ay;
 
 // #define IOPIPE_ENABLED
 #ifdef IOPIPE_ENABLED
 /* LLL -- IO port to pipe hack */
 #define IOPIPE_READ_PATH_DFL  "/tmp/qemu_z80_rd"
 #define IOPIPE_WRITE_PATH_DFL "/tmp/qemu_z80_wr"
+/* bit 0 of this (odd) port is set while a byte from the pipe is waiting */
+#define IOPIPE_STATUS_PORT    0xff
+#define IOPIPE_STATUS_DATA    0x01
+/* a read with no byte waiting halts the CPU until one comes; otherwise
+   it returns 0xff */
+#define IOPIPE_BLOCKING       1
+#define IOPIPE_BUF_SIZE       4096
 typedef struct IOPipe {
     int rdfd;
     int wrfd;
-    char *rd_path;
-    char *wr_path;
+    const char *rd_path;
+    const char *wr_path;
+    /* both ways the bytes are buffered, and the pipes are only read and
+       written from the main loop when they are ready */
+    uint8_t in_buf[IOPIPE_BUF_SIZE];
+    unsigned int in_head, in_tail;
+    uint8_t out_buf[IOPIPE_BUF_SIZE];
+    unsigned int out_head, out_tail;
 } IOPipe;
 static IOPipe iopipe = {0, 0, IOPIPE_READ_PATH_DFL, IOPIPE_WRITE_PATH_DFL};
 static uint8_t iopipe_read(IOPipe *iop);
+static uint8_t iopipe_status(IOPipe *iop);
 static int iopipe_write(IOPipe *iop, uint8_t data);
 #endif
 
@@ -61,63 +90,90 @@ static int iopipe_write(IOPipe *iop, uint8_t data);
    io_in_ports will be loaded with the contents of 'io_in_file' which
    specifies the port and value to be read anytime a IN instruction is executed.
 
-   io_out_ports will be written out to 'io_out_file' anytime an OUT instruction is executed.
+   OUT instructions go to 'io_out_file' and the log through io_output.c.
  */
 static uint8_t io_input_ports[256]={0};
-static uint8_t io_output_ports[256]={0};
+
+/* io_input_file is parsed again only if it changed since the last frame */
+static int io_input_stale = 1;
+static int io_input_loaded;
+static struct stat io_input_stat;
+static time_t io_input_load_time;   /* when it was last parsed */
+
+/* 'io_input_map_file' is 256 bytes, the value of each port, mapped
+   shared so that a read of a port is a load from it */
+static const volatile uint8_t *io_input_map_ports;
 
 /* set from cli options */
 extern const char *io_input_file;
+extern const char *io_input_map_file;
 extern const char *io_output_file;
 extern const char *io_output_log_file;
-
-// io_output_log_file fd for appending all OUT instructions
-static FILE *io_output_log_fd = NULL;
+extern const char *tape_file;
+extern const char *tape_mode;
  
 
 
 static uint32_t io_spectrum_read(void *opaque, uint32_t addr)
 {
+    if (zx_ay && (addr & 0xc002) == 0xc000) {
+        return ay8910_read(zx_ay, 2);
+    }
     if ((addr & 1) == 0) {
 #ifdef IOPIPE_ENABLED
         return iopipe_read(&iopipe);
 #else
-        return zx_keyboard_read(opaque, addr);
+        return zx_tape_ear(zx_keyboard_read(opaque, addr));
 #endif
     } else {
-        return 0xff;
-    }
-}
-
-static void io_spectrum_write(void *opaque, uint32_t addr, uint32_t data)
-{
-    if ((addr & 1) == 0) {
 #ifdef IOPIPE_ENABLED
-        iopipe_write(&iopipe, (uint8_t)data);
-#else
-        zx_video_set_border(data & 0x7);
+        if ((addr & 0xff) == IOPIPE_STATUS_PORT) {
+            return iopipe_status(&iopipe);
+        }
 #endif
+        return 0xff;
     }
 }
 
+/* 128K memory paging port, decoded on A15 and A1 low */
 static void io_page_write(void *opaque, uint32_t addr, uint32_t data)
 {
     int newrom, newram;
-    int changed = 0;
 
+    /* bit 5 locks the paging until the next reset */
+    if (pagebyte & 0x20) {
+        return;
+    }
+    pagebyte = data;
+    zx_video_set_screen(data & 0x08);
     newrom = 8 + !!(data & 0x10);
     newram = data & 0x7;
     if (page_tab[0] != newrom) {
         page_tab[0] = newrom;
-        changed = 1;
+        cpu_z80_remap(first_cpu, 0x0000, 0x4000);
     }
     if (page_tab[3] != newram) {
         page_tab[3] = newram;
-        changed = 1;
+        cpu_z80_remap(first_cpu, 0xc000, 0x4000);
+    }
+}
+
+static void io_spectrum_write(void *opaque, uint32_t addr, uint32_t data)
+{
+    if (zx_paging && (addr & 0x8002) == 0) {
+        io_page_write(opaque, addr, data);
+    }
+    /* 0xfffd selects an AY register, 0xbffd writes it */
+    if (zx_ay && (addr & 0x8002) == 0x8000) {
+        ay8910_write(zx_ay, !(addr & 0x4000), data);
     }
-    if (changed) {
-        cpu_interrupt(first_cpu, CPU_INTERRUPT_EXITTB);
-        tlb_flush(first_cpu, 1);
+    if ((addr & 1) == 0) {
+#ifdef IOPIPE_ENABLED
+        iopipe_write(&iopipe, (uint8_t)data);
+#else
+        zx_video_set_border(data & 0x7);
+        zx_beeper_write(data);
+#endif
     }
 }
 
@@ -129,31 +185,134 @@ static void main_cpu_reset(void *opaque)
 {
     CPUState *env = opaque;
     cpu_reset(env);
+
+    /* the paging latch is cleared by reset as well */
+    if (zx_paging) {
+        pagebyte = 0;
+        page_tab[0] = 8;
+        page_tab[3] = 0;
+        zx_video_set_screen(0);
+    }
 }
 
+/* The ULA raises the frame interrupt every 69888 T-states on the 48K and
+   every 70908 T-states on the 128K.  Frames are timed in CPU cycles; unless
+   -icount is in use, an interrupt that comes early is held back until the
+   host clock catches up, so that the guest runs at its real speed. */
+#define ZX_FRAME_TSTATES_48   69888
+#define ZX_FRAME_TSTATES_128  70908
+#define ZX_CPU_FREQ_48        3500000
+#define ZX_CPU_FREQ_128       3546900
+
+static Z80CycleTimer *zx_frame_timer;
 static QEMUTimer *zx_ula_timer;
+static uint64_t zx_frame_tstates;   /* frame length in T-states */
+static uint64_t zx_frame_start;     /* T-state of the last frame interrupt */
+static int64_t zx_frame_ticks;      /* frame length in vm_clock ticks */
+static int64_t zx_frame_due;        /* vm_clock time of the next frame */
 
-static void zx_50hz_timer(void *opaque)
+static void zx_frame_interrupt(CPUState *env)
 {
-    int64_t next_time;
+    cpu_interrupt(env, CPU_INTERRUPT_HARD);
+    cpu_z80_mod_cycle_timer(zx_frame_timer,
+                            zx_frame_start + zx_frame_tstates);
+    io_input_stale = 1;
 
+    zx_video_do_retrace(zx_frame_start);
+}
+
+static void zx_frame_cycle_timer(void *opaque)
+{
     CPUState *env = opaque;
-    cpu_interrupt(env, CPU_INTERRUPT_HARD);
+    int64_t now;
 
-    /* FIXME: not exactly 50 Hz */
-    next_time = qemu_get_clock(vm_clock) + muldiv64(1, ticks_per_sec, 50);
-    qemu_mod_timer(zx_ula_timer, next_time);
+    zx_frame_start += zx_frame_tstates;
 
-    zx_video_do_retrace();
+    if (!use_icount) {
+        now = qemu_get_clock(vm_clock);
+        if (now < zx_frame_due) {
+            qemu_mod_timer(zx_ula_timer, zx_frame_due);
+            return;
+        }
+        /* running behind the host clock, don't try to catch up */
+        zx_frame_due = MAX(zx_frame_due + zx_frame_ticks, now);
+    }
+    zx_frame_interrupt(env);
+}
+
+static void zx_50hz_timer(void *opaque)
+{
+    CPUState *env = opaque;
+
+    /* the frame ended early in host time; the CPU kept running (or sat
+       in HALT), so the frame really starts now */
+    zx_frame_start = env->tstates;
+    zx_frame_due += zx_frame_ticks;
+    zx_frame_interrupt(env);
 }
 
 static CPUState *zx_env;
 
-static void zx_timer_init(void)
+static void zx_timer_init(int is_128k)
 {
-    int64_t t = qemu_get_clock(vm_clock);
+    if (is_128k) {
+        zx_frame_tstates = ZX_FRAME_TSTATES_128;
+        zx_frame_ticks = muldiv64(ZX_FRAME_TSTATES_128, ticks_per_sec,
+                                  ZX_CPU_FREQ_128);
+    } else {
+        zx_frame_tstates = ZX_FRAME_TSTATES_48;
+        zx_frame_ticks = muldiv64(ZX_FRAME_TSTATES_48, ticks_per_sec,
+                                  ZX_CPU_FREQ_48);
+    }
     zx_ula_timer = qemu_new_timer(vm_clock, zx_50hz_timer, zx_env);
-    qemu_mod_timer(zx_ula_timer, t);
+    zx_frame_timer = cpu_z80_new_cycle_timer(zx_env, zx_frame_cycle_timer,
+                                             zx_env);
+    zx_frame_start = zx_env->tstates;
+    zx_frame_due = qemu_get_clock(vm_clock) + zx_frame_ticks;
+    cpu_z80_mod_cycle_timer(zx_frame_timer,
+                            zx_frame_start + zx_frame_tstates);
+}
+
+static void zx_save(QEMUFile *f, void *opaque)
+{
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        qemu_put_be32(f, page_tab[i]);
+    }
+    qemu_put_be32(f, pagebyte);
+
+    /* while the ULA timer is pending the frame cycle timer is idle */
+    qemu_put_timer(f, zx_ula_timer);
+    qemu_put_be64(f, zx_frame_start);
+    qemu_put_be64(f, zx_frame_due);
+}
+
+static int zx_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int i;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < 4; i++) {
+        page_tab[i] = qemu_get_be32(f);
+    }
+    pagebyte = qemu_get_be32(f);
+    tlb_flush(zx_env, 1);
+    zx_video_set_screen(pagebyte & 0x08);
+
+    qemu_get_timer(f, zx_ula_timer);
+    zx_frame_start = qemu_get_be64(f);
+    zx_frame_due = qemu_get_be64(f);
+    if (qemu_timer_pending(zx_ula_timer)) {
+        cpu_z80_del_cycle_timer(zx_frame_timer);
+    } else {
+        cpu_z80_mod_cycle_timer(zx_frame_timer,
+                                zx_frame_start + zx_frame_tstates);
+    }
+    return 0;
 }
 
 static const uint8_t halthack_oldip[16] =
@@ -163,185 +322,245 @@ static const uint8_t halthack_newip[16] =
 
 
 #ifdef IOPIPE_ENABLED
-static uint8_t iopipe_read(IOPipe *iop)
+static void iopipe_fd_write(void *opaque);
+
+/* write out what the pipe takes now, and the rest when it has room */
+static void iopipe_flush(IOPipe *iop)
 {
-    uint8_t val;
-    // fprintf(stderr, "%s: about to read from pipe\n", __PRETTY_FUNCTION__);
-
-    int ret; 
-    // read 1 byte from the pipe, we BLOCK if there's nothing to read.
-    while ((ret=read(iop->rdfd, &val, 1)) < 0)
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-                {
-                    // fprintf(stderr, "%s: read from pipe would block (ret=%d), waiting...\n", __PRETTY_FUNCTION__, ret);
-                    usleep(5*1000);
-                }
-            else
-                break;
+    unsigned int start, len;
+    int ret;
+
+    while (iop->out_head != iop->out_tail) {
+        start = iop->out_tail % IOPIPE_BUF_SIZE;
+        len = MIN(iop->out_head - iop->out_tail, IOPIPE_BUF_SIZE - start);
+        ret = write(iop->wrfd, iop->out_buf + start, len);
+        if (ret <= 0) {
+            break;
         }
-    
-    if (ret > 0){
-        // fprintf(stderr, "%s: read byte %02X from io pipe\n", __PRETTY_FUNCTION__, val);
-        return val;
+        iop->out_tail += ret;
     }
-    else {
-        perror(__PRETTY_FUNCTION__);
-        fprintf(stderr, "%s: error while reading from io pipe\n", __PRETTY_FUNCTION__);
+    qemu_set_fd_handler(iop->wrfd, NULL,
+                        iop->out_head != iop->out_tail ? iopipe_fd_write
+                                                       : NULL, iop);
+}
+
+static void iopipe_fd_write(void *opaque)
+{
+    iopipe_flush(opaque);
+}
+
+static int iopipe_can_read(void *opaque)
+{
+    IOPipe *iop = opaque;
+
+    return iop->in_head - iop->in_tail < IOPIPE_BUF_SIZE;
+}
+
+static void iopipe_fd_read(void *opaque);
+
+static int iopipe_open_read(IOPipe *iop)
+{
+    iop->rdfd = open(iop->rd_path, O_RDONLY | O_NONBLOCK);
+    if (iop->rdfd == -1) {
+        return -1;
+    }
+    qemu_set_fd_handler2(iop->rdfd, iopipe_can_read, iopipe_fd_read, NULL,
+                         iop);
+    return 0;
+}
+
+static void iopipe_fd_read(void *opaque)
+{
+    IOPipe *iop = opaque;
+    uint8_t buf[IOPIPE_BUF_SIZE];
+    int ret, i;
+
+    ret = read(iop->rdfd, buf,
+               IOPIPE_BUF_SIZE - (iop->in_head - iop->in_tail));
+    if (ret == 0) {
+        /* the writer went away; wait for the next one */
+        qemu_set_fd_handler2(iop->rdfd, NULL, NULL, NULL, NULL);
+        close(iop->rdfd);
+        if (iopipe_open_read(iop) < 0) {
+            fprintf(stderr, "%s: failed to reopen read pipe %s\n", __PRETTY_FUNCTION__, iop->rd_path);
+        }
+        return;
+    }
+    if (ret < 0) {
+        return;
+    }
+    for (i = 0; i < ret; i++) {
+        iop->in_buf[iop->in_head++ % IOPIPE_BUF_SIZE] = buf[i];
+    }
+    cpu_z80_io_wake(zx_env);
+}
+
+static uint8_t iopipe_read(IOPipe *iop)
+{
+    if (iop->in_head == iop->in_tail) {
+        /* the guest is waiting for an answer to what it wrote */
+        iopipe_flush(iop);
+        if (IOPIPE_BLOCKING) {
+            cpu_z80_io_stall(zx_env);
+        }
         return 0xff;
     }
+    return iop->in_buf[iop->in_tail++ % IOPIPE_BUF_SIZE];
 }
 
-static int iopipe_write(IOPipe *iop, uint8_t data)
+static uint8_t iopipe_status(IOPipe *iop)
 {
-    int ret = write(iop->wrfd, &data, 1); // write 1 byte to the pipe
-    if (ret > 0){
-        // fprintf(stderr, "%s: wrote byte %02X to io pipe\n", __PRETTY_FUNCTION__, data);
+    if (iop->in_head == iop->in_tail) {
+        iopipe_flush(iop);
         return 0;
     }
-    else {
-        fprintf(stderr, "%s: error while writing to io pipe\n", __PRETTY_FUNCTION__);
-        return -1;
+    return IOPIPE_STATUS_DATA;
+}
+
+static int iopipe_write(IOPipe *iop, uint8_t data)
+{
+    if (iop->out_head - iop->out_tail == IOPIPE_BUF_SIZE) {
+        iopipe_flush(iop);
+        if (iop->out_head - iop->out_tail == IOPIPE_BUF_SIZE) {
+            fprintf(stderr, "%s: error while writing to io pipe\n", __PRETTY_FUNCTION__);
+            return -1;
+        }
     }
+    iop->out_buf[iop->out_head++ % IOPIPE_BUF_SIZE] = data;
+    if (iop->out_head - iop->out_tail == 1) {
+        qemu_set_fd_handler(iop->wrfd, NULL, iopipe_fd_write, iop);
+    }
+    return 0;
 }
 
 static int iopipe_init(IOPipe *iop)
 {
-    int rdfd, wrfd;
-
-    rdfd = open(iop->rd_path, O_RDONLY | O_NONBLOCK);
-    if (rdfd == -1){
+    if (iopipe_open_read(iop) < 0) {
         fprintf(stderr, "%s: failed to open read pipe %s\n", __PRETTY_FUNCTION__, iop->rd_path);
         return -1;
     }
-    
-    wrfd = open(iop->wr_path, O_WRONLY | O_NONBLOCK);
-    if (wrfd == -1){
+
+    iop->wrfd = open(iop->wr_path, O_WRONLY | O_NONBLOCK);
+    if (iop->wrfd == -1){
         fprintf(stderr, "%s: failed to open write pipe %s\n", __PRETTY_FUNCTION__, iop->wr_path);
         perror(__PRETTY_FUNCTION__);
         return -2;
     }
-
-    iop->rdfd = rdfd;
-    iop->wrfd = wrfd;
     return 0;
 }
 #endif 
 
-static uint32_t io_file_read(void *opaque, uint32_t addr)
+/* Parse io_input_file into io_input_ports.  This is done when the file
+   changes, as seen at most once per frame, not on every IN. */
+static void io_input_parse(void)
 {
-    int p;
+    FILE *input_file_fd;
+    char line[255];
+    int lineno = 0;
+    unsigned int port, value;
 
     /* default value for unspecified input ports readings */
-    uint32_t deflt = 0x00; //TODO: maybe rand() % 256
-
-    for (p=0; p<256; p++) 
-        io_input_ports[p]=(uint8_t) deflt;
+    memset(io_input_ports, 0x00, sizeof(io_input_ports));
 
-    // fprintf(stderr, "%s: port %x value %x\n", __PRETTY_FUNCTION__, (uint8_t)addr, (uint8_t)deflt);
-    
-    FILE *input_file_fd;
     input_file_fd = fopen(io_input_file, "r");
+    if (!input_file_fd) {
+        fprintf(stderr, "ERROR at %s: failed to open file %s for reading.\n", __PRETTY_FUNCTION__, io_input_file);
+        perror(__PRETTY_FUNCTION__);
+        return;
+    }
+    while (fgets(line, 255, input_file_fd)) {
+        lineno++;
+        if (sscanf(line, "0x%02X: 0x%02X \n", &port, &value) >= 2)
+            io_input_ports[(uint8_t)port]=(uint8_t)value;
+        else
+            fprintf(stderr, "WARNING -- ignoring malformed input port specification line: %s (%s:%d).\n", line, io_input_file, lineno);
+    }
+    fclose(input_file_fd);
+}
 
-    if (input_file_fd) {
-        char line[255];
-        int lineno = 0;
-        unsigned int port, value;
-
-        while (fgets(line, 255, input_file_fd)) {
-            lineno++;
-            if (sscanf(line, "0x%02X: 0x%02X \n", &port, &value) >= 2)
-                io_input_ports[(uint8_t)port]=(uint8_t)value;
-            else 
-                fprintf(stderr, "WARNING -- ignoring malformed input port specification line: %s (%s:%d).\n", line, io_input_file, lineno);
+/* a rewrite in place changes mtime or size, a rename the inode.  The
+   mtime may only count seconds, and a rewrite keeping the size can come
+   in the second the file was last parsed: until that second is over, the
+   file is parsed again every frame. */
+static int io_input_same(const struct stat *st)
+{
+    if (st->st_mtime != io_input_stat.st_mtime ||
+        st->st_size != io_input_stat.st_size ||
+        st->st_ino != io_input_stat.st_ino) {
+        return 0;
+    }
+#if defined(__linux__)
+    if (st->st_mtim.tv_nsec != io_input_stat.st_mtim.tv_nsec) {
+        return 0;
+    }
+#endif
+    return st->st_mtime < io_input_load_time;
+}
 
+static void io_input_check(void)
+{
+    struct stat st;
+    time_t now;
 
-        }
+    io_input_stale = 0;
+    now = time(NULL);
+    if (stat(io_input_file, &st) < 0) {
+        memset(&st, 0, sizeof(st));
     }
-    else {
-        fprintf(stderr, "ERROR at %s: failed to open file %s for reading.\n", __PRETTY_FUNCTION__, io_input_file);
-        perror(__PRETTY_FUNCTION__);
+    if (io_input_loaded && io_input_same(&st)) {
+        return;
     }
+    io_input_stat = st;
+    io_input_load_time = now;
+    io_input_loaded = 1;
+    io_input_parse();
+}
 
-    /* finally, close the file */
-    if (input_file_fd) {
-        fclose(input_file_fd);
+static uint32_t io_file_read(void *opaque, uint32_t addr)
+{
+    if (io_input_stale) {
+        io_input_check();
     }
-
-    /* return the value read */
     return (uint32_t) io_input_ports[(uint8_t)addr];
 }
 
+/* the binary map is read as the harness writes it */
+static uint32_t io_map_read(void *opaque, uint32_t addr)
+{
+    return io_input_map_ports[(uint8_t)addr];
+}
 
-static void io_file_write(void *opaque, uint32_t addr, uint32_t data)
+static int io_input_map_init(void)
 {
-    // fprintf(stderr, "%s: about to write to io_output_file: %s\n", __PRETTY_FUNCTION__, io_output_file);
-    
-    /* get current PC from cpu state */
-    uint32_t pc = zx_env->pc;
-    //    fprintf(stderr, "INFO -- %s:    PC: 0x%04X  OUT port=0x%02X  value=0x%02X\n", __PRETTY_FUNCTION__, pc, (uint8_t)addr, (uint8_t)data);
-
-    fprintf(stderr, "INFO -- %s:    OUT port=0x%02X  value=0x%02X\n", __PRETTY_FUNCTION__, (uint8_t)addr, (uint8_t)data);
-
-    uint8_t port = (uint8_t)addr;
-    io_output_ports[port] = (uint8_t)data;
-
-    if (io_output_file)	{
-	FILE *output_file_fd;
-	output_file_fd = fopen(io_output_file, "w+");
-    
-	if (output_file_fd) {
-	    int p;
-	    const char *linefmt = "OUT Port 0x%02X:   0x%02X\r\n"; // ie: OUT Port 0x0A:\t 0xFF
-	    for (p=0; p < 256; p++) {
-		fprintf(output_file_fd, linefmt, p, io_output_ports[p]);
-	    }
-	}
-	else {
-	    fprintf(stderr, "ERROR at %s: failed to open file %s for writing.\n", __PRETTY_FUNCTION__, io_output_file);
-	    perror(__PRETTY_FUNCTION__);
-	}
-
-	/* finally, close the file */
-	if (output_file_fd) {
-	    fclose(output_file_fd);
-	}
-    }
-
-    if (io_output_log_file) {
-	
-	/* first, open the log file if neeeded */
-	if (!io_output_log_fd) {
-//	    fprintf(stderr, "%s: about to open io_output_log_file: %s\n",
-//		    __PRETTY_FUNCTION__, 
-//		    io_output_log_file);
-
-	    io_output_log_fd = fopen(io_output_log_file, "w");
-	    if (io_output_log_fd) {
-		//TODO: log info
-	    }
-	    else {
-		fprintf(stderr, "ERROR at %s: failed to open file %s for writing.\n",
-			__PRETTY_FUNCTION__,
-			io_output_log_file);
-		perror(__PRETTY_FUNCTION__);
-	    }
-	}
-
-	/* append to the output log file */
-	if (io_output_log_fd){             // sanity check
-	    const char *linefmt = "OUT(0x%02X):    0x%02X\r\n";
-
-
-	    
-	    /* write to the file */
-	    fprintf(io_output_log_fd, linefmt, port, io_output_ports[port]);
-	    fflush(io_output_log_fd);
-	}
-	else {
-	    fprintf(stderr, "ERROR -- cannot write to io-output-log file %s. fopen failed?", io_output_log_file);
-	}
+#ifndef _WIN32
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(io_input_map_file, O_RDONLY);
+    if (fd < 0) {
+        return -1;
     }
+    if (fstat(fd, &st) < 0 || st.st_size < 256) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, 256, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    io_input_map_ports = map;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+
+static void io_file_write(void *opaque, uint32_t addr, uint32_t data)
+{
+    io_output_write(zx_env->pc, addr, data);
 }
 
 
@@ -359,8 +578,9 @@ static void zx_spectrum_common_init(ram_addr_t ram_size,
     int rom_size;
     int ram_base, rom_base;
     CPUState *env;
-    // int port, pagebyte;
+    // int port;
     int haltaddr;
+    int flash;
 
     /* init CPUs */
     if (!cpu_model) {
@@ -368,7 +588,7 @@ static void zx_spectrum_common_init(ram_addr_t ram_size,
     }
     env = cpu_init(cpu_model);
     zx_env = env; // XXX
-    register_savevm("cpu", 0, 4, cpu_save, cpu_load, env);
+    register_savevm("cpu", 0, CPU_SAVE_VERSION, cpu_save, cpu_load, env);
     qemu_register_reset(main_cpu_reset, 0, env);
     main_cpu_reset(env);
 
@@ -428,28 +648,55 @@ static void zx_spectrum_common_init(ram_addr_t ram_size,
         qemu_free(filename);
     }
 
-    /* hack from xz80 adding HALT to the keyboard input loop to save CPU */
-    haltaddr = rom_base + 0x10b0 + 0x4000;
+    /* hack from xz80 adding HALT to the keyboard input loop to save CPU;
+       on the 128K the 48K BASIC ROM is the second one */
+    haltaddr = rom_base + 0x10b0 + (is_128k ? 0x4000 : 0);
     cpu_physical_memory_read(haltaddr, halthack_curip, 12);
     if (!memcmp(halthack_curip, halthack_oldip, 12)) {
         cpu_physical_memory_write_rom(haltaddr, halthack_newip, 12);
     }
 
     /* map entire I/O space */
-    if (io_output_file || io_output_log_file) 
+    if (io_output_file || io_output_log_file) {
         /* redirect OUTs to file if necessary*/
+        io_output_init(io_output_file, io_output_log_file);
         register_ioport_write(0, 0x10000, 1, io_file_write, NULL);
-    else 
+    } else
         register_ioport_write(0, 0x10000, 1, io_spectrum_write, NULL);
 
-    if (io_input_file)
+    if (io_input_map_file) {
+        if (io_input_map_init() < 0) {
+            fprintf(stderr, "qemu: could not map '%s', it must be at least "
+                    "256 bytes\n", io_input_map_file);
+            exit(1);
+        }
+        register_ioport_read(0, 0x10000, 1, io_map_read, NULL);
+    } else if (io_input_file)
         register_ioport_read (0, 0x10000, 1, io_file_read,  NULL);
     else
         register_ioport_read (0, 0x10000, 1, io_spectrum_read, NULL);
 
-    zx_video_init(ram_offset, is_128k);
+    zx_video_init(ram_base, ram_offset, is_128k);
     zx_keyboard_init();
-    zx_timer_init();
+    zx_timer_init(is_128k);
+    zx_beeper_init(is_128k ? ZX_CPU_FREQ_128 : ZX_CPU_FREQ_48);
+    if (is_128k) {
+        zx_ay = ay8910_init("ay8910", ZX_AY_CLOCK, NULL, NULL, NULL);
+    }
+    if (tape_file) {
+        flash = !tape_mode || !strcmp(tape_mode, "flash");
+        if (!flash && strcmp(tape_mode, "edge")) {
+            fprintf(stderr, "qemu: unknown tape mode '%s'\n", tape_mode);
+            exit(1);
+        }
+        if (zx_tape_init(env, tape_file, flash,
+                         is_128k ? ZX_CPU_FREQ_128 : ZX_CPU_FREQ_48,
+                         is_128k) < 0) {
+            fprintf(stderr, "qemu: could not load tape '%s'\n", tape_file);
+            exit(1);
+        }
+    }
+    register_savevm("zx_spectrum", 0, 1, zx_save, zx_load, NULL);
 
 #ifdef IOPIPE_ENABLED
     iopipe_init(&iopipe);
@@ -460,6 +707,7 @@ static void zx_spectrum_common_init(ram_addr_t ram_size,
         page_tab[1] = 5;
         page_tab[2] = 2;
         page_tab[3] = 0;
+        zx_paging = 1;
     }
 
 #ifdef CONFIG_LIBSPECTRUM
@@ -522,6 +770,7 @@ static void zx_spectrum_common_init(ram_addr_t ram_size,
                 pagebyte = libspectrum_snap_out_128_memoryport(snap);
                 page_tab[0] = 8 + !!(pagebyte & 0x10);
                 page_tab[3] = pagebyte & 0x7;
+                zx_video_set_screen(pagebyte & 0x08);
             } else {
                 /* page in 48K ROM */
                 page_tab[0] = 9;
@@ -0,0 +1,656 @@
+/*
+ * ZX Spectrum Tape Emulation
+ *
+ * This code is licensed under the GPL version 2
+ */
+#include "hw.h"
+#include "sysemu.h"
+#include "zx_tape.h"
+
+/* The image is read into memory and cut into blocks, which point into it.
+   A playing tape is a sequence of pulses; the level of EAR flips at the
+   start of each one.  Nothing runs while the guest is not looking: a read
+   of the EAR bit steps the tape up to the current T-state, so that the
+   cost is per pulse whatever the way the guest samples it.
+
+   In flash mode the ROM loader is trapped where it starts to wait for the
+   pilot tone.  A block the ROM could load is copied to memory at once and
+   the loader returns the way it would have at the end of the block; any
+   other block is played on EAR from then on. */
+
+#define TAPE_PILOT      2168            /* standard timings, in T-states */
+#define TAPE_SYNC1      667
+#define TAPE_SYNC2      735
+#define TAPE_ZERO       855
+#define TAPE_ONE        1710
+#define TAPE_PILOT_HDR  8063            /* pilot pulses before a header */
+#define TAPE_PILOT_DATA 3223
+#define TAPE_TAP_PAUSE  1000            /* ms after each block of a .tap */
+
+/* LD-BYTES in the 48K ROM: the CALL LD-EDGE-1 at LD-START and the final
+   RET, which goes back to SA/LD-RET */
+#define ROM_LD_START    0x056c
+#define ROM_LD_RET      0x05e2
+
+enum {
+    TAPE_DATA,                  /* pilot, sync and bits */
+    TAPE_PULSES,                /* 16-bit pulse lengths */
+    TAPE_DIRECT,                /* a level per bit */
+    TAPE_PAUSE,
+    TAPE_STOP,
+    TAPE_STOP48,                /* stop on the 48K only */
+};
+
+typedef struct {
+    int type;
+    int std;                    /* with the ROM's timings */
+    uint32_t pilot;
+    uint32_t pilot_count;
+    uint32_t sync1;
+    uint32_t sync2;
+    uint32_t zero;              /* T-states per sample for TAPE_DIRECT */
+    uint32_t one;
+    uint32_t last_bits;         /* bits used in the last byte */
+    uint32_t pause;             /* ms */
+    const uint8_t *data;
+    uint32_t len;               /* bytes, or pulses for TAPE_PULSES */
+} ZXTapeBlock;
+
+/* where the tape is within a block */
+enum {
+    PHASE_BLOCK,
+    PHASE_PILOT,
+    PHASE_SYNC1,
+    PHASE_SYNC2,
+    PHASE_BITS,
+    PHASE_PULSES,
+    PHASE_DIRECT,
+    PHASE_PAUSE,
+    PHASE_NEXT,
+};
+
+typedef struct {
+    uint8_t *image;
+    ZXTapeBlock *blocks;
+    int nb_blocks;
+    int flash;
+    int is_128k;
+    uint32_t cpu_freq;
+
+    int playing;
+    int block;
+    int phase;
+    uint32_t count;             /* pilot pulses left */
+    uint32_t pos;               /* bit or pulse within the block */
+    int half;                   /* second pulse of a bit */
+    int level;
+    uint64_t next_edge;         /* T-state the current pulse ends at */
+} ZXTapeState;
+
+static ZXTapeState zx_tape;
+
+static void tape_start(ZXTapeState *s, uint64_t now)
+{
+    if (s->block < s->nb_blocks) {
+        s->playing = 1;
+        s->phase = PHASE_BLOCK;
+        s->next_edge = now;
+    }
+}
+
+static inline uint32_t block_bits(ZXTapeBlock *b)
+{
+    return b->len ? (b->len - 1) * 8 + b->last_bits : 0;
+}
+
+static inline int block_bit(ZXTapeBlock *b, uint32_t pos)
+{
+    return (b->data[pos >> 3] >> (7 - (pos & 7))) & 1;
+}
+
+/* the pulse ending at next_edge is over: start the next one */
+static void tape_next_pulse(ZXTapeState *s)
+{
+    ZXTapeBlock *b;
+    uint32_t len = 0;
+
+    while (!len && s->playing) {
+        b = &s->blocks[s->block];
+        switch (s->phase) {
+        case PHASE_BLOCK:
+            s->pos = 0;
+            s->half = 0;
+            switch (b->type) {
+            case TAPE_DATA:
+                s->count = b->pilot_count;
+                s->phase = PHASE_PILOT;
+                break;
+            case TAPE_PULSES:
+                s->phase = PHASE_PULSES;
+                break;
+            case TAPE_DIRECT:
+                s->phase = PHASE_DIRECT;
+                break;
+            case TAPE_STOP48:
+                if (s->is_128k) {
+                    s->phase = PHASE_NEXT;
+                    break;
+                }
+                /* fall through */
+            case TAPE_STOP:
+                s->block++;
+                s->playing = 0;
+                break;
+            default:
+                s->phase = PHASE_PAUSE;
+                break;
+            }
+            break;
+        case PHASE_PILOT:
+            if (s->count) {
+                s->count--;
+                s->level ^= 1;
+                len = b->pilot;
+            } else {
+                s->phase = PHASE_SYNC1;
+            }
+            break;
+        case PHASE_SYNC1:
+            s->phase = PHASE_SYNC2;
+            if (b->sync1) {
+                s->level ^= 1;
+                len = b->sync1;
+            }
+            break;
+        case PHASE_SYNC2:
+            s->phase = PHASE_BITS;
+            if (b->sync2) {
+                s->level ^= 1;
+                len = b->sync2;
+            }
+            break;
+        case PHASE_BITS:
+            /* two pulses per bit */
+            if (s->pos < block_bits(b)) {
+                s->level ^= 1;
+                len = block_bit(b, s->pos) ? b->one : b->zero;
+                s->pos += s->half;
+                s->half ^= 1;
+            } else {
+                s->phase = PHASE_PAUSE;
+            }
+            break;
+        case PHASE_PULSES:
+            if (s->pos < b->len) {
+                s->level ^= 1;
+                len = lduw_le_p(b->data + 2 * s->pos);
+                s->pos++;
+            } else {
+                s->phase = PHASE_PAUSE;
+            }
+            break;
+        case PHASE_DIRECT:
+            if (s->pos < block_bits(b)) {
+                s->level = block_bit(b, s->pos);
+                len = b->zero;
+                s->pos++;
+            } else {
+                s->phase = PHASE_PAUSE;
+            }
+            break;
+        case PHASE_PAUSE:
+            /* the last pulse ends with the level going low */
+            s->phase = PHASE_NEXT;
+            if (b->pause) {
+                s->level = 0;
+                len = muldiv64(b->pause, s->cpu_freq, 1000);
+            }
+            break;
+        default:
+            s->block++;
+            s->phase = PHASE_BLOCK;
+            if (s->block >= s->nb_blocks) {
+                s->playing = 0;
+            }
+            break;
+        }
+    }
+    s->next_edge += len;
+}
+
+uint32_t zx_tape_ear(uint32_t value)
+{
+    ZXTapeState *s = &zx_tape;
+    uint64_t now = first_cpu->tstates;
+
+    if (!s->playing) {
+        return value;
+    }
+    while (s->playing && s->next_edge <= now) {
+        tape_next_pulse(s);
+    }
+    return (value & ~0x40) | (s->level ? 0x40 : 0);
+}
+
+/* flags of XOR and CP, as the loader leaves them; like the rest of the
+   CPU, without X and Y */
+static uint8_t flags_logic(uint8_t res)
+{
+    uint8_t f = res & CC_S;
+    uint8_t p = res;
+
+    p ^= p >> 4;
+    p ^= p >> 2;
+    p ^= p >> 1;
+    if (!(p & 1)) {
+        f |= CC_P;
+    }
+    if (!res) {
+        f |= CC_Z;
+    }
+    return f;
+}
+
+static uint8_t flags_cp(uint8_t a, uint8_t b)
+{
+    uint8_t res = a - b;
+    uint8_t f = CC_N | (res & CC_S);
+
+    if (!res) {
+        f |= CC_Z;
+    }
+    if ((a ^ b ^ res) & 0x10) {
+        f |= CC_H;
+    }
+    if ((a ^ b) & (a ^ res) & 0x80) {
+        f |= CC_P;
+    }
+    if (a < b) {
+        f |= CC_C;
+    }
+    return f;
+}
+
+/* Load (or verify, with carry reset in F') the block the way LD-BYTES
+   does: the flag byte must match A', then DE bytes go to IX on, then
+   comes the parity byte.  H is the running XOR of the bytes, L the last
+   byte.  A block that ends early is a timeout, with carry reset and L
+   holding the marker bit of the byte that never came. */
+static void tape_flash_load(CPUState *env, ZXTapeBlock *b)
+{
+    uint16_t ix = env->regs[R_IX];
+    uint16_t de = env->regs[R_DE];
+    int verify = !(env->regs[R_FX] & CC_C);
+    uint8_t byte = 0, parity = 0, mem;
+    uint8_t a = env->regs[R_A];
+    uint8_t f, b_reg = 0xb0, c_reg = env->regs[R_BC];
+    uint32_t pos = 0;
+
+    if (!b->len) {
+        goto timeout;
+    }
+    byte = b->data[pos++];
+    parity = byte;
+    if (byte != env->regs[R_AX]) {
+        a = env->regs[R_AX] ^ byte;
+        f = flags_logic(a);
+        goto done;
+    }
+    /* the border colour and EAR level the loader ends with */
+    c_reg = 0x01;
+    for (;;) {
+        if (pos >= b->len) {
+            goto timeout;
+        }
+        byte = b->data[pos++];
+        parity ^= byte;
+        if (!de) {
+            /* that was the parity byte */
+            a = parity;
+            f = flags_cp(parity, 1);
+            break;
+        }
+        if (verify) {
+            cpu_memory_rw_debug(env, ix, &mem, 1, 0);
+            if (mem != byte) {
+                a = mem ^ byte;
+                f = flags_logic(a);
+                break;
+            }
+        } else {
+            cpu_memory_rw_debug(env, ix, &byte, 1, 1);
+        }
+        ix++;
+        de--;
+    }
+    goto done;
+timeout:
+    a = 0;
+    f = CC_Z | CC_H;
+    b_reg = 0;
+    byte = 0x01;
+done:
+    env->regs[R_A] = a;
+    env->regs[R_F] = f;
+    env->regs[R_BC] = (b_reg << 8) | c_reg;
+    env->regs[R_DE] = de;
+    env->regs[R_HL] = (parity << 8) | byte;
+    env->regs[R_IX] = ix;
+    env->pc = ROM_LD_RET;
+}
+
+/* only the 48K ROM's loader is trapped, whichever ROM is paged in */
+static int tape_rom_paged(CPUState *env)
+{
+    static const uint8_t ld_start[3] = { 0xcd, 0xe7, 0x05 };
+    uint8_t buf[3];
+
+    cpu_memory_rw_debug(env, ROM_LD_START, buf, 3, 0);
+    if (memcmp(buf, ld_start, 3)) {
+        return 0;
+    }
+    cpu_memory_rw_debug(env, ROM_LD_RET, buf, 1, 0);
+    return buf[0] == 0xc9;
+}
+
+static int zx_tape_trap(CPUState *env, void *opaque)
+{
+    ZXTapeState *s = opaque;
+    ZXTapeBlock *b;
+
+    if (s->playing || !tape_rom_paged(env)) {
+        return 0;
+    }
+    if (!s->flash) {
+        tape_start(s, env->tstates);
+        return 0;
+    }
+
+    /* pauses and stops only matter to a tape that is playing */
+    while (s->block < s->nb_blocks &&
+           s->blocks[s->block].type >= TAPE_PAUSE) {
+        s->block++;
+    }
+    if (s->block >= s->nb_blocks) {
+        return 0;
+    }
+    b = &s->blocks[s->block];
+    if (!b->std) {
+        tape_start(s, env->tstates);
+        return 0;
+    }
+    tape_flash_load(env, b);
+    s->block++;
+    return 1;
+}
+
+static ZXTapeBlock *tape_new_block(ZXTapeState *s, int type)
+{
+    ZXTapeBlock *b;
+
+    s->blocks = qemu_realloc(s->blocks,
+                             (s->nb_blocks + 1) * sizeof(ZXTapeBlock));
+    b = &s->blocks[s->nb_blocks++];
+    memset(b, 0, sizeof(*b));
+    b->type = type;
+    b->last_bits = 8;
+    return b;
+}
+
+static void tape_std_block(ZXTapeState *s, const uint8_t *data,
+                           uint32_t len, uint32_t pause)
+{
+    ZXTapeBlock *b = tape_new_block(s, TAPE_DATA);
+
+    b->std = 1;
+    b->pilot = TAPE_PILOT;
+    b->pilot_count = (len && data[0] < 0x80) ? TAPE_PILOT_HDR
+                                             : TAPE_PILOT_DATA;
+    b->sync1 = TAPE_SYNC1;
+    b->sync2 = TAPE_SYNC2;
+    b->zero = TAPE_ZERO;
+    b->one = TAPE_ONE;
+    b->pause = pause;
+    b->data = data;
+    b->len = len;
+}
+
+static int tape_parse_tap(ZXTapeState *s, const uint8_t *p, int size)
+{
+    const uint8_t *end = p + size;
+    uint32_t len;
+
+    while (end - p >= 2) {
+        len = lduw_le_p(p);
+        p += 2;
+        if (len > end - p) {
+            return -1;
+        }
+        tape_std_block(s, p, len, TAPE_TAP_PAUSE);
+        p += len;
+    }
+    return 0;
+}
+
+static inline uint32_t ld24(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+/* Loops are unrolled.  Jumps, calls and selections are not followed; the
+   blocks are played in the order they are in the file. */
+static int tape_parse_tzx(ZXTapeState *s, const uint8_t *p, int size)
+{
+    const uint8_t *end = p + size;
+    ZXTapeBlock *b;
+    uint32_t len;
+    int id, loop_start = -1, loop_count = 0, i, n;
+
+    for (p += 10; p < end; p += len) {
+        id = *p++;
+        /* the length of the block after the ID, header included */
+        switch (id) {
+        case 0x10:
+            len = 4 + (end - p >= 4 ? lduw_le_p(p + 2) : 0);
+            break;
+        case 0x11:
+            len = 0x12 + (end - p >= 0x12 ? ld24(p + 0x0f) : 0);
+            break;
+        case 0x12:
+            len = 4;
+            break;
+        case 0x13:
+            len = 1 + (end - p >= 1 ? p[0] * 2 : 0);
+            break;
+        case 0x14:
+            len = 0x0a + (end - p >= 0x0a ? ld24(p + 0x07) : 0);
+            break;
+        case 0x15:
+            len = 0x08 + (end - p >= 0x08 ? ld24(p + 0x05) : 0);
+            break;
+        case 0x20:
+        case 0x23:
+        case 0x24:
+            len = 2;
+            break;
+        case 0x21:
+        case 0x30:
+            len = 1 + (end - p >= 1 ? p[0] : 0);
+            break;
+        case 0x22:
+        case 0x25:
+        case 0x27:
+            len = 0;
+            break;
+        case 0x26:
+            len = 2 + (end - p >= 2 ? lduw_le_p(p) * 2 : 0);
+            break;
+        case 0x28:
+        case 0x32:
+            len = 2 + (end - p >= 2 ? lduw_le_p(p) : 0);
+            break;
+        case 0x31:
+            len = 2 + (end - p >= 2 ? p[1] : 0);
+            break;
+        case 0x33:
+            len = 1 + (end - p >= 1 ? p[0] * 3 : 0);
+            break;
+        case 0x35:
+            len = 0x14 + (end - p >= 0x14 ? ldl_le_p(p + 0x10) : 0);
+            break;
+        case 0x5a:
+            len = 9;
+            break;
+        default:
+            /* 0x18, 0x19, 0x2a, 0x2b and any newer block */
+            len = 4 + (end - p >= 4 ? ldl_le_p(p) : 0);
+            break;
+        }
+        if (len > end - p) {
+            return -1;
+        }
+
+        switch (id) {
+        case 0x10:
+            tape_std_block(s, p + 4, lduw_le_p(p + 2), lduw_le_p(p));
+            break;
+        case 0x11:
+            b = tape_new_block(s, TAPE_DATA);
+            b->pilot = lduw_le_p(p);
+            b->sync1 = lduw_le_p(p + 2);
+            b->sync2 = lduw_le_p(p + 4);
+            b->zero = lduw_le_p(p + 6);
+            b->one = lduw_le_p(p + 8);
+            b->pilot_count = lduw_le_p(p + 0x0a);
+            b->last_bits = p[0x0c];
+            b->pause = lduw_le_p(p + 0x0d);
+            b->data = p + 0x12;
+            b->len = ld24(p + 0x0f);
+            break;
+        case 0x12:
+            b = tape_new_block(s, TAPE_DATA);
+            b->pilot = lduw_le_p(p);
+            b->pilot_count = lduw_le_p(p + 2);
+            break;
+        case 0x13:
+            b = tape_new_block(s, TAPE_PULSES);
+            b->data = p + 1;
+            b->len = p[0];
+            break;
+        case 0x14:
+            b = tape_new_block(s, TAPE_DATA);
+            b->zero = lduw_le_p(p);
+            b->one = lduw_le_p(p + 2);
+            b->last_bits = p[4];
+            b->pause = lduw_le_p(p + 5);
+            b->data = p + 0x0a;
+            b->len = ld24(p + 7);
+            break;
+        case 0x15:
+            b = tape_new_block(s, TAPE_DIRECT);
+            b->zero = lduw_le_p(p);
+            b->pause = lduw_le_p(p + 2);
+            b->last_bits = p[4];
+            b->data = p + 8;
+            b->len = ld24(p + 5);
+            break;
+        case 0x20:
+            b = tape_new_block(s, lduw_le_p(p) ? TAPE_PAUSE : TAPE_STOP);
+            b->pause = lduw_le_p(p);
+            break;
+        case 0x24:
+            loop_start = s->nb_blocks;
+            loop_count = lduw_le_p(p);
+            break;
+        case 0x25:
+            if (loop_start < 0) {
+                break;
+            }
+            n = s->nb_blocks - loop_start;
+            for (i = 1; i < loop_count; i++) {
+                s->blocks = qemu_realloc(s->blocks, (s->nb_blocks + n) *
+                                         sizeof(ZXTapeBlock));
+                memcpy(s->blocks + s->nb_blocks, s->blocks + loop_start,
+                       n * sizeof(ZXTapeBlock));
+                s->nb_blocks += n;
+            }
+            loop_start = -1;
+            break;
+        case 0x2a:
+            tape_new_block(s, TAPE_STOP48);
+            break;
+        default:
+            break;
+        }
+    }
+    return 0;
+}
+
+static void zx_tape_save(QEMUFile *f, void *opaque)
+{
+    ZXTapeState *s = opaque;
+
+    qemu_put_sbe32(f, s->playing);
+    qemu_put_sbe32(f, s->block);
+    qemu_put_sbe32(f, s->phase);
+    qemu_put_be32(f, s->count);
+    qemu_put_be32(f, s->pos);
+    qemu_put_sbe32(f, s->half);
+    qemu_put_sbe32(f, s->level);
+    qemu_put_be64(f, s->next_edge);
+}
+
+static int zx_tape_load(QEMUFile *f, void *opaque, int version_id)
+{
+    ZXTapeState *s = opaque;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+    s->playing = qemu_get_sbe32(f);
+    s->block = qemu_get_sbe32(f);
+    s->phase = qemu_get_sbe32(f);
+    s->count = qemu_get_be32(f);
+    s->pos = qemu_get_be32(f);
+    s->half = qemu_get_sbe32(f);
+    s->level = qemu_get_sbe32(f);
+    s->next_edge = qemu_get_be64(f);
+    /* the image may not be the one that was saved with */
+    if (s->block < 0 || s->block >= s->nb_blocks) {
+        s->block = s->nb_blocks;
+        s->playing = 0;
+    }
+    return 0;
+}
+
+int zx_tape_init(CPUState *env, const char *filename, int flash,
+                 uint32_t cpu_freq, int is_128k)
+{
+    ZXTapeState *s = &zx_tape;
+    int size, ret;
+
+    size = get_image_size(filename);
+    if (size < 0) {
+        return -1;
+    }
+    s->image = qemu_malloc(size);
+    if (load_image(filename, s->image) != size) {
+        return -1;
+    }
+    if (size >= 10 && !memcmp(s->image, "ZXTape!\x1a", 8)) {
+        ret = tape_parse_tzx(s, s->image, size);
+    } else {
+        ret = tape_parse_tap(s, s->image, size);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "%s: truncated, %d blocks used\n", filename,
+                s->nb_blocks);
+    }
+
+    s->flash = flash;
+    s->cpu_freq = cpu_freq;
+    s->is_128k = is_128k;
+    cpu_z80_set_trap(env, ROM_LD_START, zx_tape_trap, s);
+    register_savevm("zx_tape", 0, 1, zx_tape_save, zx_tape_load, s);
+    return 0;
+}
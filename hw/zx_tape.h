@@ -0,0 +1,15 @@
+#ifndef HW_ZX_TAPE_H
+#define HW_ZX_TAPE_H
+/* ZX Spectrum Tape */
+
+/* filename is a .tap or .tzx image.  With flash set, the ROM loader is
+   trapped and standard blocks are copied straight to memory; otherwise,
+   and for blocks the ROM could not load, the tape is played on EAR.
+   cpu_freq is the clock the pulse lengths are counted in. */
+int zx_tape_init(CPUState *env, const char *filename, int flash,
+                 uint32_t cpu_freq, int is_128k);
+/* value, a read of port 0xfe, with EAR (bit 6) from the tape if it is
+   playing */
+uint32_t zx_tape_ear(uint32_t value);
+
+#endif
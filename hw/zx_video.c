@@ -28,6 +28,7 @@
 #include "hw.h"
 #include "isa.h"
 #include "console.h"
+#include "exec-all.h"
 #include "zx_video.h"
 #include "pixel_ops.h"
 #include "pixel_ops_dup.h"
@@ -36,9 +37,53 @@ typedef unsigned int rgb_to_pixel_dup_func(unsigned int r,
                                            unsigned int g,
                                            unsigned int b);
 
+/* Writes to the ULA port and to the visible screen made once the ULA has
+   started on the frame are logged with their time, so that the lines
+   they affect can be drawn the way the ULA really showed them. */
+#define ZX_EVENTS_MAX 8192
+#define ZX_EV_BORDER  0xffff
+
+typedef struct {
+    uint32_t t;                 /* T-states since the frame interrupt */
+    uint16_t addr;              /* screen offset, or ZX_EV_BORDER */
+    uint8_t old;
+    uint8_t val;
+} ZXVEvent;
+
 typedef struct {
     DisplayState *ds;
     uint8_t *vram_ptr;
+    ram_addr_t vram_offset;
+    ram_addr_t ram_offset;
+    target_phys_addr_t ram_base;
+    int is_128k;
+    int screen;                 /* 128K: 0 = bank 5, 1 = bank 7 */
+    int vram_io;
+
+    /* bitmap and attributes the screen was last drawn from */
+    uint8_t shadow[0x1b00];
+    int drawn_flash;
+
+    /* ULA timing */
+    int line_tstates;
+    int first_row_tstates;      /* start of the first row of the output */
+    uint64_t frame_start;
+
+    ZXVEvent events[ZX_EVENTS_MAX];
+    int nb_events;
+    int events_lost;
+
+    /* the screen as it is replayed from the log */
+    uint8_t replay[0x1b00];
+    /* per output row: the border colour drawn (0xff if unknown), and
+       whether the row shows the replay rather than the current screen */
+    uint8_t *row_border;
+    uint8_t *row_replayed;
+    /* character rows to redraw once some of their lines stop showing
+       the replay */
+    uint8_t row_stale[24];
+    int replay_y0;
+    int replay_y1;
 
     int bwidth;
     int bheight;
@@ -48,7 +93,6 @@ typedef struct {
     int theight;
 
     int border;
-    int prevborder;
 
     int flash;
     int flashcount;
@@ -179,57 +223,257 @@ static inline int get_pixfmt_index(DisplayState *s)
 
 static ZXVState *zxvstate;
 
+/* bitmap offset of display line y */
+static inline int zx_line_offset(int y)
+{
+    return ((y & 0xc0) << 5) | ((y & 0x07) << 8) | ((y & 0x38) << 2);
+}
+
+/* display line of a bitmap offset */
+static inline int zx_offset_line(int addr)
+{
+    return ((addr >> 5) & 0xc0) | ((addr >> 8) & 0x07) | ((addr >> 2) & 0x38);
+}
+
+static void zx_video_log(ZXVState *s, int addr, int old, int val)
+{
+    uint64_t t;
+    ZXVEvent *e;
+
+    /* what happens before the first row is part of the frame anyway */
+    t = first_cpu->tstates - s->frame_start;
+    if (t < s->first_row_tstates || s->events_lost) {
+        return;
+    }
+    if (s->nb_events == ZX_EVENTS_MAX) {
+        s->events_lost = 1;
+        return;
+    }
+    e = &s->events[s->nb_events++];
+    e->t = t;
+    e->addr = addr;
+    e->old = old;
+    e->val = val;
+}
+
 void zx_video_set_border(int col)
 {
     ZXVState *s = zxvstate;
 
-    s->border = col;
+    if (col != s->border) {
+        zx_video_log(s, ZX_EV_BORDER, s->border, col);
+        s->border = col;
+    }
+};
+
+/* Stores to the pages of the screen on show come here, reads go straight
+   to RAM.  Only the screen bytes are logged; as for any RAM write,
+   translated code on the page is invalidated and the page is marked
+   dirty. */
+static void zx_vram_writeb(void *opaque, target_phys_addr_t addr,
+                           uint32_t val)
+{
+    ZXVState *s = opaque;
+    ram_addr_t ram_addr = addr;
+    uint8_t *p = qemu_get_ram_ptr(ram_addr);
+
+    tb_invalidate_phys_write(ram_addr, 1);
+    val &= 0xff;
+    if (ram_addr - s->vram_offset < 0x1b00 && *p != val) {
+        zx_video_log(s, ram_addr - s->vram_offset, *p, val);
+    }
+    *p = val;
+    phys_ram_dirty[ram_addr >> TARGET_PAGE_BITS] |= 0xff & ~CODE_DIRTY_FLAG;
+}
+
+static void zx_vram_writew(void *opaque, target_phys_addr_t addr,
+                           uint32_t val)
+{
+    zx_vram_writeb(opaque, addr, val);
+    zx_vram_writeb(opaque, addr + 1, val >> 8);
+}
+
+static void zx_vram_writel(void *opaque, target_phys_addr_t addr,
+                           uint32_t val)
+{
+    zx_vram_writew(opaque, addr, val);
+    zx_vram_writew(opaque, addr + 2, val >> 16);
+}
+
+static uint32_t zx_vram_readb(void *opaque, target_phys_addr_t addr)
+{
+    return ldub_p(qemu_get_ram_ptr(addr));
+}
+
+static uint32_t zx_vram_readw(void *opaque, target_phys_addr_t addr)
+{
+    return lduw_p(qemu_get_ram_ptr(addr));
+}
+
+static uint32_t zx_vram_readl(void *opaque, target_phys_addr_t addr)
+{
+    return ldl_p(qemu_get_ram_ptr(addr));
+}
+
+static CPUReadMemoryFunc *zx_vram_read[3] = {
+    zx_vram_readb,
+    zx_vram_readw,
+    zx_vram_readl,
 };
 
-void zx_video_do_retrace(void)
+static CPUWriteMemoryFunc *zx_vram_write[3] = {
+    zx_vram_writeb,
+    zx_vram_writew,
+    zx_vram_writel,
+};
+
+/* offset is the offset of a screen in RAM.  Whole pages are watched,
+   as a ROMD region cannot be split into subpages; the writes past the
+   screen are simply passed through.  The RAM pages are unassigned
+   first, or they would keep their region offset. */
+static void zx_video_watch(ZXVState *s, ram_addr_t offset, int watch)
+{
+    ram_addr_t size = TARGET_PAGE_ALIGN(0x1b00);
+
+    cpu_register_physical_memory(s->ram_base + offset, size,
+                                 IO_MEM_UNASSIGNED);
+    if (watch) {
+        cpu_register_physical_memory_offset(s->ram_base + offset, size,
+                                            (s->ram_offset + offset) |
+                                            s->vram_io | IO_MEM_ROMD,
+                                            s->ram_offset + offset);
+    } else {
+        cpu_register_physical_memory(s->ram_base + offset, size,
+                                     (s->ram_offset + offset) | IO_MEM_RAM);
+    }
+}
+
+/* the screen is read from the visible bank only, so writes to the other
+   one are not noticed until a flip repaints everything, and it stays
+   plain RAM */
+static void zx_video_map_screen(ZXVState *s)
+{
+    if (s->is_128k) {
+        zx_video_watch(s, (s->screen ? 5 : 7) << 14, 0);
+        zx_video_watch(s, (s->screen ? 7 : 5) << 14, 1);
+        s->vram_offset = s->ram_offset + ((s->screen ? 7 : 5) << 14);
+    } else {
+        zx_video_watch(s, 0, 1);
+        s->vram_offset = s->ram_offset;
+    }
+    s->vram_ptr = qemu_get_ram_ptr(s->vram_offset);
+}
+
+void zx_video_set_screen(int screen)
 {
     ZXVState *s = zxvstate;
 
-    if (++s->flashcount == 16) {
-        s->flashcount = 0;
-        s->invalidate = 1;
-        s->flash = !s->flash;
+    screen = !!screen;
+    if (!s->is_128k || s->screen == screen) {
+        return;
     }
+    s->screen = screen;
+    zx_video_map_screen(s);
+    /* the log refers to the other screen */
+    s->events_lost = 1;
+    s->invalidate = 1;
 }
 
-static void zx_draw_scanline(ZXVState *s1, uint8_t *d,
-                             const uint8_t *s, const uint8_t *as)
+/* draw 8 pixels of bitmap data in the colours of an attribute */
+static inline void zx_draw_byte(ZXVState *s, zx_draw_line_func *zx_draw_line,
+                                uint8_t *d, int data, int attrib)
 {
-    int x, x_incr;
-    zx_draw_line_func *zx_draw_line;
+    int fg, bg, bright, flash;
+
+    bright = (attrib & 0x40) >> 3;
+    flash = (attrib & 0x80) && s->flash;
+    if (flash) {
+        fg = (attrib >> 3) & 0x07;
+        bg = attrib & 0x07;
+    } else {
+        fg = attrib & 0x07;
+        bg = (attrib >> 3) & 0x07;
+    }
+    fg |= bright;
+    bg |= bright;
 
-    zx_draw_line = zx_draw_line_table[get_pixfmt_index(s1->ds)];
-    x_incr = (ds_get_bits_per_pixel(s1->ds) + 7) >> 3;
+    zx_draw_line(d, data, s->palette[fg] ^ s->palette[bg], s->palette[bg]);
+}
 
-    for (x = 0; x < 32; x++) {
-        int attrib, fg, bg, bright, flash;
+/* draw the lines in mask of the 8x8 character cell at row, col */
+static void zx_draw_cell(ZXVState *s, uint8_t *d, int row, int col, int mask)
+{
+    int y, attrib;
+    const uint8_t *src;
+    zx_draw_line_func *zx_draw_line;
 
-        attrib = *as;
-        bright = (attrib & 0x40) >> 3;
-        flash = (attrib & 0x80) && s1->flash;
-        if (flash) {
-            fg = (attrib >> 3) & 0x07;
-            bg = attrib & 0x07;
-        } else {
-            fg = attrib & 0x07;
-            bg = (attrib >> 3) & 0x07;
+    zx_draw_line = zx_draw_line_table[get_pixfmt_index(s->ds)];
+
+    attrib = s->vram_ptr[0x1800 + row * 32 + col];
+    src = s->vram_ptr + (((row & 0x18) << 8) | ((row & 0x07) << 5) | col);
+    for (y = 0; y < 8; y++) {
+        if (mask & (1 << y)) {
+            zx_draw_byte(s, zx_draw_line, d, src[y << 8], attrib);
         }
-        fg |= bright;
-        bg |= bright;
+        d += ds_get_linesize(s->ds);
+    }
+}
+
+/* draw display line y of the replayed screen */
+static void zx_draw_replay_line(ZXVState *s, uint8_t *d, int y)
+{
+    int col, x_incr;
+    const uint8_t *src, *attr;
+    zx_draw_line_func *zx_draw_line;
 
-        zx_draw_line(d, *s, s1->palette[fg] ^ s1->palette[bg], s1->palette[bg]);
+    zx_draw_line = zx_draw_line_table[get_pixfmt_index(s->ds)];
+    x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
 
+    src = s->replay + zx_line_offset(y);
+    attr = s->replay + 0x1800 + (y >> 3) * 32;
+    for (col = 0; col < 32; col++) {
+        zx_draw_byte(s, zx_draw_line, d, src[col], attr[col]);
         d += 8 * x_incr;
-        s++; as++;
     }
 }
 
-static void zx_border_row(ZXVState *s, uint8_t *d)
+/* whether the cell differs from the shadow copy, which is updated */
+static int zx_cell_changed(ZXVState *s, int row, int col, int flash_changed)
+{
+    int y, addr, attrib, changed;
+
+    addr = 0x1800 + row * 32 + col;
+    attrib = s->vram_ptr[addr];
+    changed = attrib != s->shadow[addr] || ((attrib & 0x80) && flash_changed);
+    s->shadow[addr] = attrib;
+
+    addr = ((row & 0x18) << 8) | ((row & 0x07) << 5) | col;
+    for (y = 0; y < 8; y++, addr += 0x100) {
+        if (s->vram_ptr[addr] != s->shadow[addr]) {
+            s->shadow[addr] = s->vram_ptr[addr];
+            changed = 1;
+        }
+    }
+    return changed;
+}
+
+/* the lines of a character row which show the current screen */
+static int zx_row_mask(ZXVState *s, int row)
+{
+    int y, mask;
+    const uint8_t *replayed;
+
+    replayed = s->row_replayed + s->bheight + row * 8;
+    mask = 0;
+    for (y = 0; y < 8; y++) {
+        if (!replayed[y]) {
+            mask |= 1 << y;
+        }
+    }
+    return mask;
+}
+
+static void zx_border_row(ZXVState *s, uint8_t *d, int border)
 {
     int x, x_incr;
     zx_draw_line_func *zx_draw_line;
@@ -238,12 +482,12 @@ static void zx_border_row(ZXVState *s, uint8_t *d)
     x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
 
     for (x = 0; x < s->twidth / 8; x++) {
-        zx_draw_line(d, 0xff, s->palette[s->border], 0);
+        zx_draw_line(d, 0xff, s->palette[border], 0);
         d += 8 * x_incr;
     }
 }
 
-static void zx_border_sides(ZXVState *s, uint8_t *d)
+static void zx_border_sides(ZXVState *s, uint8_t *d, int border)
 {
     int x, x_incr;
     zx_draw_line_func *zx_draw_line;
@@ -252,16 +496,149 @@ static void zx_border_sides(ZXVState *s, uint8_t *d)
     x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
 
     for (x = 0; x < s->bwidth / 8; x++) {
-        zx_draw_line(d, 0xff, s->palette[s->border], 0);
+        zx_draw_line(d, 0xff, s->palette[border], 0);
         d += 8 * x_incr;
     }
     d += s->swidth * x_incr;
     for (x = 0; x < s->bwidth / 8; x++) {
-        zx_draw_line(d, 0xff, s->palette[s->border], 0);
+        zx_draw_line(d, 0xff, s->palette[border], 0);
         d += 8 * x_incr;
     }
 }
 
+/* draw the border of output row r */
+static void zx_border_line(ZXVState *s, uint8_t *d, int r, int border)
+{
+    if (r < s->bheight || r >= s->theight - s->bheight) {
+        zx_border_row(s, d, border);
+    } else {
+        zx_border_sides(s, d, border);
+    }
+    s->row_border[r] = border;
+}
+
+/* whether display line y of the replay differs from the current screen */
+static int zx_replay_differs(ZXVState *s, int y)
+{
+    int addr;
+
+    addr = zx_line_offset(y);
+    if (memcmp(s->replay + addr, s->vram_ptr + addr, 32)) {
+        return 1;
+    }
+    addr = 0x1800 + (y >> 3) * 32;
+    return memcmp(s->replay + addr, s->vram_ptr + addr, 32) != 0;
+}
+
+/* At the end of a frame, the rows which looked different from the
+   current screen while the ULA drew them are drawn from the log; the
+   others are left to the refresh, which draws the current screen. */
+static void zx_replay_frame(ZXVState *s)
+{
+    uint32_t line_last[192], border_last, t;
+    int i, r, y, ev, border, x_incr, linesize;
+    ZXVEvent *e;
+    uint8_t *d;
+
+    /* rows left over from the previous frame */
+    for (r = 0; r < s->theight; r++) {
+        if (s->row_replayed[r]) {
+            s->row_replayed[r] = 2;
+        }
+    }
+
+    if (s->nb_events && !s->events_lost && !s->invalidate &&
+        s->rgb_to_pixel &&
+        ds_get_width(s->ds) == s->twidth &&
+        ds_get_height(s->ds) == s->theight) {
+        /* wind the screen back to the first row, noting when each line
+           was last written */
+        memcpy(s->replay, s->vram_ptr, 0x1b00);
+        border = s->border;
+        border_last = 0;
+        memset(line_last, 0, sizeof(line_last));
+        for (i = s->nb_events - 1; i >= 0; i--) {
+            e = &s->events[i];
+            if (e->addr == ZX_EV_BORDER) {
+                border = e->old;
+                border_last = MAX(border_last, e->t);
+            } else if (e->addr < 0x1800) {
+                s->replay[e->addr] = e->old;
+                y = zx_offset_line(e->addr);
+                line_last[y] = MAX(line_last[y], e->t);
+            } else {
+                s->replay[e->addr] = e->old;
+                y = ((e->addr - 0x1800) >> 5) * 8;
+                for (r = y; r < y + 8; r++) {
+                    line_last[r] = MAX(line_last[r], e->t);
+                }
+            }
+        }
+
+        x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
+        linesize = ds_get_linesize(s->ds);
+        d = ds_get_data(s->ds);
+        ev = 0;
+        for (r = 0; r < s->theight; r++, d += linesize) {
+            t = s->first_row_tstates + r * s->line_tstates;
+            for (; ev < s->nb_events && s->events[ev].t < t; ev++) {
+                e = &s->events[ev];
+                if (e->addr == ZX_EV_BORDER) {
+                    border = e->val;
+                } else {
+                    s->replay[e->addr] = e->val;
+                }
+            }
+
+            /* lines not written after they were drawn look the same */
+            y = r - s->bheight;
+            if (y >= 0 && y < s->sheight) {
+                if (!(line_last[y] >= t && zx_replay_differs(s, y)) &&
+                    !(border_last >= t && border != s->border)) {
+                    continue;
+                }
+                zx_border_line(s, d, r, border);
+                zx_draw_replay_line(s, d + s->bwidth * x_incr, y);
+            } else {
+                if (!(border_last >= t && border != s->border)) {
+                    continue;
+                }
+                zx_border_line(s, d, r, border);
+            }
+            s->row_replayed[r] = 1;
+            if (s->replay_y0 < 0) {
+                s->replay_y0 = r;
+            }
+            s->replay_y1 = r;
+        }
+    }
+
+    for (r = 0; r < s->theight; r++) {
+        if (s->row_replayed[r] == 2) {
+            s->row_replayed[r] = 0;
+            y = r - s->bheight;
+            if (y >= 0 && y < s->sheight) {
+                s->row_stale[y >> 3] = 1;
+            }
+        }
+    }
+}
+
+void zx_video_do_retrace(uint64_t frame_start)
+{
+    ZXVState *s = zxvstate;
+
+    zx_replay_frame(s);
+    s->frame_start = frame_start;
+    s->nb_events = 0;
+    s->events_lost = 0;
+
+    if (++s->flashcount == 16) {
+        s->flashcount = 0;
+        s->flash = !s->flash;
+    }
+}
+
 static void update_palette(ZXVState *s)
 {
     int i, r, g, b;
@@ -275,93 +652,164 @@ static void update_palette(ZXVState *s)
 
 static void zx_update_display(void *opaque)
 {
-    int y;
-    uint8_t *d;
+    int r, row, col, x0, x1, y0, y1, mask;
+    uint8_t *d, *drow;
     ZXVState *s = (ZXVState *)opaque;
-    uint32_t addr, attrib;
-    int x_incr;
-    int dirty = s->invalidate;
-    static int inited = 0;
-
-    x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
+    uint32_t addr;
+    int x_incr, linesize;
+    int full, dirty, stale, flash_changed;
 
-    if (unlikely(inited == 0)) {
+    if (unlikely(s->rgb_to_pixel == NULL)) {
         s->rgb_to_pixel = rgb_to_pixel_dup_table[get_pixfmt_index(s->ds)];
         update_palette(s);
-        inited = 1;
     }
 
     if (unlikely(ds_get_width(s->ds) != s->twidth ||
                  ds_get_height(s->ds) != s->theight)) {
         qemu_console_resize(s->ds, s->twidth, s->theight);
         s->invalidate = 1;
-        s->prevborder = -1;
     }
 
-    /* FIXME: need to allow for two screens, and to adjust for
-       video no longer being at physical address 0 */
-    dirty = 1;
-
-    if (!dirty) {
-        for (addr = 0; addr < 0x1b00; addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, VGA_DIRTY_FLAG)) {
-                dirty = 1;
-            }
+    x_incr = (ds_get_bits_per_pixel(s->ds) + 7) >> 3;
+    linesize = ds_get_linesize(s->ds);
+
+    full = s->invalidate;
+    if (full) {
+        /* the rows of the last replay are lost as well */
+        memset(s->row_border, 0xff, s->theight);
+        memset(s->row_replayed, 0, s->theight);
+        s->replay_y0 = -1;
+    }
+    dirty = 0;
+    for (addr = 0; addr < 0x1b00; addr += TARGET_PAGE_SIZE) {
+        if (cpu_physical_memory_get_dirty(s->vram_offset + addr,
+                                          VGA_DIRTY_FLAG)) {
+            dirty = 1;
         }
     }
-
-    if (dirty) {
-        d = ds_get_data(s->ds);
-        d += s->bheight * ds_get_linesize(s->ds);
-        d += s->bwidth * x_incr;
-
-        for (y = 0; y < 192; y++) {
-            addr = ((y & 0x07) << 8) | ((y & 0x38) << 2) | ((y & 0xc0) << 5);
-            attrib = 0x1800 | ((y & 0xf8) << 2);
-            zx_draw_scanline(s, d, s->vram_ptr + addr, s->vram_ptr + attrib);
-            d += ds_get_linesize(s->ds);
+    stale = 0;
+    for (row = 0; row < 24; row++) {
+        stale |= s->row_stale[row];
+    }
+    flash_changed = s->flash != s->drawn_flash;
+
+    /* only the character cells which differ from the shadow copy are
+       drawn, and each row of cells is updated from its first to its
+       last changed cell.  Lines showing the replay of the last frame
+       are left alone. */
+    if (full || dirty || stale || flash_changed) {
+        drow = ds_get_data(s->ds);
+        drow += s->bheight * linesize;
+        drow += s->bwidth * x_incr;
+
+        for (row = 0; row < 24; row++) {
+            mask = zx_row_mask(s, row);
+            x0 = -1;
+            x1 = -1;
+            d = drow;
+            for (col = 0; col < 32; col++) {
+                if ((zx_cell_changed(s, row, col, flash_changed) || full ||
+                     s->row_stale[row]) && mask) {
+                    zx_draw_cell(s, d, row, col, mask);
+                    if (x0 < 0) {
+                        x0 = col;
+                    }
+                    x1 = col;
+                }
+                d += 8 * x_incr;
+            }
+            s->row_stale[row] = 0;
+            if (x0 >= 0 && !full) {
+                dpy_update(s->ds, s->bwidth + x0 * 8, s->bheight + row * 8,
+                           (x1 - x0 + 1) * 8, 8);
+            }
+            drow += 8 * linesize;
         }
 
-        s->invalidate = 0;
-        cpu_physical_memory_reset_dirty(0, 0x1b00, VGA_DIRTY_FLAG);
+        s->drawn_flash = s->flash;
+        cpu_physical_memory_reset_dirty(s->vram_offset,
+                                        s->vram_offset + 0x1b00,
+                                        VGA_DIRTY_FLAG);
     }
 
-    if (s->border != s->prevborder) {
-        d = ds_get_data(s->ds);
-        for (y = 0; y < s->bheight; y++) {
-            zx_border_row(s, d + (y * ds_get_linesize(s->ds)));
-        }
-        for (y = s->bheight; y < s->theight - s->bheight; y++) {
-            zx_border_sides(s, d + (y * ds_get_linesize(s->ds)));
-        }
-        for (y = s->theight - s->bheight; y < s->theight; y++) {
-            zx_border_row(s, d + (y * ds_get_linesize(s->ds)));
+    y0 = -1;
+    y1 = -1;
+    d = ds_get_data(s->ds);
+    for (r = 0; r < s->theight; r++, d += linesize) {
+        if (!s->row_replayed[r] && s->row_border[r] != s->border) {
+            zx_border_line(s, d, r, s->border);
+            if (y0 < 0) {
+                y0 = r;
+            }
+            y1 = r;
         }
-        s->prevborder = s->border;
+    }
+    if (y0 >= 0 && !full) {
+        dpy_update(s->ds, 0, y0, s->twidth, y1 - y0 + 1);
     }
 
-    dpy_update(s->ds, 0, 0, s->twidth, s->theight);
+    if (s->replay_y0 >= 0 && !full) {
+        dpy_update(s->ds, 0, s->replay_y0, s->twidth,
+                   s->replay_y1 - s->replay_y0 + 1);
+    }
+    s->replay_y0 = -1;
+
+    if (full) {
+        dpy_update(s->ds, 0, 0, s->twidth, s->theight);
+        s->invalidate = 0;
+    }
 }
 
 static void zx_invalidate_display(void *opaque)
 {
     ZXVState *s = (ZXVState *)opaque;
     s->invalidate = 1;
-    s->prevborder = -1;
 }
 
-void zx_video_init(ram_addr_t zx_vram_offset, int is_128k)
+static void zx_video_save(QEMUFile *f, void *opaque)
+{
+    ZXVState *s = (ZXVState *)opaque;
+
+    qemu_put_be32(f, s->border);
+    qemu_put_be32(f, s->flash);
+    qemu_put_be32(f, s->flashcount);
+}
+
+static int zx_video_load(QEMUFile *f, void *opaque, int version_id)
+{
+    ZXVState *s = (ZXVState *)opaque;
+
+    if (version_id != 1) {
+        return -EINVAL;
+    }
+
+    s->border = qemu_get_be32(f);
+    s->flash = qemu_get_be32(f);
+    s->flashcount = qemu_get_be32(f);
+    /* the log is not saved; the frame is shown as it ends */
+    s->events_lost = 1;
+    zx_invalidate_display(s);
+    return 0;
+}
+
+void zx_video_init(target_phys_addr_t ram_base, ram_addr_t ram_offset,
+                   int is_128k)
 {
     ZXVState *s = qemu_mallocz(sizeof(ZXVState));
     zxvstate = s;
     s->invalidate = 1;
-    s->prevborder = -1;
     s->flashcount = 0;
+    s->ram_base = ram_base;
+    s->ram_offset = ram_offset;
+    s->is_128k = is_128k;
+    s->screen = 0;
+    s->vram_io = cpu_register_io_memory(0, zx_vram_read, zx_vram_write, s);
+    zx_video_map_screen(s);
+
+    /* the write handler needs the time of each store to the screen */
+    cpu_z80_time_stores(first_cpu, 0x4000, 0x1b00);
     if (is_128k) {
-        // TODO: implement video page switching
-        s->vram_ptr = qemu_get_ram_ptr(zx_vram_offset + (5 << 14));
-    } else {
-        s->vram_ptr = qemu_get_ram_ptr(zx_vram_offset);
+        cpu_z80_time_stores(first_cpu, 0xc000, 0x1b00);
     }
 
     s->ds = graphic_console_init(zx_update_display, zx_invalidate_display,
@@ -375,4 +823,24 @@ void zx_video_init(ram_addr_t zx_vram_offset, int is_128k)
     s->theight = s->sheight + s->bheight * 2;
     s->border = 0;
     s->flash = 0;
+
+    s->row_border = qemu_malloc(s->theight);
+    memset(s->row_border, 0xff, s->theight);
+    s->row_replayed = qemu_mallocz(s->theight);
+    s->replay_y0 = -1;
+
+    /* the ULA starts the top left pixel of the screen 14336 T-states
+       (14364 on the 128K) after the frame interrupt, and takes two
+       pixels per T-state; the output starts with the border above and
+       left of it */
+    if (is_128k) {
+        s->line_tstates = 228;
+        s->first_row_tstates = 14364;
+    } else {
+        s->line_tstates = 224;
+        s->first_row_tstates = 14336;
+    }
+    s->first_row_tstates -= s->bheight * s->line_tstates + s->bwidth / 2;
+
+    register_savevm("zx_video", 0, 1, zx_video_save, zx_video_load, s);
 }
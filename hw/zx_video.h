@@ -2,8 +2,13 @@
 #define HW_ZX_VIDEO_H
 /* ZX Spectrum Video */
 
-void zx_video_init(ram_addr_t zx_vram_offset, int is_128k);
-void zx_video_do_retrace(void);
+/* ram_base is the physical address RAM is mapped at */
+void zx_video_init(target_phys_addr_t ram_base, ram_addr_t ram_offset,
+                   int is_128k);
+/* the frame interrupt; frame_start is its time in T-states */
+void zx_video_do_retrace(uint64_t frame_start);
 void zx_video_set_border(int col);
+/* 128K: show the normal screen (bank 5) or the shadow screen (bank 7) */
+void zx_video_set_screen(int screen);
 
 #endif
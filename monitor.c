@@ -1546,6 +1546,40 @@ static void do_inject_nmi(Monitor *mon, int cpu_index)
 }
 #endif
 
+#if defined(TARGET_Z80)
+static void do_z80prof(Monitor *mon, const char *cmd, const char *filename)
+{
+    CPUState *env;
+
+    env = mon_get_cpu();
+    if (!env)
+        return;
+    if (!strcmp(cmd, "start")) {
+        cpu_z80_prof_start(env);
+    } else if (!strcmp(cmd, "stop")) {
+        cpu_z80_prof_stop(env);
+    } else if (!strcmp(cmd, "dump")) {
+        if (!filename) {
+            monitor_printf(mon, "z80prof dump: missing file name\n");
+        } else if (cpu_z80_prof_dump(env, filename) < 0) {
+            monitor_printf(mon, "could not open '%s'\n", filename);
+        }
+    } else {
+        monitor_printf(mon, "invalid command '%s'\n", cmd);
+    }
+}
+
+static void do_info_z80prof(Monitor *mon)
+{
+    CPUState *env;
+
+    env = mon_get_cpu();
+    if (!env)
+        return;
+    cpu_z80_prof_info(env, (FILE *)mon, monitor_fprintf);
+}
+#endif
+
 static void do_info_status(Monitor *mon)
 {
     if (vm_running) {
@@ -1712,6 +1746,10 @@ static const mon_cmd_t info_cmds[] = {
       "", "show host USB devices", },
     { "profile", "", do_info_profile,
       "", "show profiling information", },
+#if defined(TARGET_Z80)
+    { "z80prof", "", do_info_z80prof,
+      "", "show the hottest blocks of the Z80 guest profiler", },
+#endif
     { "capture", "", do_info_capture,
       "", "show capture information" },
     { "snapshots", "", do_info_snapshots,
@@ -67,6 +67,8 @@ show USB devices plugged on the virtual USB hub
 show all USB host devices
 @item info profile
 show profiling information
+@item info z80prof
+show the hottest blocks of the Z80 guest profiler (Z80 only)
 @item info capture
 show information about active capturing
 @item info snapshots
@@ -461,6 +463,22 @@ ETEXI
 STEXI
 @item nmi @var{cpu}
 Inject an NMI on the given CPU (x86 only).
+ETEXI
+
+#if defined(TARGET_Z80)
+    { "z80prof", "ss?", do_z80prof,
+      "start|stop|dump [file]", "control the Z80 guest profiler" },
+#endif
+STEXI
+@item z80prof start|stop|dump [@var{file}]
+Control the Z80 guest profiler (Z80 only).  @code{start} discards the
+previous results and makes the code count how often each translated
+block runs, how many T-states, I/O accesses and code invalidations it
+accounts for.  Blocks are keyed by PC and by the physical address of
+their code, so the same code in different memory banks is reported
+separately.  @code{stop} freezes the counters, @code{info z80prof} shows
+the hottest blocks and @code{dump} writes all of them to @var{file}
+with their disassembly.
 ETEXI
 
     { "migrate", "-ds", do_migrate,
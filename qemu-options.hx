@@ -1448,6 +1448,30 @@ order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
 ETEXI
 
+DEF("idle-skip", 0, QEMU_OPTION_idle_skip, \
+    "-idle-skip      when the CPUs are halted waiting for an interrupt, advance\n" \
+    "                virtual time to the next timer instead of sleeping\n")
+STEXI
+@item -idle-skip
+When every CPU is halted waiting for an interrupt, advance virtual time
+straight to the next virtual timer instead of waiting for the host clock
+to reach it.  Guests that spend their time idle then run as fast as the
+host can emulate them, which suits batch runs without a display or audio.
+Virtual time runs ahead of real time.
+ETEXI
+
+DEF("tb-cache", HAS_ARG, QEMU_OPTION_tb_cache, \
+    "-tb-cache file  keep the code translated from ROM in 'file' across runs\n")
+STEXI
+@item -tb-cache @var{file}
+Save the host code translated from the guest ROM to @var{file} when QEMU
+exits, and load it back at the next start so that the firmware does not
+have to be translated again.  The file is ignored when it was written by
+a different QEMU binary or for a different machine or CPU model, and
+blocks whose ROM contents have changed are dropped.  Only available on
+x86_64 Linux hosts.
+ETEXI
+
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
     "-watchdog i6300esb|ib700\n" \
     "                enable virtual hardware watchdog [default=none]\n")
@@ -1579,10 +1603,20 @@ DEF("old-param", 0, QEMU_OPTION_old_param,
 DEF("io-input-file", HAS_ARG, QEMU_OPTION_io_input_file,
     "-io-input-file in_file\n"
     "                use in_file's contents as data for IN instructions\n")
+DEF("io-input-map", HAS_ARG, QEMU_OPTION_io_input_map,
+    "-io-input-map map_file\n"
+    "                read IN data from the 256-byte binary map_file, byte n being\n"
+    "                the value of port n, as it is written\n")
 DEF("io-output-file", HAS_ARG, QEMU_OPTION_io_output_file,
     "-io-output-file out_file\n"
     "                redirect OUT instructions output to out_file\n")
 DEF("io-output-log-file", HAS_ARG, QEMU_OPTION_io_output_log_file,
     "-io-output-log-file out_log_file\n"
     "                write a log of all OUT instructions to out_log_file\n")
+DEF("tape", HAS_ARG, QEMU_OPTION_tape,
+    "-tape file      insert the .tap or .tzx image 'file' in the tape player\n")
+DEF("tape-mode", HAS_ARG, QEMU_OPTION_tape_mode,
+    "-tape-mode flash|edge\n"
+    "                load standard blocks through the ROM loader at once (flash,\n"
+    "                the default) or play the whole tape in real time (edge)\n")
 #endif
@@ -29,6 +29,9 @@
 /* support for self modifying code even if the modified instruction is
    close to the modifying instruction */
 #define TARGET_HAS_PRECISE_SMC
+/* blocks of pages that keep rewriting their code can load their
+   immediate operands from memory (CF_SMC) */
+#define TARGET_HAS_SMC_OPERANDS
 
 #define TARGET_HAS_ICE 1
 
@@ -73,6 +76,25 @@
 #define CC_Z	0x0040
 #define CC_S    0x0080
 
+/* lazy condition code evaluation: the translator records the last
+   flag-producing operation in cc_op and F is only computed when needed */
+enum {
+    CC_OP_DYNAMIC, /* must use dynamic code to get cc_op */
+    CC_OP_FLAGS,   /* all flags are explicitly computed in F */
+
+    CC_OP_ADDB,    /* CC_DST = op1 + op2 (+ carry), not truncated,
+                      CC_SRC = op2, CC_SRC2 = op1 */
+    CC_OP_SUBB,    /* CC_DST = op1 - op2 (- carry), not truncated,
+                      CC_SRC = op2, CC_SRC2 = op1 */
+    CC_OP_LOGICB,  /* and/xor/or, rotates: CC_DST = res | (carry << 8),
+                      CC_SRC = H flag */
+    CC_OP_INCB,    /* CC_DST = res, CC_SRC = preserved C flag */
+    CC_OP_DECB,    /* CC_DST = res, CC_SRC = preserved C flag */
+    CC_OP_BITB,    /* CC_DST = T0 & mask, CC_SRC = preserved C flag */
+
+    CC_OP_NB,
+};
+
 /* hidden flags - used internally by qemu to represent additionnal cpu
    states. Only the CPL and INHIBIT_IRQ are not redundant. We avoid
    using the IOPL_MASK, TF_MASK and VM_MASK bit position to ease oring
@@ -100,6 +122,7 @@
 #define HF_OSFXSR_SHIFT     16 /* CR4.OSFXSR */
 #define HF_VM_SHIFT         17 /* must be same as eflags */
 #define HF_SMM_SHIFT        19 /* CPU in SMM mode */
+#define HF_PROF_SHIFT       20 /* block entries are counted by the profiler */
 
 #define HF_CPL_MASK          (3 << HF_CPL_SHIFT)
 #define HF_SOFTMMU_MASK      (1 << HF_SOFTMMU_SHIFT)
@@ -116,6 +139,7 @@
 #define HF_CS64_MASK         (1 << HF_CS64_SHIFT)
 #define HF_OSFXSR_MASK       (1 << HF_OSFXSR_SHIFT)
 #define HF_SMM_MASK          (1 << HF_SMM_SHIFT)
+#define HF_PROF_MASK         (1 << HF_PROF_SHIFT)
 
 #define EXCP00_DIVZ	0
 #define EXCP01_SSTP	1
@@ -138,6 +162,21 @@
 
 #define NB_MMU_MODES 2
 
+#define Z80_LOOP_COUNT_SIZE 64
+
+/* hot loop detection: the state of each loop head, hashed by the ram
+   address of its code, so that a bank switch does not carry it to other
+   code; tb_flush() forgets them all */
+#define Z80_LOOP_COLD     0
+#define Z80_LOOP_HOT      1     /* translate as a loop region */
+#define Z80_LOOP_REJECTED 2     /* not a region the translator can do */
+#define Z80_LOOP_HEAD_SIZE 256
+
+typedef struct Z80LoopHead {
+    uint32_t addr;
+    uint8_t state;
+} Z80LoopHead;
+
 typedef struct CPUZ80State {
 #if TARGET_LONG_BITS > HOST_LONG_BITS
     /* temporaries if we cannot store them in host registers */
@@ -150,6 +189,12 @@ typedef struct CPUZ80State {
     /* not sure if this is messy: */
     target_ulong regs[CPU_NB_REGS];
 
+    /* lazy condition codes, see CC_OP_xxx */
+    uint32_t cc_op;
+    target_ulong cc_src;
+    target_ulong cc_src2;
+    target_ulong cc_dst;
+
     int iff1;
     int iff2;
     int imode;
@@ -185,6 +230,28 @@ typedef struct CPUZ80State {
 
     int model;
 
+    /* T-state accounting, not cleared on reset */
+    uint64_t tstates;           /* T-states executed so far */
+    uint64_t tstate_deadline;   /* expiry of the first cycle timer */
+    struct Z80CycleTimer *cycle_timers;
+
+    /* ROM trap, see cpu_z80_set_trap() */
+    target_ulong trap_pc;
+    int (*trap_fn)(struct CPUZ80State *s, void *opaque);
+    void *trap_opaque;
+
+    /* addresses whose stores a board times, a bit per 256 bytes; see
+       cpu_z80_time_stores() */
+    uint32_t timed_stores[8];
+
+    /* I/O stall, see cpu_z80_io_stall() */
+    int io_stall;
+    int io_stalled;
+
+    /* executions of backward branches, hashed by target */
+    uint16_t loop_count[Z80_LOOP_COUNT_SIZE];
+    Z80LoopHead loop_heads[Z80_LOOP_HEAD_SIZE];
+
     /* in order to simplify APIC support, we leave this pointer to the
        user */
     struct APICState *apic_state;
@@ -195,6 +262,79 @@ void z80_translate_init(void);
 int cpu_z80_exec(CPUZ80State *s);
 void cpu_z80_close(CPUZ80State *s);
 int cpu_get_pic_interrupt(CPUZ80State *s);
+uint32_t cpu_z80_cc_compute_all(CPUZ80State *env1, int op);
+
+/* cycle timers: callbacks run from the cpu loop once the T-state counter
+   reaches their expiry */
+typedef void Z80CycleTimerCB(void *opaque);
+typedef struct Z80CycleTimer Z80CycleTimer;
+
+Z80CycleTimer *cpu_z80_new_cycle_timer(CPUZ80State *s, Z80CycleTimerCB *cb,
+                                       void *opaque);
+void cpu_z80_mod_cycle_timer(Z80CycleTimer *ts, uint64_t expire);
+void cpu_z80_del_cycle_timer(Z80CycleTimer *ts);
+void cpu_z80_run_cycle_timers(CPUZ80State *s);
+
+/* boards with banked memory translate CPU addresses through mapaddr; when
+   they change what is mapped at [start, start + size[ they call this to
+   drop the TLB entries of that window only */
+void cpu_z80_remap(CPUZ80State *s, target_ulong start, target_ulong size);
+
+/* ROM traps: the translator calls fn in place of the instruction at pc.
+   fn returns 0 to let the instruction run, or leaves the registers and
+   PC the way the trapped routine would have and returns 1.  The check is
+   made at translation time, so fn must look at the memory mapping itself
+   if the routine is banked. */
+typedef int Z80TrapFn(CPUZ80State *s, void *opaque);
+
+void cpu_z80_set_trap(CPUZ80State *s, target_ulong pc, Z80TrapFn *fn,
+                      void *opaque);
+
+/* A board whose memory write handler looks at the T-state counter calls
+   this for the CPU addresses it handles: the translator then brings the
+   counter up to date before every store that may hit [start, start + size[,
+   not only for I/O and at the end of the TB.  Code already translated is
+   dropped. */
+void cpu_z80_time_stores(CPUZ80State *s, target_ulong start,
+                         target_ulong size);
+
+/* An I/O read callback with no data for the guest yet can call
+   cpu_z80_io_stall(): the value it returns is dropped and the CPU halts
+   at the IN, which runs again when cpu_z80_io_wake() is called or an
+   interrupt comes. */
+void cpu_z80_io_stall(CPUZ80State *s);
+void cpu_z80_io_wake(CPUZ80State *s);
+
+static inline int cpu_z80_loop_state(const Z80LoopHead *heads,
+                                     uint32_t addr)
+{
+    const Z80LoopHead *h = &heads[addr % Z80_LOOP_HEAD_SIZE];
+
+    return h->addr == addr ? h->state : Z80_LOOP_COLD;
+}
+
+static inline void cpu_z80_set_loop_state(Z80LoopHead *heads, uint32_t addr,
+                                          int state)
+{
+    Z80LoopHead *h = &heads[addr % Z80_LOOP_HEAD_SIZE];
+
+    h->addr = addr;
+    h->state = state;
+}
+
+/* guest profiler: attributes executed blocks, T-states, I/O and code
+   invalidations to guest PC and bank */
+extern int z80_prof_active;
+
+void cpu_z80_prof_start(CPUZ80State *s);
+void cpu_z80_prof_stop(CPUZ80State *s);
+void cpu_z80_prof_info(CPUZ80State *s, FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
+int cpu_z80_prof_dump(CPUZ80State *s, const char *filename);
+void cpu_z80_prof_block(CPUZ80State *s, uint32_t pc, uint32_t phys,
+                        int size, int ninsns);
+void cpu_z80_prof_io(CPUZ80State *s);
+void cpu_z80_prof_smc(CPUZ80State *s);
 
 /* wrapper, just in case memory mappings must be changed */
 static inline void cpu_z80_set_cpl(CPUZ80State *s, int cpl)
@@ -231,6 +371,8 @@ void z80_cpu_list(FILE *f, int (*cpu_fprintf)(FILE *f, const char *fmt, ...));
 #define cpu_signal_handler cpu_z80_signal_handler
 #define cpu_list z80_cpu_list
 
+#define CPU_SAVE_VERSION 5
+
 /* MMU modes definitions */
 #define MMU_MODE0_SUFFIX _kernel
 #define MMU_MODE1_SUFFIX _user
@@ -256,6 +398,9 @@ static inline void cpu_get_tb_cpu_state(CPUState *env, target_ulong *pc,
     *pc = env->pc;
     *cs_base = 0;
     *flags = env->hflags;
+    if (z80_prof_active) {
+        *flags |= HF_PROF_MASK;
+    }
 }
 
 #endif /* CPU_Z80_H */
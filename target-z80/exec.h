@@ -62,6 +62,11 @@ register target_ulong T1 asm(AREG2);
 
 #define PC  (env->pc)
 
+#define CC_SRC  (env->cc_src)
+#define CC_SRC2 (env->cc_src2)
+#define CC_DST  (env->cc_dst)
+#define CC_OP   (env->cc_op)
+
 #include "cpu.h"
 #include "exec-all.h"
 
@@ -188,6 +193,14 @@ static inline int cpu_halted(CPUState *env)
         return 0;
     }
     //printf("%s: at PC 0x%x halted == %d, irq %d\n",__FUNCTION__, env->pc, env->halted,env->interrupt_request);
+    if (!cpu_has_work(env) && env->cycle_timers) {
+        /* a halted Z80 keeps executing NOPs, so skip straight to the next
+           cycle timer */
+        if (env->tstates < env->tstate_deadline) {
+            env->tstates = env->tstate_deadline;
+        }
+        cpu_z80_run_cycle_timers(env);
+    }
     if (cpu_has_work(env)) {
         env->halted = 0;
         return 0;
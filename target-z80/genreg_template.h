@@ -18,48 +18,56 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
  */
 
+/* The pair is a TCG global holding a 16-bit value; the bytes are
+   extracted from it and deposited into it. */
+
 /* Loads */
 
+#ifdef REGHIGH
 static inline void glue(gen_movb_v_,REGHIGH)(TCGv v)
 {
-    tcg_gen_ld8u_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 1));
+    tcg_gen_shri_tl(v, glue(cpu_,REGPAIR), 8);
 }
 
 static inline void glue(gen_movb_v_,REGLOW)(TCGv v)
 {
-    tcg_gen_ld8u_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_ext8u_tl(v, glue(cpu_,REGPAIR));
 }
+#endif
 
 static inline void glue(gen_movw_v_,REGPAIR)(TCGv v)
 {
-    tcg_gen_ld16u_tl(v, cpu_env,
-                     offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                             WORD_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_mov_tl(v, glue(cpu_,REGPAIR));
 }
 
 /* Stores */
 
+#ifdef REGHIGH
 static inline void glue(glue(gen_movb_,REGHIGH),_v)(TCGv v)
 {
-    tcg_gen_st8_tl(v, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 1));
+    TCGv tmp1 = tcg_temp_new();
+
+    tcg_gen_ext8u_tl(tmp1, v);
+    tcg_gen_shli_tl(tmp1, tmp1, 8);
+    tcg_gen_andi_tl(glue(cpu_,REGPAIR), glue(cpu_,REGPAIR), 0x00ff);
+    tcg_gen_or_tl(glue(cpu_,REGPAIR), glue(cpu_,REGPAIR), tmp1);
+
+    tcg_temp_free(tmp1);
 }
 
 static inline void glue(glue(gen_movb_,REGLOW),_v)(TCGv v)
 {
-    tcg_gen_st8_tl(v, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 0));
+    TCGv tmp1 = tcg_temp_new();
+
+    tcg_gen_ext8u_tl(tmp1, v);
+    tcg_gen_andi_tl(glue(cpu_,REGPAIR), glue(cpu_,REGPAIR), 0xff00);
+    tcg_gen_or_tl(glue(cpu_,REGPAIR), glue(cpu_,REGPAIR), tmp1);
+
+    tcg_temp_free(tmp1);
 }
+#endif
 
 static inline void glue(glue(gen_movw_,REGPAIR),_v)(TCGv v)
 {
-    tcg_gen_st16_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGPAIR)]) +
-                                            WORD_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_ext16u_tl(glue(cpu_,REGPAIR), v);
 }
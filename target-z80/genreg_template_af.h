@@ -18,66 +18,41 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
  */
 
+/* The two halves are separate TCG globals holding 8-bit values. */
+
 /* Loads */
 
 static inline void glue(gen_movw_v_,REGPAIR)(TCGv v)
 {
-    TCGv tmp1 = tcg_temp_new();
-
-    tcg_gen_ld8u_tl(tmp1, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGHIGH)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 0));
-    tcg_gen_shli_tl(tmp1, tmp1, 8);
-    tcg_gen_ld8u_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGLOW)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 0));
-    tcg_gen_or_tl(v, tmp1, v);
-
-    tcg_temp_free(tmp1);
+    tcg_gen_shli_tl(v, glue(cpu_,REGHIGH), 8);
+    tcg_gen_or_tl(v, v, glue(cpu_,REGLOW));
 }
 
 static inline void glue(gen_movb_v_,REGHIGH)(TCGv v)
 {
-    tcg_gen_ld8u_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGHIGH)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_mov_tl(v, glue(cpu_,REGHIGH));
 }
 
 static inline void glue(gen_movb_v_,REGLOW)(TCGv v)
 {
-    tcg_gen_ld8u_tl(v, cpu_env,
-                    offsetof(CPUState, regs[glue(R_,REGLOW)]) +
-                                            BYTE_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_mov_tl(v, glue(cpu_,REGLOW));
 }
 
 /* Stores */
 
 static inline void glue(glue(gen_movw_,REGPAIR),_v)(TCGv v)
 {
-    TCGv tmp1 = tcg_temp_new();
-
-    tcg_gen_shri_tl(tmp1, v, 8);
-    tcg_gen_st8_tl(tmp1, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGHIGH)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 0));
-    tcg_gen_ext8u_tl(tmp1, v);
-    tcg_gen_st8_tl(tmp1, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGLOW)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 0));
-
-    tcg_temp_free(tmp1);
+    tcg_gen_ext8u_tl(glue(cpu_,REGLOW), v);
+    tcg_gen_shri_tl(glue(cpu_,REGHIGH), v, 8);
+    tcg_gen_ext8u_tl(glue(cpu_,REGHIGH), glue(cpu_,REGHIGH));
 }
 
 static inline void glue(glue(gen_movb_,REGHIGH),_v)(TCGv v)
 {
-    tcg_gen_st8_tl(v, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGHIGH)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_ext8u_tl(glue(cpu_,REGHIGH), v);
 }
 
 static inline void glue(glue(gen_movb_,REGLOW),_v)(TCGv v)
 {
-    tcg_gen_st8_tl(v, cpu_env,
-                   offsetof(CPUState, regs[glue(R_,REGLOW)]) +
-                                           BYTE_OFFSET(cpu_env->regs[], 0));
+    tcg_gen_ext8u_tl(glue(cpu_,REGLOW), v);
 }
@@ -51,6 +51,7 @@ CPUZ80State *cpu_z80_init(const char *model)
         z80_translate_init();
     }
     env->model = id;
+    env->tstate_deadline = UINT64_MAX;
     cpu_reset(env);
     qemu_init_vcpu(env);
     return env;
@@ -96,6 +97,8 @@ static int cpu_z80_find_by_name(const char *name)
 /* NOTE: must be called outside the CPU execute loop */
 void cpu_reset(CPUZ80State *env)
 {
+    target_ulong (*mapaddr)(target_ulong addr) = env->mapaddr;
+
     if (qemu_loglevel_mask(CPU_LOG_RESET)) {
         qemu_log("CPU Reset (CPU %d)\n", env->cpu_index);
         log_cpu_state(env, 0);
@@ -103,6 +106,9 @@ void cpu_reset(CPUZ80State *env)
 
     memset(env, 0, offsetof(CPUZ80State, breakpoints));
 
+    /* the memory mapping is wired up by the board */
+    env->mapaddr = mapaddr;
+
     tlb_flush(env, 1);
 
     /* init to reset state */
@@ -118,6 +124,7 @@ void cpu_reset(CPUZ80State *env)
     env->regs[R_A] = 0xff;
     env->regs[R_F] = 0xff;
     env->regs[R_SP] = 0xffff;
+    env->cc_op = CC_OP_FLAGS;
 }
 
 void cpu_z80_close(CPUZ80State *env)
@@ -125,6 +132,95 @@ void cpu_z80_close(CPUZ80State *env)
     free(env);
 }
 
+/***********************************************************/
+/* cycle timers */
+
+struct Z80CycleTimer {
+    CPUZ80State *env;
+    uint64_t expire;
+    Z80CycleTimerCB *cb;
+    void *opaque;
+    struct Z80CycleTimer *next;
+};
+
+Z80CycleTimer *cpu_z80_new_cycle_timer(CPUZ80State *env, Z80CycleTimerCB *cb,
+                                       void *opaque)
+{
+    Z80CycleTimer *ts;
+
+    ts = qemu_mallocz(sizeof(Z80CycleTimer));
+    ts->env = env;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    return ts;
+}
+
+static void cpu_z80_update_deadline(CPUZ80State *env)
+{
+    env->tstate_deadline = env->cycle_timers ? env->cycle_timers->expire
+                                             : UINT64_MAX;
+}
+
+void cpu_z80_del_cycle_timer(Z80CycleTimer *ts)
+{
+    Z80CycleTimer **pt, *t;
+
+    pt = &ts->env->cycle_timers;
+    for (;;) {
+        t = *pt;
+        if (!t) {
+            break;
+        }
+        if (t == ts) {
+            *pt = t->next;
+            break;
+        }
+        pt = &t->next;
+    }
+    cpu_z80_update_deadline(ts->env);
+}
+
+/* modify the expiry (in T-states) of a timer and activate it; the list
+   is kept sorted so that the cpu loop only compares against the head */
+void cpu_z80_mod_cycle_timer(Z80CycleTimer *ts, uint64_t expire)
+{
+    Z80CycleTimer **pt, *t;
+
+    cpu_z80_del_cycle_timer(ts);
+
+    pt = &ts->env->cycle_timers;
+    for (;;) {
+        t = *pt;
+        if (!t || t->expire > expire) {
+            break;
+        }
+        pt = &t->next;
+    }
+    ts->expire = expire;
+    ts->next = *pt;
+    *pt = ts;
+    cpu_z80_update_deadline(ts->env);
+}
+
+void cpu_z80_run_cycle_timers(CPUZ80State *env)
+{
+    Z80CycleTimer *ts;
+
+    for (;;) {
+        ts = env->cycle_timers;
+        if (!ts || ts->expire > env->tstates) {
+            break;
+        }
+        /* remove timer from the list before calling the callback */
+        env->cycle_timers = ts->next;
+        ts->next = NULL;
+        cpu_z80_update_deadline(env);
+        ts->cb(ts->opaque);
+    }
+    /* the deadline may have been brought forward by cpu_exit() */
+    cpu_z80_update_deadline(env);
+}
+
 /***********************************************************/
 /* x86 debug */
 
@@ -132,13 +228,13 @@ void cpu_dump_state(CPUState *env, FILE *f,
                     int (*cpu_fprintf)(FILE *f, const char *fmt, ...),
                     int flags)
 {
-    int fl = env->regs[R_F];
+    int fl = cpu_z80_cc_compute_all(env, env->cc_op);
 
     cpu_fprintf(f, "AF =%04x BC =%04x DE =%04x HL =%04x IX=%04x\n"
                    "AF'=%04x BC'=%04x DE'=%04x HL'=%04x IY=%04x\n"
                    "PC =%04x SP =%04x F=[%c%c%c%c%c%c%c%c]\n"
-                   "IM=%i IFF1=%i IFF2=%i I=%02x R=%02x\n",
-                   (env->regs[R_A] << 8) | env->regs[R_F],
+                   "IM=%i IFF1=%i IFF2=%i I=%02x R=%02x T=%" PRIu64 "\n",
+                   (env->regs[R_A] << 8) | fl,
                    env->regs[R_BC],
                    env->regs[R_DE],
                    env->regs[R_HL],
@@ -158,7 +254,8 @@ void cpu_dump_state(CPUState *env, FILE *f,
                    fl & 0x04 ? 'P' : '-',
                    fl & 0x02 ? 'N' : '-',
                    fl & 0x01 ? 'C' : '-',
-                   env->imode, env->iff1, env->iff2, env->regs[R_I], env->regs[R_R]);
+                   env->imode, env->iff1, env->iff2, env->regs[R_I], env->regs[R_R],
+                   env->tstates);
 }
 
 /***********************************************************/
@@ -167,6 +264,55 @@ static void cpu_z80_flush_tlb(CPUZ80State *env, target_ulong addr)
     tlb_flush_page(env, addr);
 }
 
+/* translated code is looked up by RAM offset, so the blocks of a bank
+   that is switched out stay valid and are found again when it returns.
+   Blocks only chain to the same page, which is in the same window, and
+   the OUT that switches ends its block (gen_out_eob()), so no chain
+   leads from the new mapping into the old one. */
+void cpu_z80_remap(CPUZ80State *env, target_ulong start, target_ulong size)
+{
+    target_ulong addr;
+
+    for (addr = start & TARGET_PAGE_MASK; addr < start + size;
+         addr += TARGET_PAGE_SIZE) {
+        cpu_z80_flush_tlb(env, addr);
+    }
+}
+
+/* the code already translated at pc has no trap call */
+void cpu_z80_set_trap(CPUZ80State *env, target_ulong pc, Z80TrapFn *fn,
+                      void *opaque)
+{
+    env->trap_pc = pc;
+    env->trap_fn = fn;
+    env->trap_opaque = opaque;
+    tb_flush(env);
+}
+
+void cpu_z80_time_stores(CPUZ80State *env, target_ulong start,
+                         target_ulong size)
+{
+    target_ulong addr;
+
+    for (addr = start & ~0xff; addr < start + size; addr += 0x100) {
+        env->timed_stores[(addr >> 13) & 7] |= 1 << ((addr >> 8) & 31);
+    }
+    tb_flush(env);
+}
+
+void cpu_z80_io_stall(CPUZ80State *env)
+{
+    env->io_stall = 1;
+}
+
+void cpu_z80_io_wake(CPUZ80State *env)
+{
+    if (env->io_stalled) {
+        env->io_stalled = 0;
+        env->halted = 0;
+    }
+}
+
 /* return value:
    -1 = cannot handle fault
    0  = nothing more to do
@@ -204,15 +350,14 @@ int cpu_z80_handle_mmu_fault(CPUZ80State *env, target_ulong addr,
 
 target_phys_addr_t cpu_get_phys_page_debug(CPUState *env, target_ulong addr)
 {
-    uint32_t pte, paddr, page_offset, page_size;
+    uint32_t paddr, page_offset, page_size;
 
-    pte = addr;
     page_size = TARGET_PAGE_SIZE;
 
     if (env->mapaddr) {
         addr = env->mapaddr(addr);
     }
     page_offset = (addr & TARGET_PAGE_MASK) & (page_size - 1);
-    paddr = (pte & TARGET_PAGE_MASK) + page_offset;
+    paddr = (addr & TARGET_PAGE_MASK) + page_offset;
     return paddr;
 }
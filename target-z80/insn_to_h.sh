@@ -0,0 +1,127 @@
+#!/bin/sh
+
+# Expand the Z80 instruction table in insn.def (standard input) into the
+# C arrays of z80-insn.h (standard output), one 256-entry array per page.
+#
+# This code is licensed under the GPL version 2
+
+${AWK:-awk} '
+function fail(msg) {
+    print "insn.def:" NR ": " msg | "cat 1>&2"
+    err = 1
+    exit 1
+}
+
+function flags(s,    m, i, c) {
+    if (s == "-")
+        return 0
+    if (s == "*")
+        return 255
+    m = 0
+    for (i = 1; i <= length(s); i++) {
+        c = substr(s, i, 1)
+        if (!(c in flagbit))
+            fail("unknown flag " c)
+        m += flagbit[c]
+    }
+    return m
+}
+
+function kinds(s,    n, k, i, r) {
+    if (s == "-")
+        return "0"
+    n = split(s, k, ",")
+    r = ""
+    for (i = 1; i <= n; i++) {
+        if (!(k[i] in kindname))
+            fail("unknown kind " k[i])
+        r = r (i > 1 ? " | " : "") kindname[k[i]]
+    }
+    return r
+}
+
+function matches(pat, op,    i, c) {
+    for (i = 8; i >= 1; i--) {
+        c = substr(pat, i, 1)
+        if ((c == "0" && op % 2 == 1) || (c == "1" && op % 2 == 0))
+            return 0
+        op = int(op / 2)
+    }
+    return 1
+}
+
+BEGIN {
+    split("C N P X H Y Z S", f, " ")
+    for (i = 1; i <= 8; i++)
+        flagbit[f[i]] = 2 ^ (i - 1)
+
+    split("prefix jr jp call rst ret jump halt cond repeat io invalid undoc " \
+          "store", k, " ")
+    for (i in k) {
+        name = toupper(k[i])
+        kindname[k[i]] = "Z80_INSN_" name
+    }
+
+    opnd["-"] = "NONE"; opndlen["-"] = 0
+    opnd["n"] = "N";    opndlen["n"] = 1
+    opnd["nn"] = "NN";  opndlen["nn"] = 2
+    opnd["e"] = "E";    opndlen["e"] = 1
+    opnd["d"] = "D";    opndlen["d"] = 1
+    opnd["dn"] = "DN";  opndlen["dn"] = 2
+
+    npages = split("main xd cb xdcb ed", pages, " ")
+    for (i = 1; i <= npages; i++)
+        known[pages[i]] = 1
+}
+
+/^[ \t]*(#|$)/ { next }
+
+{
+    if (NF < 9)
+        fail("missing fields")
+    if (length($2) != 8)
+        fail("pattern " $2 " is not 8 bits")
+    if (!($3 in opnd))
+        fail("unknown operand " $3)
+    mnemonic = $9
+    for (i = 10; i <= NF; i++)
+        mnemonic = mnemonic " " $i
+    entry = sprintf("{ %d, %-14s %2d, %d, 0x%02x, 0x%02x, %s },",
+                    1 + opndlen[$3], "Z80_OPND_" opnd[$3] ",", $4, $5,
+                    flags($6), flags($7), kinds($8))
+    n = split($1, pg, ",")
+    for (i = 1; i <= n; i++) {
+        if (!(pg[i] in known))
+            fail("unknown page " pg[i])
+        for (op = 0; op < 256; op++) {
+            if (matches($2, op)) {
+                tab[pg[i], op] = entry
+                text[pg[i], op] = mnemonic
+            }
+        }
+    }
+}
+
+END {
+    if (err)
+        exit 1
+    for (i = 1; i <= npages; i++) {
+        for (op = 0; op < 256; op++) {
+            if (!((pages[i], op) in tab)) {
+                printf "insn.def: %s %02x is not covered\n", pages[i], op \
+                    | "cat 1>&2"
+                exit 1
+            }
+        }
+    }
+    print "/* generated from insn.def by insn_to_h.sh, do not edit */"
+    for (i = 1; i <= npages; i++) {
+        p = pages[i]
+        print ""
+        print "static const Z80Insn z80_insn_" p "[256] = {"
+        for (op = 0; op < 256; op++)
+            printf "    %s  /* %02x %s */\n", tab[p, op], op, text[p, op]
+        print "};"
+    }
+}
+'
@@ -1,11 +1,63 @@
 #include "hw/hw.h"
 #include "hw/boards.h"
 
+#include "exec-all.h"
+
 void cpu_save(QEMUFile *f, void *opaque)
 {
+    CPUState *env = opaque;
+    int i;
+
+    /* F lives in the lazy condition codes while the CPU runs */
+    env->regs[R_F] = cpu_z80_cc_compute_all(env, env->cc_op);
+    env->cc_op = CC_OP_FLAGS;
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        qemu_put_be16(f, env->regs[i]);
+    }
+    qemu_put_be16s(f, &env->pc);
+
+    qemu_put_byte(f, env->iff1);
+    qemu_put_byte(f, env->iff2);
+    qemu_put_byte(f, env->imode);
+    qemu_put_be32s(f, &env->hflags);
+
+    qemu_put_be32(f, env->halted);
+    qemu_put_be32(f, env->interrupt_request & CPU_INTERRUPT_HARD);
+
+    qemu_put_be64s(f, &env->tstates);
 }
 
 int cpu_load(QEMUFile *f, void *opaque, int version_id)
 {
+    CPUState *env = opaque;
+    int i;
+
+    if (version_id != CPU_SAVE_VERSION) {
+        return -EINVAL;
+    }
+
+    for (i = 0; i < CPU_NB_REGS; i++) {
+        env->regs[i] = qemu_get_be16(f);
+    }
+    qemu_get_be16s(f, &env->pc);
+    env->cc_op = CC_OP_FLAGS;
+
+    env->iff1 = qemu_get_byte(f);
+    env->iff2 = qemu_get_byte(f);
+    env->imode = qemu_get_byte(f);
+    qemu_get_be32s(f, &env->hflags);
+
+    env->halted = qemu_get_be32(f);
+    env->interrupt_request &= ~CPU_INTERRUPT_HARD;
+    env->interrupt_request |= qemu_get_be32(f) & CPU_INTERRUPT_HARD;
+
+    /* the boards re-arm their cycle timers when their own state is
+       loaded */
+    qemu_get_be64s(f, &env->tstates);
+
+    /* memory and paging have changed under the translated code */
+    tlb_flush(env, 1);
+    tb_flush(env);
     return 0;
 }
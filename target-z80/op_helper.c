@@ -17,6 +17,7 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston MA  02110-1301 USA
  */
+#include <string.h>
 #include "exec.h"
 #include "helper.h"
 
@@ -88,11 +89,13 @@ void do_interrupt(CPUZ80State *env)
         /* XXX: assuming 0xff on data bus */
     case 1:
         env->pc = 0x0038;
+        env->tstates += 13;
         break;
     case 2:
         /* XXX: assuming 0xff on data bus */
         d = 0xff;
         env->pc = lduw_kernel((env->regs[R_I] << 8) | d);
+        env->tstates += 19;
         break;
     }
 }
@@ -161,78 +164,7 @@ void HELPER(movl_pc_im)(uint32_t new_pc)
     PC = (uint16_t)new_pc;
 }
 
-/* Z80 instruction-specific helpers */
-
-/* Halt */
-
-void HELPER(halt)(void)
-{
-    //printf("halting at PC 0x%x\n",env->pc);
-    env->halted = 1;
-    env->hflags &= ~HF_INHIBIT_IRQ_MASK; /* needed if sti is just before */
-    env->exception_index = EXCP_HLT;
-    cpu_loop_exit();
-}
-
-/* In / Out */
-
-void HELPER(in_T0_im)(uint32_t val)
-{
-    //    T0 = cpu_inb(env, (A << 8) | val);
-    T0 = cpu_inb(env, val);
-}
-
-void HELPER(in_T0_bc_cc)(void)
-{
-    int sf, zf, pf;
-
-    T0 = cpu_inb(env, BC);
-
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[(uint8_t)T0];
-    F = (F & CC_C) | sf | zf | pf;
-}
-
-void HELPER(out_T0_im)(uint32_t val)
-{
-    // cpu_outb(env, (A << 8) | val, T0);
-    cpu_outb(env, val, T0);
-}
-
-void HELPER(out_T0_bc)(void)
-{
-    cpu_outb(env, BC, T0);
-}
-
-/* Misc */
-
-void HELPER(bit_T0)(uint32_t val)
-{
-    int sf, zf, pf;
-
-    sf = (T0 & val & 0x80) ? CC_S : 0;
-    zf = (T0 & val) ? 0 : CC_Z;
-    pf = (T0 & val) ? 0 : CC_P;
-    F = (F & CC_C) | sf | zf | CC_H | pf;
-}
-
-void HELPER(jmp_T0)(void)
-{
-    PC = T0;
-}
-
-void HELPER(djnz)(uint32_t pc1, uint32_t pc2)
-{
-    BC = (uint16_t)(BC - 0x0100);
-    if (BC & 0xff00) {
-        PC = (uint16_t)pc1;
-    } else {
-        PC = (uint16_t)pc2;
-    }
-}
-
-/* Arithmetic/logic operations */
+/* lazy condition codes */
 
 #define signed_overflow_add(op1, op2, res, size) \
     (!!((~(op1 ^ op2) & (op1 ^ res)) >> (size - 1)))
@@ -240,239 +172,266 @@ void HELPER(djnz)(uint32_t pc1, uint32_t pc2)
 #define signed_overflow_sub(op1, op2, res, size) \
     (!!((((1 << size) - 1) & ((op1 ^ op2) & (op1 ^ res))) >> (size - 1)))
 
-void HELPER(add_cc)(void)
+static uint32_t compute_all_addb(void)
 {
     int sf, zf, hf, pf, cf;
-    int tmp = A;
+    int src1 = CC_SRC2;
+    int src2 = CC_SRC;
+    int res = (uint8_t)CC_DST;
     int carry;
 
-    A = (uint8_t)(A + T0);
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    carry = (tmp & T0) | ((tmp | T0) & ~A);
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    carry = (src1 & src2) | ((src1 | src2) & ~res);
     hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_add(tmp, T0, A, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
+    pf = signed_overflow_add(src1, src2, res, 8) ? CC_P : 0;
+    cf = (CC_DST >> 8) & CC_C;
 
-    F = sf | zf | hf | pf | cf;
+    return sf | zf | hf | pf | cf;
 }
 
-void HELPER(adc_cc)(void)
+static uint32_t compute_all_subb(void)
 {
     int sf, zf, hf, pf, cf;
-    int tmp = A;
+    int src1 = CC_SRC2;
+    int src2 = CC_SRC;
+    int res = (uint8_t)CC_DST;
     int carry;
 
-    A = (uint8_t)(A + T0 + !!(F & CC_C));
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    carry = (tmp & T0) | ((tmp | T0) & ~A);
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    carry = (~src1 & src2) | (~(src1 ^ src2) & res);
     hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_add(tmp, T0, A, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
+    pf = signed_overflow_sub(src1, src2, res, 8) ? CC_P : 0;
+    cf = (CC_DST >> 8) & CC_C;
 
-    F = sf | zf | hf | pf | cf;
+    return sf | zf | hf | pf | CC_N | cf;
 }
 
-void HELPER(sub_cc)(void)
+static uint32_t compute_all_logicb(void)
 {
-    int sf, zf, hf, pf, cf;
-    int tmp = A;
-    int carry;
+    int sf, zf, pf, cf;
+    int res = (uint8_t)CC_DST;
 
-    A = (uint8_t)(A - T0);
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    carry = (~tmp & T0) | (~(tmp ^ T0) & A);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_sub(tmp, T0, A, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    pf = parity_table[res];
+    cf = (CC_DST >> 8) & CC_C;
 
-    F = sf | zf | hf | pf | CC_N | cf;
+    return sf | zf | CC_SRC | pf | cf;
 }
 
-void HELPER(sbc_cc)(void)
+static uint32_t compute_all_incb(void)
 {
-    int sf, zf, hf, pf, cf;
-    int tmp = A;
-    int carry;
+    int sf, zf, hf, pf;
+    int res = (uint8_t)CC_DST;
 
-    A = (uint8_t)(A - T0 - !!(F & CC_C));
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    carry = (~tmp & T0) | (~(tmp ^ T0) & A);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_sub(tmp, T0, A, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    hf = (res & 0x0f) == 0x00 ? CC_H : 0;
+    pf = res == 0x80 ? CC_P : 0;
 
-    F = sf | zf | hf | pf | CC_N | cf;
+    return CC_SRC | sf | zf | hf | pf;
 }
 
-void HELPER(and_cc)(void)
+static uint32_t compute_all_decb(void)
 {
-    int sf, zf, pf;
-    A = (uint8_t)(A & T0);
+    int sf, zf, hf, pf;
+    int res = (uint8_t)CC_DST;
 
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    pf = parity_table[(uint8_t)A];
-    F = sf | zf | CC_H | pf;
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    hf = (res & 0x0f) == 0x0f ? CC_H : 0;
+    pf = res == 0x7f ? CC_P : 0;
+
+    return CC_SRC | sf | zf | hf | CC_N | pf;
 }
 
-void HELPER(xor_cc)(void)
+static uint32_t compute_all_bitb(void)
 {
     int sf, zf, pf;
-    A = (uint8_t)(A ^ T0);
 
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    pf = parity_table[(uint8_t)A];
-    F = sf | zf | pf;
+    sf = (CC_DST & 0x80) ? CC_S : 0;
+    zf = CC_DST ? 0 : CC_Z;
+    pf = CC_DST ? 0 : CC_P;
+
+    return CC_SRC | sf | zf | CC_H | pf;
+}
+
+uint32_t HELPER(cc_compute_all)(uint32_t op)
+{
+    switch (op) {
+    default: /* should never happen */
+        return 0;
+    case CC_OP_FLAGS:
+        return F;
+    case CC_OP_ADDB:
+        return compute_all_addb();
+    case CC_OP_SUBB:
+        return compute_all_subb();
+    case CC_OP_LOGICB:
+        return compute_all_logicb();
+    case CC_OP_INCB:
+        return compute_all_incb();
+    case CC_OP_DECB:
+        return compute_all_decb();
+    case CC_OP_BITB:
+        return compute_all_bitb();
+    }
 }
 
-void HELPER(or_cc)(void)
-{
-    int sf, zf, pf;
-    A = (uint8_t)(A | T0);
-
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    pf = parity_table[(uint8_t)A];
-    F = sf | zf | pf;
+uint32_t HELPER(cc_compute_c)(uint32_t op)
+{
+    switch (op) {
+    default: /* should never happen */
+        return 0;
+    case CC_OP_FLAGS:
+        return F & CC_C;
+    case CC_OP_ADDB:
+    case CC_OP_SUBB:
+    case CC_OP_LOGICB:
+        return (CC_DST >> 8) & CC_C;
+    case CC_OP_INCB:
+    case CC_OP_DECB:
+    case CC_OP_BITB:
+        return CC_SRC;
+    }
 }
 
-void HELPER(cp_cc)(void)
+uint32_t cpu_z80_cc_compute_all(CPUZ80State *env1, int op)
 {
-    int sf, zf, hf, pf, cf;
-    int res, carry;
-
-    res = (uint8_t)(A - T0);
-    sf = (res & 0x80) ? CC_S : 0;
-    zf = res ? 0 : CC_Z;
-    carry = (~A & T0) | (~(A ^ T0) & res);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_sub(A, T0, res, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
+    CPUZ80State *saved_env;
+    uint32_t ret;
 
-    F = sf | zf | hf | pf | CC_N | cf;
-//  CC_DST = (uint8_t)(A - T0);
+    saved_env = env;
+    env = env1;
+    ret = helper_cc_compute_all(op);
+    env = saved_env;
+    return ret;
 }
 
-/* Rotation/shift operations */
+/* Z80 instruction-specific helpers */
 
-void HELPER(rlc_T0_cc)(void)
-{
-    int sf, zf, pf, cf;
-    int tmp;
+/* Halt */
 
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | !!(T0 & 0x80));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+void HELPER(halt)(void)
+{
+    //printf("halting at PC 0x%x\n",env->pc);
+    env->halted = 1;
+    env->io_stalled = 0;
+    env->hflags &= ~HF_INHIBIT_IRQ_MASK; /* needed if sti is just before */
+    env->exception_index = EXCP_HLT;
+    cpu_loop_exit();
 }
 
-void HELPER(rrc_T0_cc)(void)
+/* the trap function sees F, and may change it */
+void HELPER(trap)(void)
 {
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | ((tmp & 0x01) ? 0x80 : 0));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+    /* the trap is gone: the insn runs as translated */
+    if (env->trap_fn == NULL) {
+        return;
+    }
+    if (env->trap_fn(env, env->trap_opaque)) {
+        env->cc_op = CC_OP_FLAGS;
+        env->exception_index = -1;
+        cpu_loop_exit();
+    }
 }
 
-void HELPER(rl_T0_cc)(void)
+/* In / Out */
+
+/* PC points to the IN, which runs again once the CPU is woken up; its
+   T-states are counted again, like wait states */
+static inline void check_io_stall(void)
 {
-    int sf, zf, pf, cf;
-    int tmp;
+    if (unlikely(env->io_stall)) {
+        env->io_stall = 0;
+        env->io_stalled = 1;
+        env->halted = 1;
+        env->exception_index = EXCP_HLT;
+        cpu_loop_exit();
+    }
+}
 
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | !!(F & CC_C));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+void HELPER(in_T0_im)(uint32_t val)
+{
+    if (unlikely(z80_prof_active)) {
+        cpu_z80_prof_io(env);
+    }
+    //    T0 = cpu_inb(env, (A << 8) | val);
+    T0 = cpu_inb(env, val);
+    check_io_stall();
 }
 
-void HELPER(rr_T0_cc)(void)
+void HELPER(in_T0_bc_cc)(void)
 {
-    int sf, zf, pf, cf;
-    int tmp;
+    int sf, zf, pf;
+
+    if (unlikely(z80_prof_active)) {
+        cpu_z80_prof_io(env);
+    }
+    T0 = cpu_inb(env, BC);
+    check_io_stall();
 
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | ((F & CC_C) ? 0x80 : 0));
     sf = (T0 & 0x80) ? CC_S : 0;
     zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+    pf = parity_table[(uint8_t)T0];
+    F = (F & CC_C) | sf | zf | pf;
 }
 
-void HELPER(sla_T0_cc)(void)
+void HELPER(out_T0_im)(uint32_t val)
 {
-    int sf, zf, pf, cf;
-    int tmp;
-
-    tmp = T0;
-    T0 = (uint8_t)(T0 << 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+    if (unlikely(z80_prof_active)) {
+        cpu_z80_prof_io(env);
+    }
+    // cpu_outb(env, (A << 8) | val, T0);
+    cpu_outb(env, val, T0);
 }
 
-void HELPER(sra_T0_cc)(void)
+void HELPER(out_T0_bc)(void)
 {
-    int sf, zf, pf, cf;
-    int tmp;
+    if (unlikely(z80_prof_active)) {
+        cpu_z80_prof_io(env);
+    }
+    cpu_outb(env, BC, T0);
+}
 
-    tmp = T0;
-    T0 = (uint8_t)((T0 >> 1) | (T0 & 0x80));
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+/* Profiler */
+
+/* info is the guest code size << 16 | the number of insns */
+void HELPER(prof_block)(uint32_t pc, uint32_t phys, uint32_t info)
+{
+    cpu_z80_prof_block(env, pc, phys, info >> 16, info & 0xffff);
 }
 
-/* Z80-specific: R800 has tst instruction */
-void HELPER(sll_T0_cc)(void)
+/* Hot loops */
+
+/* a backward branch to pc has run often enough: have the block at pc,
+   whose code is at ram address phys, translated again as a loop region */
+void HELPER(loop_hot)(uint32_t pc, uint32_t phys)
 {
-    int sf, zf, pf, cf;
-    int tmp;
+    TranslationBlock *tb;
 
-    tmp = T0;
-    T0 = (uint8_t)((T0 << 1) | 1); /* Yes -- bit 0 is *set* */
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+    env->loop_count[pc % Z80_LOOP_COUNT_SIZE] = 0;
+    if (cpu_z80_loop_state(env->loop_heads, phys) == Z80_LOOP_REJECTED) {
+        return;
+    }
+    cpu_z80_set_loop_state(env->loop_heads, phys, Z80_LOOP_HOT);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (tb && tb->pc == pc && !(tb->cflags & CF_LOOP)) {
+        tb_phys_invalidate(tb, -1);
+    }
 }
 
-void HELPER(srl_T0_cc)(void)
-{
-    int sf, zf, pf, cf;
-    int tmp;
+/* Misc */
 
-    tmp = T0;
-    T0 = (uint8_t)(T0 >> 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-    pf = parity_table[T0];
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = sf | zf | pf | cf;
+void HELPER(jmp_T0)(void)
+{
+    PC = T0;
 }
 
+/* Rotation/shift operations */
+
 void HELPER(rld_cc)(void)
 {
     int sf, zf, pf;
@@ -527,15 +486,6 @@ void HELPER(bli_ld_dec_cc)(void)
     F = (F & (CC_S | CC_Z | CC_C)) | pf;
 }
 
-void HELPER(bli_ld_rep)(uint32_t next_pc)
-{
-    if (BC) {
-        PC = (uint16_t)(next_pc - 2);
-    } else {
-        PC = next_pc;
-    }
-}
-
 void HELPER(bli_cp_cc)(void)
 {
     int sf, zf, hf, pf;
@@ -573,15 +523,174 @@ void HELPER(bli_cp_dec_cc)(void)
     F = (F & ~CC_P) | pf;
 }
 
-void HELPER(bli_cp_rep)(uint32_t next_pc)
+/* LDIR/LDDR and CPIR/CPDR run as many iterations as they can in one
+   call rather than re-entering the TB for every byte.  They stop early,
+   leaving PC on the instruction, when an interrupt or exit is pending or
+   a cycle timer is due.  Bytes on plain RAM pages are accessed directly
+   through the TLB addend; I/O, ROM and pages holding translated code go
+   through the softmmu one byte at a time. */
+
+#define BLI_REP_TSTATES 21
+
+/* host address of addr if the TLB maps it to plain RAM, else NULL */
+static inline uint8_t *bli_ram_ptr(target_ulong addr, int is_write)
 {
-    if (BC && T0 != A) {
+    CPUTLBEntry *te;
+    target_ulong tlb_addr;
+
+    te = &env->tlb_table[cpu_mmu_index(env)]
+                        [(addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1)];
+    tlb_addr = is_write ? te->addr_write : te->addr_read;
+    if (tlb_addr != (addr & TARGET_PAGE_MASK)) {
+        return NULL;
+    }
+    return (uint8_t *)(long)(addr + te->addend);
+}
+
+/* iterations that may start before the next cycle timer, at least one */
+static inline int bli_limit(int count)
+{
+    uint64_t n;
+
+    if (env->tstate_deadline <= env->tstates) {
+        return 1;
+    }
+    n = (env->tstate_deadline - env->tstates + BLI_REP_TSTATES - 1) /
+        BLI_REP_TSTATES;
+    return n < count ? n : count;
+}
+
+/* iterations that stay within the page of addr */
+static inline int bli_page_run(target_ulong addr, int dec)
+{
+    if (dec) {
+        return (addr & ~TARGET_PAGE_MASK) + 1;
+    } else {
+        return TARGET_PAGE_SIZE - (addr & ~TARGET_PAGE_MASK);
+    }
+}
+
+static inline int bli_pending(void)
+{
+    return env->interrupt_request || env->exit_request;
+}
+
+/* env->tstates holds the start of the instruction; the translator adds
+   the cost of its final iteration */
+static inline void bli_finish(uint32_t next_pc, int done, int repeat)
+{
+    env->tstates += (uint64_t)(done - 1) * BLI_REP_TSTATES;
+    if (repeat) {
         PC = (uint16_t)(next_pc - 2);
+        env->tstates += 5;
     } else {
         PC = next_pc;
     }
 }
 
+void HELPER(bli_ld_block)(uint32_t next_pc, uint32_t dec)
+{
+    target_ulong insn = (uint16_t)(next_pc - 2);
+    uint64_t start = env->tstates;
+    int count, limit, done, n, i, step;
+    uint8_t *src, *dst;
+
+    step = dec ? -1 : 1;
+    count = BC ? BC : 0x10000;
+    limit = bli_limit(count);
+    for (done = 0; done < limit; done += n) {
+        if (done && bli_pending()) {
+            break;
+        }
+        n = limit - done;
+        n = MIN(n, bli_page_run(HL, dec));
+        n = MIN(n, bli_page_run(DE, dec));
+        src = bli_ram_ptr(HL, 0);
+        dst = bli_ram_ptr(DE, 1);
+        if (src && dst) {
+            if (dec) {
+                src -= n - 1;
+                dst -= n - 1;
+            }
+            if (dst + n <= src || src + n <= dst) {
+                memcpy(dst, src, n);
+            } else if (!dec) {
+                /* overlapping, e.g. a fill with DE = HL + 1 */
+                for (i = 0; i < n; i++) {
+                    dst[i] = src[i];
+                }
+            } else {
+                for (i = n - 1; i >= 0; i--) {
+                    dst[i] = src[i];
+                }
+            }
+            HL = (uint16_t)(HL + step * n);
+            DE = (uint16_t)(DE + step * n);
+        } else {
+            n = 1;
+            /* a device watching the store sees when it happens */
+            env->tstates = start + (uint64_t)done * BLI_REP_TSTATES;
+            stb_kernel(DE, ldub_kernel(HL));
+            HL = (uint16_t)(HL + step);
+            DE = (uint16_t)(DE + step);
+            if (((DE - step - insn) & 0xffff) < 2) {
+                /* the instruction overwrote itself */
+                done++;
+                break;
+            }
+        }
+    }
+    BC = (uint16_t)(count - done);
+    env->tstates = start;
+
+    F = (F & (CC_S | CC_Z | CC_C)) | (BC ? CC_P : 0);
+    bli_finish(next_pc, done, BC != 0);
+}
+
+void HELPER(bli_cp_block)(uint32_t next_pc, uint32_t dec)
+{
+    int count, limit, done, n, i, step, found;
+    int sf, zf, hf, res, carry;
+    uint8_t *src;
+    uint8_t val = 0;
+
+    step = dec ? -1 : 1;
+    count = BC ? BC : 0x10000;
+    limit = bli_limit(count);
+    found = 0;
+    for (done = 0; done < limit && !found; done += n) {
+        if (done && bli_pending()) {
+            break;
+        }
+        n = MIN(limit - done, bli_page_run(HL, dec));
+        src = bli_ram_ptr(HL, 0);
+        if (src) {
+            for (i = 0; i < n; i++) {
+                val = src[step * i];
+                if (val == A) {
+                    found = 1;
+                    n = i + 1;
+                    break;
+                }
+            }
+        } else {
+            n = 1;
+            val = ldub_kernel(HL);
+            found = (val == A);
+        }
+        HL = (uint16_t)(HL + step * n);
+    }
+    BC = (uint16_t)(count - done);
+
+    res = (uint8_t)(A - val);
+    sf = (res & 0x80) ? CC_S : 0;
+    zf = res ? 0 : CC_Z;
+    carry = (~A & val) | (~(A ^ val) & res);
+    hf = (carry & 0x08) ? CC_H : 0;
+    F = (F & CC_C) | sf | zf | hf | (BC ? CC_P : 0) | CC_N;
+    bli_finish(next_pc, done, BC && !found);
+}
+
 void HELPER(bli_io_T0_inc)(uint32_t out)
 {
     HL = (uint16_t)(HL + 1);
@@ -610,8 +719,10 @@ void HELPER(bli_io_T0_dec)(uint32_t out)
 
 void HELPER(bli_io_rep)(uint32_t next_pc)
 {
-    if (F & CC_Z) {
+    /* repeat until B reaches zero */
+    if (!(F & CC_Z)) {
         PC = (uint16_t)(next_pc - 2);
+        env->tstates += 5;
     } else {
         PC = next_pc;
     }
@@ -619,50 +730,6 @@ void HELPER(bli_io_rep)(uint32_t next_pc)
 
 /* misc */
 
-void HELPER(rlca_cc)(void)
-{
-    int cf;
-    int tmp;
-
-    tmp = A;
-    A = (uint8_t)((A << 1) | !!(tmp & 0x80));
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = (F & (CC_S | CC_Z | CC_P)) | cf;
-}
-
-void HELPER(rrca_cc)(void)
-{
-    int cf;
-    int tmp;
-
-    tmp = A;
-    A = (A >> 1) | ((tmp & 0x01) ? 0x80 : 0);
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = (F & (CC_S | CC_Z | CC_P)) | cf;
-}
-
-void HELPER(rla_cc)(void)
-{
-    int cf;
-    int tmp;
-
-    tmp = A;
-    A = (uint8_t)((A << 1) | !!(F & CC_C));
-    cf = (tmp & 0x80) ? CC_C : 0;
-    F = (F & (CC_S | CC_Z | CC_P)) | cf;
-}
-
-void HELPER(rra_cc)(void)
-{
-    int cf;
-    int tmp;
-
-    tmp = A;
-    A = (A >> 1) | ((F & CC_C) ? 0x80 : 0);
-    cf = (tmp & 0x01) ? CC_C : 0;
-    F = (F & (CC_S | CC_Z | CC_P)) | cf;
-}
-
 /* TODO */
 void HELPER(daa_cc)(void)
 {
@@ -695,45 +762,6 @@ void HELPER(daa_cc)(void)
     F = (F & CC_N) | sf | zf | hf | pf | cf;
 }
 
-void HELPER(cpl_cc)(void)
-{
-    A = (uint8_t)~A;
-    F |= CC_H | CC_N;
-}
-
-void HELPER(scf_cc)(void)
-{
-    F = (F & (CC_S | CC_Z | CC_P)) | CC_C;
-}
-
-void HELPER(ccf_cc)(void)
-{
-    int hf, cf;
-
-    hf = (F & CC_C) ? CC_H : 0;
-    cf = (F & CC_C) ^ CC_C;
-    F = (F & (CC_S | CC_Z | CC_P)) | hf | cf;
-}
-
-/* misc */
-
-void HELPER(neg_cc)(void)
-{
-    int sf, zf, hf, pf, cf;
-    int tmp = A;
-    int carry;
-
-    A = (uint8_t)-A;
-    sf = (A & 0x80) ? CC_S : 0;
-    zf = A ? 0 : CC_Z;
-    carry = (tmp & T0) | ((tmp | T0) & ~A);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_sub(tmp, T0, A, 8) ? CC_P : 0;
-    cf = (carry & 0x80) ? CC_C : 0;
-
-    F = sf | zf | hf | pf | CC_N | cf;
-}
-
 /* word operations -- HL only? */
 
 void HELPER(sbcw_T0_T1_cc)(void)
@@ -753,20 +781,6 @@ void HELPER(sbcw_T0_T1_cc)(void)
     F = sf | zf | hf | pf | CC_N | cf;
 }
 
-void HELPER(addw_T0_T1_cc)(void)
-{
-    int hf, cf;
-    int tmp = T0;
-    int carry;
-
-    T0 = (uint16_t)(T0 + T1);
-    carry = (tmp & T1) | ((tmp | T1) & ~T0);
-    hf = (carry & 0x0800) ? CC_H : 0;
-    cf = (carry & 0x8000) ? CC_C : 0;
-
-    F = (F & (CC_S | CC_Z | CC_P)) | hf | cf;
-}
-
 void HELPER(adcw_T0_T1_cc)(void)
 {
     int sf, zf, hf, pf, cf;
@@ -784,45 +798,6 @@ void HELPER(adcw_T0_T1_cc)(void)
     F = sf | zf | hf | pf | cf;
 }
 
-/* misc */
-
-void HELPER(incb_T0_cc)(void)
-{
-    int sf, zf, hf, pf;
-    int tmp;
-    int carry;
-
-    tmp = T0;
-    T0 = (uint8_t)(T0 + 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-
-    carry = (tmp & 1) | ((tmp | 1) & ~T0);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_add(tmp, 1, T0, 8) ? CC_P : 0;
-
-    F = (F & CC_C) | sf | zf | hf | pf;
-}
-
-void HELPER(decb_T0_cc)(void)
-{
-    int sf, zf, hf, pf;
-    int tmp;
-    int carry;
-
-    tmp = T0;
-    T0 = (uint8_t)(T0 - 1);
-    sf = (T0 & 0x80) ? CC_S : 0;
-    zf = T0 ? 0 : CC_Z;
-
-    carry = (~tmp & 1) | (~(tmp ^ 1) & T0);
-    hf = (carry & 0x08) ? CC_H : 0;
-    pf = signed_overflow_sub(tmp, 1, T0, 8) ? CC_P : 0;
-
-    F = (F & CC_C) | sf | zf | hf | CC_N | pf;
-    /* TODO: check CC_N is set */
-}
-
 /* value on data bus is 0xff for speccy */
 /* IM0 = execute data on bus (rst $38 on speccy) */
 /* IM1 = execute rst $38 (ROM uses this)*/
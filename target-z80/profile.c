@@ -0,0 +1,294 @@
+/*
+ * Z80 guest profiler
+ *
+ * This code is licensed under the GPL version 2
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "qemu-common.h"
+#include "dis-asm.h"
+
+/* While the profiler runs, blocks are translated with HF_PROF_MASK and
+   call helper_prof_block() on entry.  The T-states spent between two
+   block entries, including those of block instructions, I/O wait states
+   and idle skipping, are charged to the block that was entered first.
+   Blocks are identified by their PC and the physical address it maps
+   to, so that the same code in different banks is told apart. */
+
+#define PROF_HASH_BITS 12
+#define PROF_HASH_SIZE (1 << PROF_HASH_BITS)
+#define PROF_INFO_LINES 20
+
+typedef struct Z80ProfBlock {
+    uint32_t pc;
+    uint32_t phys;
+    uint16_t size;              /* guest code size */
+    uint16_t ninsns;
+    uint64_t count;             /* executions */
+    uint64_t tstates;
+    uint64_t io;                /* IN and OUT accesses */
+    uint64_t smc;               /* writes that invalidated code */
+    struct Z80ProfBlock *hash_next;
+} Z80ProfBlock;
+
+int z80_prof_active;
+
+static Z80ProfBlock *prof_hash[PROF_HASH_SIZE];
+static int prof_nb_blocks;
+static Z80ProfBlock *prof_cur;
+static uint64_t prof_cur_tstates;
+static uint64_t prof_start_tstates;
+static uint64_t prof_total_tstates;
+
+static inline unsigned int prof_hash_func(uint32_t pc, uint32_t phys)
+{
+    return (phys ^ (phys >> PROF_HASH_BITS) ^ (pc << 4)) &
+           (PROF_HASH_SIZE - 1);
+}
+
+/* charge the T-states since the last block entry */
+static void prof_account(CPUZ80State *env)
+{
+    if (prof_cur) {
+        prof_cur->tstates += env->tstates - prof_cur_tstates;
+    }
+    prof_cur_tstates = env->tstates;
+}
+
+void cpu_z80_prof_block(CPUZ80State *env, uint32_t pc, uint32_t phys,
+                        int size, int ninsns)
+{
+    Z80ProfBlock *b, **pb;
+
+    if (!z80_prof_active) {
+        return;
+    }
+    prof_account(env);
+
+    pb = &prof_hash[prof_hash_func(pc, phys)];
+    for (b = *pb; b; b = b->hash_next) {
+        if (b->pc == pc && b->phys == phys) {
+            break;
+        }
+    }
+    if (!b) {
+        b = qemu_mallocz(sizeof(*b));
+        b->pc = pc;
+        b->phys = phys;
+        b->hash_next = *pb;
+        *pb = b;
+        prof_nb_blocks++;
+    }
+    /* a block may be retranslated shorter, e.g. after a breakpoint */
+    b->size = size;
+    b->ninsns = ninsns;
+    b->count++;
+    prof_cur = b;
+}
+
+void cpu_z80_prof_io(CPUZ80State *env)
+{
+    if (prof_cur) {
+        prof_cur->io++;
+    }
+}
+
+void cpu_z80_prof_smc(CPUZ80State *env)
+{
+    if (prof_cur) {
+        prof_cur->smc++;
+    }
+}
+
+static void prof_reset(void)
+{
+    Z80ProfBlock *b, *next;
+    int i;
+
+    for (i = 0; i < PROF_HASH_SIZE; i++) {
+        for (b = prof_hash[i]; b; b = next) {
+            next = b->hash_next;
+            qemu_free(b);
+        }
+        prof_hash[i] = NULL;
+    }
+    prof_nb_blocks = 0;
+    prof_cur = NULL;
+    prof_total_tstates = 0;
+}
+
+/* blocks translated from now on count themselves.  All blocks are
+   dropped on start and stop: chained blocks jump to each other without
+   the lookup that checks HF_PROF_MASK, and would go on as translated. */
+void cpu_z80_prof_start(CPUZ80State *env)
+{
+    if (z80_prof_active) {
+        cpu_z80_prof_stop(env);
+    }
+    prof_reset();
+    prof_start_tstates = env->tstates;
+    prof_cur_tstates = env->tstates;
+    z80_prof_active = 1;
+    tb_flush(env);
+}
+
+void cpu_z80_prof_stop(CPUZ80State *env)
+{
+    if (!z80_prof_active) {
+        return;
+    }
+    prof_account(env);
+    prof_cur = NULL;
+    prof_total_tstates += env->tstates - prof_start_tstates;
+    z80_prof_active = 0;
+    tb_flush(env);
+}
+
+static uint64_t prof_total(CPUZ80State *env)
+{
+    uint64_t total = prof_total_tstates;
+
+    if (z80_prof_active) {
+        total += env->tstates - prof_start_tstates;
+    }
+    return total;
+}
+
+static int prof_cmp(const void *p1, const void *p2)
+{
+    const Z80ProfBlock *b1 = *(const Z80ProfBlock **)p1;
+    const Z80ProfBlock *b2 = *(const Z80ProfBlock **)p2;
+
+    if (b1->tstates != b2->tstates) {
+        return b1->tstates < b2->tstates ? 1 : -1;
+    }
+    if (b1->phys != b2->phys) {
+        return b1->phys < b2->phys ? -1 : 1;
+    }
+    return b1->pc < b2->pc ? -1 : b1->pc > b2->pc;
+}
+
+/* the blocks sorted by decreasing T-states */
+static Z80ProfBlock **prof_sorted(CPUZ80State *env)
+{
+    Z80ProfBlock **tab, *b;
+    int i, n;
+
+    if (z80_prof_active) {
+        prof_account(env);
+    }
+    tab = qemu_malloc((prof_nb_blocks + 1) * sizeof(*tab));
+    n = 0;
+    for (i = 0; i < PROF_HASH_SIZE; i++) {
+        for (b = prof_hash[i]; b; b = b->hash_next) {
+            tab[n++] = b;
+        }
+    }
+    qsort(tab, n, sizeof(*tab), prof_cmp);
+    return tab;
+}
+
+void cpu_z80_prof_info(CPUZ80State *env, FILE *f,
+                       int (*cpu_fprintf)(FILE *f, const char *fmt, ...))
+{
+    Z80ProfBlock **tab, *b;
+    uint64_t total, insns;
+    int i;
+
+    total = prof_total(env);
+    cpu_fprintf(f, "profiler %s, %d blocks, %" PRIu64 " T-states\n",
+                z80_prof_active ? "running" : "stopped",
+                prof_nb_blocks, total);
+    if (prof_nb_blocks == 0) {
+        return;
+    }
+    if (total == 0) {
+        total = 1;
+    }
+    tab = prof_sorted(env);
+    cpu_fprintf(f, "  pc   phys     execs      insns    T-states"
+                   "      %%        io   smc\n");
+    for (i = 0; i < prof_nb_blocks && i < PROF_INFO_LINES; i++) {
+        b = tab[i];
+        insns = b->count * b->ninsns;
+        cpu_fprintf(f, "%04x %06x %9" PRIu64 " %10" PRIu64 " %11" PRIu64
+                    " %5.1f%% %9" PRIu64 " %5" PRIu64 "\n",
+                    b->pc, b->phys, b->count, insns, b->tstates,
+                    b->tstates * 100.0 / total, b->io, b->smc);
+    }
+    qemu_free(tab);
+}
+
+/* the code is read from its physical address, as the bank it was run
+   from may no longer be mapped */
+static uint32_t prof_disas_phys;
+static uint32_t prof_disas_pc;
+
+static int prof_read_memory(bfd_vma memaddr, bfd_byte *myaddr, int length,
+                            struct disassemble_info *info)
+{
+    cpu_physical_memory_rw(prof_disas_phys + (memaddr - prof_disas_pc),
+                           myaddr, length, 0);
+    return 0;
+}
+
+static void prof_disas(FILE *f, Z80ProfBlock *b)
+{
+    struct disassemble_info disasm_info;
+    target_ulong pc;
+    int count, i;
+
+    INIT_DISASSEMBLE_INFO(disasm_info, f, fprintf);
+    disasm_info.read_memory_func = prof_read_memory;
+    disasm_info.buffer_vma = b->pc;
+    disasm_info.buffer_length = b->size;
+    disasm_info.endian = BFD_ENDIAN_LITTLE;
+    prof_disas_phys = b->phys;
+    prof_disas_pc = b->pc;
+
+    pc = b->pc;
+    for (i = 0; i < b->ninsns; i++) {
+        fprintf(f, "\t%04x:  ", pc);
+        count = print_insn_z80(pc, &disasm_info);
+        fprintf(f, "\n");
+        if (count <= 0) {
+            break;
+        }
+        pc += count;
+    }
+}
+
+/* write every block with its counters and its disassembly */
+int cpu_z80_prof_dump(CPUZ80State *env, const char *filename)
+{
+    Z80ProfBlock **tab, *b;
+    uint64_t total;
+    FILE *f;
+    int i;
+
+    f = fopen(filename, "w");
+    if (!f) {
+        return -1;
+    }
+    total = prof_total(env);
+    tab = prof_sorted(env);
+    fprintf(f, "# Z80 profile: %d blocks, %" PRIu64 " T-states\n",
+            prof_nb_blocks, total);
+    fprintf(f, "# pc phys execs insns tstates io smc\n");
+    for (i = 0; i < prof_nb_blocks; i++) {
+        b = tab[i];
+        fprintf(f, "%04x %06x %" PRIu64 " %" PRIu64 " %" PRIu64
+                " %" PRIu64 " %" PRIu64 "\n",
+                b->pc, b->phys, b->count, b->count * b->ninsns, b->tstates,
+                b->io, b->smc);
+        prof_disas(f, b);
+    }
+    qemu_free(tab);
+    fclose(f);
+    return 0;
+}
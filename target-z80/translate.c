@@ -48,11 +48,69 @@
 
 /* global register indexes */
 static TCGv cpu_env, cpu_T[3], cpu_A0;
+static TCGv cpu_A, cpu_F, cpu_BC, cpu_DE, cpu_HL, cpu_IX, cpu_IY, cpu_SP;
+static TCGv cpu_AX, cpu_FX, cpu_BCX, cpu_DEX, cpu_HLX;
+static TCGv_i32 cpu_cc_op;
+static TCGv cpu_cc_src, cpu_cc_src2, cpu_cc_dst;
+static TCGv_i64 cpu_tstates;
+
+/* flags as a function of an 8-bit result */
+static uint8_t szp_table[256];
+static uint8_t incb_table[256];
+static uint8_t decb_table[256];
+
+/* instruction table, one page of 256 entries per prefix, generated from
+   insn.def */
+enum {
+    Z80_OPND_NONE,
+    Z80_OPND_N,         /* byte */
+    Z80_OPND_NN,        /* word */
+    Z80_OPND_E,         /* relative jump */
+    Z80_OPND_D,         /* index displacement */
+    Z80_OPND_DN,        /* displacement and byte */
+};
+
+#define Z80_INSN_PREFIX  0x0001 /* the next byte is looked up in another page */
+#define Z80_INSN_JR      0x0002 /* offset in the last byte */
+#define Z80_INSN_JP      0x0004 /* target in the last two bytes */
+#define Z80_INSN_CALL    0x0008
+#define Z80_INSN_RST     0x0010
+#define Z80_INSN_RET     0x0020
+#define Z80_INSN_JUMP    0x0040 /* jp (hl) */
+#define Z80_INSN_HALT    0x0080
+#define Z80_INSN_COND    0x0100 /* may go on with the next insn */
+#define Z80_INSN_REPEAT  0x0200 /* ldir and the like */
+#define Z80_INSN_IO      0x0400
+#define Z80_INSN_INVALID 0x0800 /* does nothing */
+#define Z80_INSN_UNDOC   0x1000
+#define Z80_INSN_STORE   0x2000 /* writes memory */
+
+typedef struct Z80Insn {
+    uint8_t len;            /* opcode and operands, without the prefixes */
+    uint8_t operand;        /* Z80_OPND_xxx */
+    uint8_t tstates;        /* without the prefixes, not taken */
+    uint8_t tstates_taken;  /* added when taken or repeating */
+    uint8_t flags_read;     /* CC_xxx */
+    uint8_t flags_written;
+    uint16_t kind;          /* Z80_INSN_xxx */
+} Z80Insn;
+
+#include "z80-insn.h"
 
 #include "gen-icount.h"
 
 #define MEM_INDEX 0
 
+/* loop regions, see loop_scan() */
+#define LOOP_HOT_COUNT 1024
+#define LOOP_MAX_BYTES 64
+#define LOOP_MAX_INSNS 32
+
+/* flag liveness, see flags_liveness().  The translator does not produce
+   the undocumented X and Y flags, so they are not tracked. */
+#define LIVE_MAX_INSNS 64
+#define LIVE_FLAGS (CC_S | CC_Z | CC_H | CC_P | CC_N | CC_C)
+
 typedef struct DisasContext {
     /* current insn context */
     int override; /* -1 if no override */
@@ -66,13 +124,62 @@ typedef struct DisasContext {
     int singlestep_enabled; /* "hardware" single step enabled */
     int jmp_opt; /* use direct block chaining for direct jumps */
     int flags; /* all execution flags */
+    int cc_op; /* current CC operation */
+    int tstates; /* T-states of previous insns not yet added to the counter */
+    int insn_tstates; /* T-states of the current insn */
+    const Z80Insn *insn; /* table entry of the current insn */
+    const uint32_t *timed_stores; /* env->timed_stores, NULL if empty */
+    int imm_loaded; /* the last immediate operand is read at run time */
+    Z80LoopHead *loop_heads; /* env->loop_heads */
+    uint32_t phys_pc; /* ram address of the code at tb->pc */
     struct TranslationBlock *tb;
+    /* loop region (CF_LOOP) */
+    int loop;
+    int loop_size; /* bytes from tb->pc to the end of the closing branch */
+    int loop_slot; /* next goto_tb slot for an exit */
+    int loop_label[LOOP_MAX_BYTES]; /* label of each branch target, or -1 */
+    uint64_t loop_label_set;
+    /* flag liveness */
+    int live_flags; /* flags used after the current insn */
+    int live_insns; /* insns in live[] */
+    uint8_t live[LIVE_MAX_INSNS]; /* flags used after each insn */
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
 static void gen_jmp(DisasContext *s, target_ulong pc);
 static void gen_jmp_tb(DisasContext *s, target_ulong pc, int tb_num);
 
+/* bring the T-state counter up to the start of the current insn, so that
+   I/O helpers and timed memory stores see it; gen_pc_load relies on
+   s->tstates being reset */
+static inline void gen_update_tstates(DisasContext *s)
+{
+    if (s->tstates) {
+        tcg_gen_addi_i64(cpu_tstates, cpu_tstates, s->tstates);
+        s->tstates = 0;
+    }
+}
+
+static inline int store_timed(DisasContext *s, target_ulong addr)
+{
+    return (s->timed_stores[(addr >> 13) & 7] >> ((addr >> 8) & 31)) & 1;
+}
+
+/* before a store of size bytes, to addr or to an address only known at
+   run time if addr is -1: the counter must be up to date if a board may
+   be watching it (cpu_z80_time_stores()) */
+static inline void gen_store_tstates(DisasContext *s, int addr, int size)
+{
+    if (!s->timed_stores) {
+        return;
+    }
+    if (addr >= 0 && !store_timed(s, addr) &&
+        !store_timed(s, (addr + size - 1) & 0xffff)) {
+        return;
+    }
+    gen_update_tstates(s);
+}
+
 enum {
     /* 8-bit registers */
     OR_B,
@@ -122,16 +229,10 @@ static const char *const idxnames[] = {
 /* signed hex byte value for printf */
 #define shexb(val) (val < 0 ? '-' : '+'), (abs(val))
 
-/* Register accessor functions */
-
-#if defined(WORDS_BIGENDIAN)
-#define UNIT_OFFSET(type, units, num) (sizeof(type) - ((num + 1) * units))
-#else
-#define UNIT_OFFSET(type, units, num) (num * units)
-#endif
-
-#define BYTE_OFFSET(type, num) UNIT_OFFSET(type, 1, num)
-#define WORD_OFFSET(type, num) UNIT_OFFSET(type, 2, num)
+/* Register accessor functions.  The registers are TCG globals, so that
+   they can stay in host registers for the whole TB; they go back to
+   CPUState before helper calls, memory accesses and at the end of the
+   TB. */
 
 #define REGPAIR AF
 #define REGHIGH A
@@ -276,9 +377,10 @@ static inline void gen_movb_IYmem_v(TCGv v, uint16_t ofs)
     tcg_temp_free(addr);
 }
 
-static inline void gen_pushw(TCGv v)
+static inline void gen_pushw(DisasContext *s, TCGv v)
 {
     TCGv addr = tcg_temp_new();
+    gen_store_tstates(s, -1, 2);
     gen_movw_v_SP(addr);
     tcg_gen_subi_i32(addr, addr, 2);
     tcg_gen_ext16u_i32(addr, addr);
@@ -298,6 +400,64 @@ static inline void gen_popw(TCGv v)
     tcg_temp_free(addr);
 }
 
+/* Immediate operands.  A CF_SMC block loads them from memory when it
+   runs and records them in tb->smc_operands, so that the guest can
+   rewrite them without the block being translated again.  Only the
+   first 64 bytes of the first page of a block are tracked. */
+static int smc_operand(DisasContext *s, int len)
+{
+    TranslationBlock *tb = s->tb;
+    target_ulong ofs = s->cs_base + s->pc - tb->pc;
+
+    if (!(tb->cflags & CF_SMC) || ofs + len > 64 ||
+        ((tb->pc ^ (tb->pc + ofs + len - 1)) & TARGET_PAGE_MASK)) {
+        return 0;
+    }
+    tb->smc_operands |= (((uint64_t)1 << len) - 1) << ofs;
+    return 1;
+}
+
+static int gen_movb_v_imm(DisasContext *s, TCGv v)
+{
+    int n = ldub_code(s->pc);
+    TCGv addr;
+
+    s->imm_loaded = smc_operand(s, 1);
+    if (s->imm_loaded) {
+        addr = tcg_const_tl(s->pc);
+        tcg_gen_qemu_ld8u(v, addr, MEM_INDEX);
+        tcg_temp_free(addr);
+    } else {
+        tcg_gen_movi_tl(v, n);
+    }
+    s->pc++;
+    return n;
+}
+
+static int gen_movw_v_imm(DisasContext *s, TCGv v)
+{
+    int n = lduw_code(s->pc);
+    TCGv addr;
+
+    s->imm_loaded = smc_operand(s, 2);
+    if (s->imm_loaded) {
+        addr = tcg_const_tl(s->pc);
+        tcg_gen_qemu_ld16u(v, addr, MEM_INDEX);
+        tcg_temp_free(addr);
+    } else {
+        tcg_gen_movi_tl(v, n);
+    }
+    s->pc += 2;
+    return n;
+}
+
+/* the address n of a store, taken by gen_movw_v_imm(), for
+   gen_store_tstates(): unknown if the guest may rewrite it */
+static inline int imm_store_addr(DisasContext *s, int n)
+{
+    return s->imm_loaded ? -1 : n;
+}
+
 static gen_mov_func *const gen_movb_v_reg_tbl[] = {
     [OR_B]     = gen_movb_v_B,
     [OR_C]     = gen_movb_v_C,
@@ -347,8 +507,11 @@ static gen_mov_func *const gen_movb_reg_v_tbl[] = {
     [OR_IYl]   = gen_movb_IYl_v,
 };
 
-static inline void gen_movb_reg_v(int reg, TCGv v)
+static inline void gen_movb_reg_v(DisasContext *s, int reg, TCGv v)
 {
+    if (reg == OR_HLmem) {
+        gen_store_tstates(s, -1, 1);
+    }
     gen_movb_reg_v_tbl[reg](v);
 }
 
@@ -357,8 +520,9 @@ static gen_mov_func_idx *const gen_movb_idx_v_tbl[] = {
     [OR_IYmem] = gen_movb_IYmem_v,
 };
 
-static inline void gen_movb_idx_v(int idx, TCGv v, int ofs)
+static inline void gen_movb_idx_v(DisasContext *s, int idx, TCGv v, int ofs)
 {
+    gen_store_tstates(s, -1, 1);
     gen_movb_idx_v_tbl[idx](v, ofs);
 }
 
@@ -525,8 +689,35 @@ static inline void gen_jmp_im(target_ulong pc)
     gen_helper_movl_pc_im(tcg_const_tl(pc));
 }
 
+static inline void gen_op_set_cc_op(int32_t val)
+{
+    tcg_gen_movi_i32(cpu_cc_op, val);
+}
+
+/* write back the statically known cc_op before leaving the TB or calling
+   a helper which may exit the cpu loop */
+static inline void gen_update_cc_op(DisasContext *s)
+{
+    if (s->cc_op != CC_OP_DYNAMIC) {
+        gen_op_set_cc_op(s->cc_op);
+    }
+}
+
+/* add everything up to the end of the current insn when leaving the TB.
+   Nothing is reset, as conditional branches end the TB on both paths. */
+static inline void gen_flush_tstates(DisasContext *s)
+{
+    int n = s->tstates + s->insn_tstates;
+
+    if (n) {
+        tcg_gen_addi_i64(cpu_tstates, cpu_tstates, n);
+    }
+}
+
 static void gen_debug(DisasContext *s, target_ulong cur_pc)
 {
+    gen_update_cc_op(s);
+    gen_flush_tstates(s);
     gen_jmp_im(cur_pc);
     gen_helper_debug();
     s->is_jmp = 3;
@@ -534,6 +725,8 @@ static void gen_debug(DisasContext *s, target_ulong cur_pc)
 
 static void gen_eob(DisasContext *s)
 {
+    gen_update_cc_op(s);
+    gen_flush_tstates(s);
     if (s->tb->flags & HF_INHIBIT_IRQ_MASK) {
         gen_helper_reset_inhibit_irq();
     }
@@ -545,8 +738,22 @@ static void gen_eob(DisasContext *s)
     s->is_jmp = 3;
 }
 
+/* end the TB after an OUT: the board may have switched the bank the code
+   runs from, and neither the rest of the TB nor the blocks chained to it
+   were translated from the new one */
+static void gen_out_eob(DisasContext *s)
+{
+    if (use_icount) {
+        gen_io_end();
+    }
+    gen_jmp_im(s->pc);
+    gen_eob(s);
+}
+
 static void gen_exception(DisasContext *s, int trapno, target_ulong cur_pc)
 {
+    gen_update_cc_op(s);
+    gen_update_tstates(s);
     gen_jmp_im(cur_pc);
     gen_helper_raise_exception(trapno);
     s->is_jmp = 3;
@@ -583,6 +790,160 @@ static const int cc_flags[4] = {
     CC_S,
 };
 
+/* Lazy condition codes */
+
+/* v = table[idx & 0xff] */
+static inline void gen_table_lookup(TCGv v, const uint8_t *table, TCGv idx)
+{
+    TCGv_ptr ptr = tcg_temp_new_ptr();
+
+    tcg_gen_ext8u_tl(v, idx);
+    tcg_gen_ext_i32_ptr(ptr, v);
+    tcg_gen_add_ptr(ptr, ptr, tcg_const_ptr((tcg_target_long)table));
+    tcg_gen_ld8u_tl(v, ptr, 0);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* compute all flags into F */
+static void gen_compute_flags(DisasContext *s)
+{
+    TCGv tmp, tmp2;
+
+    switch (s->cc_op) {
+    case CC_OP_FLAGS:
+        return;
+    case CC_OP_ADDB:
+    case CC_OP_SUBB:
+        tmp = tcg_temp_new();
+        tmp2 = tcg_temp_new();
+        gen_table_lookup(cpu_F, szp_table, cpu_cc_dst);
+        tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z);
+        /* half carry is bit 4 of op1 ^ op2 ^ res */
+        tcg_gen_xor_tl(tmp, cpu_cc_src2, cpu_cc_src);
+        tcg_gen_xor_tl(tmp2, tmp, cpu_cc_dst);
+        tcg_gen_andi_tl(tmp2, tmp2, CC_H);
+        tcg_gen_or_tl(cpu_F, cpu_F, tmp2);
+        /* overflow is bit 7 of (op1 ^ op2 [^ 0x80 for add]) & (op1 ^ res) */
+        if (s->cc_op == CC_OP_ADDB) {
+            tcg_gen_xori_tl(tmp, tmp, 0x80);
+        }
+        tcg_gen_xor_tl(tmp2, cpu_cc_src2, cpu_cc_dst);
+        tcg_gen_and_tl(tmp, tmp, tmp2);
+        tcg_gen_shri_tl(tmp, tmp, 5);
+        tcg_gen_andi_tl(tmp, tmp, CC_P);
+        tcg_gen_or_tl(cpu_F, cpu_F, tmp);
+        /* carry is bit 8 of the untruncated result */
+        tcg_gen_shri_tl(tmp, cpu_cc_dst, 8);
+        tcg_gen_andi_tl(tmp, tmp, CC_C);
+        tcg_gen_or_tl(cpu_F, cpu_F, tmp);
+        if (s->cc_op == CC_OP_SUBB) {
+            tcg_gen_ori_tl(cpu_F, cpu_F, CC_N);
+        }
+        tcg_temp_free(tmp2);
+        tcg_temp_free(tmp);
+        break;
+    case CC_OP_LOGICB:
+        tmp = tcg_temp_new();
+        gen_table_lookup(cpu_F, szp_table, cpu_cc_dst);
+        tcg_gen_or_tl(cpu_F, cpu_F, cpu_cc_src);
+        tcg_gen_shri_tl(tmp, cpu_cc_dst, 8);
+        tcg_gen_andi_tl(tmp, tmp, CC_C);
+        tcg_gen_or_tl(cpu_F, cpu_F, tmp);
+        tcg_temp_free(tmp);
+        break;
+    case CC_OP_INCB:
+        gen_table_lookup(cpu_F, incb_table, cpu_cc_dst);
+        tcg_gen_or_tl(cpu_F, cpu_F, cpu_cc_src);
+        break;
+    case CC_OP_DECB:
+        gen_table_lookup(cpu_F, decb_table, cpu_cc_dst);
+        tcg_gen_or_tl(cpu_F, cpu_F, cpu_cc_src);
+        break;
+    case CC_OP_BITB:
+        /* cc_dst is either zero or a single bit, so P is set iff Z is */
+        gen_table_lookup(cpu_F, szp_table, cpu_cc_dst);
+        tcg_gen_ori_tl(cpu_F, cpu_F, CC_H);
+        tcg_gen_or_tl(cpu_F, cpu_F, cpu_cc_src);
+        break;
+    default:
+        gen_helper_cc_compute_all(cpu_F, cpu_cc_op);
+        break;
+    }
+    s->cc_op = CC_OP_FLAGS;
+}
+
+/* the board's trap runs in place of the insn at cur_pc, and leaves the
+   TB if it took over */
+static void gen_trap(DisasContext *s, target_ulong cur_pc)
+{
+    gen_compute_flags(s);
+    gen_update_cc_op(s);
+    gen_update_tstates(s);
+    gen_jmp_im(cur_pc);
+    gen_helper_trap();
+}
+
+/* compute the carry flag (0 or 1) into reg without touching F */
+static void gen_compute_carry(DisasContext *s, TCGv reg)
+{
+    switch (s->cc_op) {
+    case CC_OP_FLAGS:
+        tcg_gen_andi_tl(reg, cpu_F, CC_C);
+        break;
+    case CC_OP_ADDB:
+    case CC_OP_SUBB:
+    case CC_OP_LOGICB:
+        tcg_gen_shri_tl(reg, cpu_cc_dst, 8);
+        tcg_gen_andi_tl(reg, reg, CC_C);
+        break;
+    case CC_OP_INCB:
+    case CC_OP_DECB:
+    case CC_OP_BITB:
+        tcg_gen_mov_tl(reg, cpu_cc_src);
+        break;
+    default:
+        gen_helper_cc_compute_c(reg, cpu_cc_op);
+        break;
+    }
+}
+
+/* none of the flags the current insn sets is used before being set
+   again: its flag computation can be left out, and the cc state goes on
+   describing the flags from before, which include those it keeps */
+static inline int flags_dead(DisasContext *s)
+{
+    return !(s->live_flags & s->insn->flags_written & LIVE_FLAGS);
+}
+
+/* the flags the current insn keeps and a later one uses */
+static inline int flags_kept_live(DisasContext *s)
+{
+    return s->live_flags & ~s->insn->flags_written & LIVE_FLAGS;
+}
+
+/* the carry (0 or 1) an insn keeps, computed only if it is used later */
+static void gen_kept_carry(DisasContext *s, TCGv reg)
+{
+    if (flags_kept_live(s) & CC_C) {
+        gen_compute_carry(s, reg);
+    } else {
+        tcg_gen_movi_tl(reg, 0);
+    }
+}
+
+/* bring F up to date for an insn that changes it in place.  Flags the
+   insn neither reads nor keeps for a later one may be left stale, but
+   the I/O helpers look at F and may have the insn retried. */
+static void gen_prepare_flags(DisasContext *s)
+{
+    if (((s->insn->flags_read | flags_kept_live(s)) & LIVE_FLAGS) ||
+        (s->insn->kind & Z80_INSN_IO)) {
+        gen_compute_flags(s);
+    } else {
+        s->cc_op = CC_OP_FLAGS;
+    }
+}
+
 /* Arithmetic/logic operations */
 
 static const char *const alu[8] = {
@@ -596,19 +957,158 @@ static const char *const alu[8] = {
     "cp ",
 };
 
-typedef void (alu_helper_func)(void);
-
-static alu_helper_func *const gen_alu[8] = {
-    gen_helper_add_cc,
-    gen_helper_adc_cc,
-    gen_helper_sub_cc,
-    gen_helper_sbc_cc,
-    gen_helper_and_cc,
-    gen_helper_xor_cc,
-    gen_helper_or_cc,
-    gen_helper_cp_cc,
+enum {
+    ALU_ADD,
+    ALU_ADC,
+    ALU_SUB,
+    ALU_SBC,
+    ALU_AND,
+    ALU_XOR,
+    ALU_OR,
+    ALU_CP,
 };
 
+/* A = A op T0 when the flags it sets are not used */
+static void gen_alu_T0_noflags(DisasContext *s, int op)
+{
+    switch (op) {
+    case ALU_ADD:
+    case ALU_ADC:
+        tcg_gen_add_tl(cpu_A, cpu_A, cpu_T[0]);
+        if (op == ALU_ADC) {
+            gen_compute_carry(s, cpu_T[1]);
+            tcg_gen_add_tl(cpu_A, cpu_A, cpu_T[1]);
+        }
+        tcg_gen_ext8u_tl(cpu_A, cpu_A);
+        break;
+    case ALU_SUB:
+    case ALU_SBC:
+        tcg_gen_sub_tl(cpu_A, cpu_A, cpu_T[0]);
+        if (op == ALU_SBC) {
+            gen_compute_carry(s, cpu_T[1]);
+            tcg_gen_sub_tl(cpu_A, cpu_A, cpu_T[1]);
+        }
+        tcg_gen_ext8u_tl(cpu_A, cpu_A);
+        break;
+    case ALU_AND:
+        tcg_gen_and_tl(cpu_A, cpu_A, cpu_T[0]);
+        break;
+    case ALU_XOR:
+        tcg_gen_xor_tl(cpu_A, cpu_A, cpu_T[0]);
+        break;
+    case ALU_OR:
+        tcg_gen_or_tl(cpu_A, cpu_A, cpu_T[0]);
+        break;
+    case ALU_CP:
+        break;
+    }
+}
+
+/* A = A op T0, only recording the operands needed to compute the flags */
+static void gen_alu_T0(DisasContext *s, int op)
+{
+    if (flags_dead(s)) {
+        gen_alu_T0_noflags(s, op);
+        return;
+    }
+    switch (op) {
+    case ALU_ADD:
+    case ALU_ADC:
+    case ALU_SUB:
+    case ALU_SBC:
+    case ALU_CP:
+        if (op == ALU_ADC || op == ALU_SBC) {
+            gen_compute_carry(s, cpu_T[1]);
+        }
+        gen_movb_v_A(cpu_cc_src2);
+        tcg_gen_mov_tl(cpu_cc_src, cpu_T[0]);
+        if (op == ALU_ADD || op == ALU_ADC) {
+            tcg_gen_add_tl(cpu_cc_dst, cpu_cc_src2, cpu_cc_src);
+            if (op == ALU_ADC) {
+                tcg_gen_add_tl(cpu_cc_dst, cpu_cc_dst, cpu_T[1]);
+            }
+            s->cc_op = CC_OP_ADDB;
+        } else {
+            tcg_gen_sub_tl(cpu_cc_dst, cpu_cc_src2, cpu_cc_src);
+            if (op == ALU_SBC) {
+                tcg_gen_sub_tl(cpu_cc_dst, cpu_cc_dst, cpu_T[1]);
+            }
+            s->cc_op = CC_OP_SUBB;
+        }
+        if (op != ALU_CP) {
+            tcg_gen_ext8u_tl(cpu_T[0], cpu_cc_dst);
+            gen_movb_A_v(cpu_T[0]);
+        }
+        break;
+    case ALU_AND:
+    case ALU_XOR:
+    case ALU_OR:
+        gen_movb_v_A(cpu_cc_dst);
+        if (op == ALU_AND) {
+            tcg_gen_and_tl(cpu_cc_dst, cpu_cc_dst, cpu_T[0]);
+            tcg_gen_movi_tl(cpu_cc_src, CC_H);
+        } else {
+            if (op == ALU_XOR) {
+                tcg_gen_xor_tl(cpu_cc_dst, cpu_cc_dst, cpu_T[0]);
+            } else {
+                tcg_gen_or_tl(cpu_cc_dst, cpu_cc_dst, cpu_T[0]);
+            }
+            tcg_gen_movi_tl(cpu_cc_src, 0);
+        }
+        gen_movb_A_v(cpu_cc_dst);
+        s->cc_op = CC_OP_LOGICB;
+        break;
+    }
+}
+
+/* T0 = T0 + T1 for add hl,rr: H and C come from bits 11 and 15, S, Z and
+   P are preserved */
+static void gen_addw_T0_T1(void)
+{
+    TCGv res = tcg_temp_new();
+    TCGv tmp = tcg_temp_new();
+
+    tcg_gen_add_tl(res, cpu_T[0], cpu_T[1]);
+    tcg_gen_xor_tl(tmp, cpu_T[0], cpu_T[1]);
+    tcg_gen_xor_tl(tmp, tmp, res);
+    tcg_gen_shri_tl(tmp, tmp, 8);
+    tcg_gen_andi_tl(tmp, tmp, CC_H);
+    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+    tcg_gen_or_tl(cpu_F, cpu_F, tmp);
+    tcg_gen_shri_tl(tmp, res, 16);
+    tcg_gen_or_tl(cpu_F, cpu_F, tmp);
+    tcg_gen_ext16u_tl(cpu_T[0], res);
+
+    tcg_temp_free(tmp);
+    tcg_temp_free(res);
+}
+
+/* T0 = T0 +/- 1, the preserved carry is left in T1 for gen_incdec_cc() */
+static void gen_incdec_T0(DisasContext *s, int dec)
+{
+    if (!flags_dead(s)) {
+        gen_kept_carry(s, cpu_T[1]);
+    }
+    if (dec) {
+        tcg_gen_subi_tl(cpu_T[0], cpu_T[0], 1);
+    } else {
+        tcg_gen_addi_tl(cpu_T[0], cpu_T[0], 1);
+    }
+    tcg_gen_ext8u_tl(cpu_T[0], cpu_T[0]);
+}
+
+/* the flags must only be recorded once the result has been written back,
+   so that a faulting store restarts the instruction with intact cc state */
+static inline void gen_incdec_cc(DisasContext *s, int dec)
+{
+    if (flags_dead(s)) {
+        return;
+    }
+    tcg_gen_mov_tl(cpu_cc_src, cpu_T[1]);
+    tcg_gen_mov_tl(cpu_cc_dst, cpu_T[0]);
+    s->cc_op = dec ? CC_OP_DECB : CC_OP_INCB;
+}
+
 /* Rotation/shift operations */
 
 static const char *const rot[8] = {
@@ -622,19 +1122,79 @@ static const char *const rot[8] = {
     "srl",
 };
 
-typedef void (rot_helper_func)(void);
-
-static rot_helper_func *const gen_rot_T0[8] = {
-    gen_helper_rlc_T0_cc,
-    gen_helper_rrc_T0_cc,
-    gen_helper_rl_T0_cc,
-    gen_helper_rr_T0_cc,
-    gen_helper_sla_T0_cc,
-    gen_helper_sra_T0_cc,
-    gen_helper_sll_T0_cc,
-    gen_helper_srl_T0_cc,
+enum {
+    ROT_RLC,
+    ROT_RRC,
+    ROT_RL,
+    ROT_RR,
+    ROT_SLA,
+    ROT_SRA,
+    ROT_SLL,
+    ROT_SRL,
 };
 
+/* T0 = T0 rot 1; T1 = 9-bit result with the carry out in bit 8,
+   to be recorded by gen_rot_cc() */
+static void gen_rot_T0(DisasContext *s, int op)
+{
+    TCGv tmp = tcg_temp_new();
+
+    switch (op) {
+    case ROT_RLC:
+        tcg_gen_shri_tl(tmp, cpu_T[0], 7);
+        tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 1);
+        tcg_gen_or_tl(cpu_T[1], cpu_T[1], tmp);
+        break;
+    case ROT_RL:
+        gen_compute_carry(s, tmp);
+        tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 1);
+        tcg_gen_or_tl(cpu_T[1], cpu_T[1], tmp);
+        break;
+    case ROT_SLA:
+        tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 1);
+        break;
+    case ROT_SLL:
+        /* Z80-specific: R800 has tst instruction */
+        tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 1);
+        tcg_gen_ori_tl(cpu_T[1], cpu_T[1], 1); /* Yes -- bit 0 is *set* */
+        break;
+    case ROT_RRC:
+    case ROT_RR:
+    case ROT_SRA:
+    case ROT_SRL:
+        /* bit 0 is both the carry out (bit 8) and for rrc the new bit 7 */
+        tcg_gen_andi_tl(tmp, cpu_T[0], 0x01);
+        if (op == ROT_RRC) {
+            tcg_gen_muli_tl(tmp, tmp, 0x180);
+        } else {
+            tcg_gen_shli_tl(tmp, tmp, 8);
+        }
+        tcg_gen_shri_tl(cpu_T[1], cpu_T[0], 1);
+        tcg_gen_or_tl(cpu_T[1], cpu_T[1], tmp);
+        if (op == ROT_RR) {
+            gen_compute_carry(s, tmp);
+            tcg_gen_shli_tl(tmp, tmp, 7);
+            tcg_gen_or_tl(cpu_T[1], cpu_T[1], tmp);
+        } else if (op == ROT_SRA) {
+            tcg_gen_andi_tl(tmp, cpu_T[0], 0x80);
+            tcg_gen_or_tl(cpu_T[1], cpu_T[1], tmp);
+        }
+        break;
+    }
+    tcg_gen_ext8u_tl(cpu_T[0], cpu_T[1]);
+    tcg_temp_free(tmp);
+}
+
+static inline void gen_rot_cc(DisasContext *s)
+{
+    if (flags_dead(s)) {
+        return;
+    }
+    tcg_gen_mov_tl(cpu_cc_dst, cpu_T[1]);
+    tcg_gen_movi_tl(cpu_cc_src, 0);
+    s->cc_op = CC_OP_LOGICB;
+}
+
 /* Block instructions */
 
 static const char *const bli[4][4] = {
@@ -648,38 +1208,414 @@ static const int imode[8] = {
     0, 0, 1, 2, 0, 0, 1, 2,
 };
 
-static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong pc)
+/* with the guest profiler, blocks count their own executions. The size
+   of the block is only known at its end and is patched in like the
+   icount. */
+static TCGArg *prof_info_arg;
+
+static inline void gen_prof_start(CPUState *env, target_ulong pc)
 {
+    TCGv_i32 info;
+    target_phys_addr_t phys;
+
+    phys = cpu_get_phys_page_debug(env, pc) + (pc & ~TARGET_PAGE_MASK);
+    info = tcg_temp_new_i32();
+    prof_info_arg = gen_opparam_ptr + 1;
+    tcg_gen_movi_i32(info, 0);
+    gen_helper_prof_block(tcg_const_i32(pc), tcg_const_i32(phys), info);
+    tcg_temp_free_i32(info);
+}
+
+static inline void gen_prof_end(target_ulong size, int num_insns)
+{
+    *prof_info_arg = (size << 16) | num_insns;
+}
+
+/* leave the TB at pc, whose state is in env, unless cpu_exec() has
+   nothing to do before it runs again: chained TBs and loop regions only
+   look at the cycle timers, and cpu_exit() and cpu_interrupt() bring
+   the deadline forward */
+static inline void gen_check_deadline(target_ulong pc)
+{
+    TCGv_i64 deadline;
+    int l1;
+
+    l1 = gen_new_label();
+    deadline = tcg_temp_new_i64();
+    tcg_gen_ld_i64(deadline, cpu_env, offsetof(CPUState, tstate_deadline));
+    tcg_gen_brcond_i64(TCG_COND_LTU, cpu_tstates, deadline, l1);
+    tcg_temp_free_i64(deadline);
     gen_jmp_im(pc);
-    gen_eob(s);
+    tcg_gen_exit_tb(0);
+    gen_set_label(l1);
 }
 
-static inline void gen_cond_jump(int cc, int l1)
+/* the table entry of the insn at pc, and in *prefixes the number of
+   prefix bytes before the part it describes.  NULL for a DD or FD
+   followed by another DD, FD or ED, which is translated as a prefix that
+   does nothing. */
+static const Z80Insn *z80_insn_lookup(target_ulong pc, int *prefixes)
 {
-    gen_movb_v_F(cpu_T[0]);
+    const Z80Insn *insn;
+    int b;
+
+    b = ldub_code(pc);
+    insn = &z80_insn_main[b];
+    *prefixes = 0;
+    if (!(insn->kind & Z80_INSN_PREFIX)) {
+        return insn;
+    }
+    *prefixes = 1;
+    if (b == 0xcb) {
+        return &z80_insn_cb[ldub_code(pc + 1)];
+    } else if (b == 0xed) {
+        return &z80_insn_ed[ldub_code(pc + 1)];
+    }
+    insn = &z80_insn_xd[ldub_code(pc + 1)];
+    if (!(insn->kind & Z80_INSN_PREFIX)) {
+        return insn;
+    } else if (insn->kind & Z80_INSN_INVALID) {
+        return NULL;
+    }
+    *prefixes = 2;
+    return &z80_insn_xdcb[ldub_code(pc + 3)];
+}
+
+/* Flag liveness.  The insns of the TB are decoded ahead of translation,
+   and live[] gets the flags each one leaves that a later insn reads
+   before they are set again; an insn can skip computing the flags it
+   sets when none of them is, and bringing F up to date for those it
+   keeps when none of those is.  Everything is live where the TB may be
+   left: at its end, and before an insn that may leave it in the middle
+   (I/O that is retried, halt, block repeats, and stores, which restart
+   the TB from the storing insn when they hit its own code) or where the
+   board's trap may take over. */
+static void flags_liveness(DisasContext *s, CPUState *env, int max_insns)
+{
+    target_ulong pc_start = s->tb->pc;
+    target_ulong pc = pc_start;
+    uint8_t read[LIVE_MAX_INSNS], written[LIVE_MAX_INSNS];
+    const Z80Insn *insn;
+    int i, n, live, prefixes;
+
+    n = 0;
+    while (n < LIVE_MAX_INSNS && n < max_insns) {
+        if (env->trap_fn != NULL && pc == env->trap_pc) {
+            break;
+        }
+        insn = z80_insn_lookup(pc, &prefixes);
+        if (!insn) {
+            break;
+        }
+        read[n] = insn->flags_read;
+        written[n] = insn->flags_written;
+        if (insn->kind & (Z80_INSN_IO | Z80_INSN_HALT | Z80_INSN_REPEAT |
+                          Z80_INSN_STORE)) {
+            read[n] = 0xff;
+        }
+        n++;
+        pc += prefixes + insn->len;
+        /* where the translation loop stops */
+        if ((insn->kind & (Z80_INSN_JR | Z80_INSN_JP | Z80_INSN_CALL |
+                           Z80_INSN_RST | Z80_INSN_RET | Z80_INSN_JUMP |
+                           Z80_INSN_HALT | Z80_INSN_REPEAT)) ||
+            (pc - pc_start) >= (TARGET_PAGE_SIZE - 32) ||
+            ((s->tb->cflags & CF_SMC) && (pc - pc_start) >= 60)) {
+            break;
+        }
+    }
 
-    tcg_gen_andi_tl(cpu_T[0], cpu_T[0], cc_flags[cc >> 1]);
+    live = 0xff;
+    for (i = n - 1; i >= 0; i--) {
+        s->live[i] = live;
+        live = (live & ~written[i]) | read[i];
+    }
+    s->live_insns = n;
+}
 
-    tcg_gen_brcondi_tl((cc & 1) ? TCG_COND_NE : TCG_COND_EQ, cpu_T[0], 0, l1);
+/* Loop regions.  A backward branch to the same page counts its runs in
+   env->loop_count.  After LOOP_HOT_COUNT of them, helper_loop_hot()
+   marks the target hot and drops the TB there, which is then translated
+   as a loop region: the code from the head to the first branch back to
+   it, in a single TB.  Branches between insns of the region jump inside
+   the TB, with the cycle timer check on the backward ones, and the other
+   exits of the region take the goto_tb slots in turn. */
+
+/* decode the insn at pc for loop_scan(): its length, and the target of
+   a jr, djnz or jp nn */
+#define LOOP_INSN   0
+#define LOOP_BRANCH 1
+#define LOOP_END    2   /* ends the TB, or not worth handling */
+
+static int loop_insn(target_ulong pc, int *len, target_ulong *target)
+{
+    const Z80Insn *insn;
+    int n;
+
+    insn = z80_insn_lookup(pc, &n);
+    if (!insn || (insn->kind & (Z80_INSN_CALL | Z80_INSN_RST |
+                                Z80_INSN_JUMP | Z80_INSN_HALT |
+                                Z80_INSN_REPEAT | Z80_INSN_INVALID))) {
+        return LOOP_END;
+    }
+    if ((insn->kind & (Z80_INSN_RET | Z80_INSN_COND)) == Z80_INSN_RET) {
+        return LOOP_END;
+    }
+    *len = n + insn->len;
+    if (insn->kind & Z80_INSN_JR) {
+        *target = (pc + *len + (int8_t)ldub_code(pc + *len - 1)) & 0xffff;
+        return LOOP_BRANCH;
+    }
+    if (insn->kind & Z80_INSN_JP) {
+        *target = lduw_code(pc + *len - 2);
+        return LOOP_BRANCH;
+    }
+    return LOOP_INSN;
+}
+
+/* find the region of a loop whose head is tb->pc, and give a label to
+   each branch target in it.  Returns 0 if there is no region. */
+static int loop_scan(DisasContext *s, CPUState *env)
+{
+    target_ulong pc_start = s->tb->pc;
+    target_ulong pc, target, targets[LOOP_MAX_INSNS];
+    uint64_t starts;
+    int i, kind, ninsns, ntargets, len, ofs;
+
+    pc = pc_start;
+    starts = 0;
+    ntargets = 0;
+    for (ninsns = 0;; ninsns++) {
+        if (ninsns == LOOP_MAX_INSNS) {
+            return 0;
+        }
+        kind = loop_insn(pc, &len, &target);
+        ofs = pc - pc_start;
+        if (kind == LOOP_END || ofs + len > LOOP_MAX_BYTES ||
+            ((pc_start ^ (pc + len - 1)) & TARGET_PAGE_MASK) ||
+            (env->trap_fn != NULL && env->trap_pc == pc)) {
+            return 0;
+        }
+        starts |= (uint64_t)1 << ofs;
+        pc += len;
+        if (kind == LOOP_BRANCH) {
+            targets[ntargets++] = target;
+            if (target == pc_start) {
+                break;
+            }
+        }
+    }
+
+    s->loop_size = pc - pc_start;
+    s->loop_slot = 0;
+    s->loop_label_set = 0;
+    for (i = 0; i < LOOP_MAX_BYTES; i++) {
+        s->loop_label[i] = -1;
+    }
+    for (i = 0; i < ntargets; i++) {
+        ofs = targets[i] - pc_start;
+        if (targets[i] >= pc_start && ofs < s->loop_size &&
+            ((starts >> ofs) & 1) && s->loop_label[ofs] < 0) {
+            s->loop_label[ofs] = gen_new_label();
+        }
+    }
+    return 1;
+}
+
+/* the label of pc in the loop region, or -1 */
+static inline int loop_label(DisasContext *s, target_ulong pc)
+{
+    target_ulong ofs = (pc - s->tb->pc) & 0xffff;
+
+    if (ofs >= s->loop_size) {
+        return -1;
+    }
+    return s->loop_label[ofs];
+}
+
+/* the insn at pc is the target of branches inside the loop region: the
+   paths meet with the state in env */
+static void gen_loop_label(DisasContext *s, target_ulong pc)
+{
+    int l = loop_label(s, pc);
+
+    if (l < 0) {
+        return;
+    }
+    gen_update_cc_op(s);
+    gen_update_tstates(s);
+    gen_set_label(l);
+    s->loop_label_set |= (uint64_t)1 << (pc - s->tb->pc);
+    s->cc_op = CC_OP_DYNAMIC;
+}
+
+/* the labels of insns that were not translated, when the region was cut
+   short, leave the TB */
+static void gen_loop_stubs(DisasContext *s)
+{
+    int i;
+
+    for (i = 0; i < s->loop_size; i++) {
+        if (s->loop_label[i] >= 0 && !((s->loop_label_set >> i) & 1)) {
+            gen_set_label(s->loop_label[i]);
+            gen_jmp_im((s->tb->pc + i) & 0xffff);
+            tcg_gen_exit_tb(0);
+        }
+    }
+}
+
+/* jump to pc inside the loop region; returns 0 if pc is not in it */
+static int gen_loop_branch(DisasContext *s, target_ulong pc)
+{
+    int l = loop_label(s, pc);
+
+    if (l < 0) {
+        return 0;
+    }
+    gen_update_cc_op(s);
+    gen_flush_tstates(s);
+    if (((pc - s->tb->pc) & 0xffff) < ((s->pc - s->tb->pc) & 0xffff)) {
+        gen_check_deadline(pc);
+    }
+    tcg_gen_br(l);
+    return 1;
+}
+
+/* count the runs of a backward branch to pc, outside loop regions */
+static void gen_loop_count(DisasContext *s, target_ulong pc)
+{
+    TCGv count;
+    int offset, l1;
+    uint32_t phys;
+
+    /* the head must be on the page of tb->pc, whose ram address is known */
+    if (s->loop || pc >= s->pc || s->pc - pc > LOOP_MAX_BYTES ||
+        ((pc ^ s->pc) & TARGET_PAGE_MASK) ||
+        ((pc ^ s->tb->pc) & TARGET_PAGE_MASK) || use_icount) {
+        return;
+    }
+    phys = s->phys_pc + (pc - s->tb->pc);
+    if (cpu_z80_loop_state(s->loop_heads, phys) != Z80_LOOP_COLD) {
+        return;
+    }
+    offset = offsetof(CPUState, loop_count[pc % Z80_LOOP_COUNT_SIZE]);
+    l1 = gen_new_label();
+    count = tcg_temp_new();
+    tcg_gen_ld16u_tl(count, cpu_env, offset);
+    tcg_gen_addi_tl(count, count, 1);
+    tcg_gen_st16_tl(count, cpu_env, offset);
+    tcg_gen_brcondi_tl(TCG_COND_LTU, count, LOOP_HOT_COUNT, l1);
+    tcg_temp_free(count);
+    gen_helper_loop_hot(tcg_const_i32(pc), tcg_const_i32(phys));
+    gen_jmp_im(pc);
+    tcg_gen_exit_tb(0);
+    gen_set_label(l1);
+}
+
+static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong pc)
+{
+    TranslationBlock *tb;
+
+    if (s->loop) {
+        if (gen_loop_branch(s, pc)) {
+            s->is_jmp = 3;
+            return;
+        }
+        tb_num = s->loop_slot++;
+        if (tb_num > 1) {
+            gen_jmp_im(pc);
+            gen_eob(s);
+            return;
+        }
+    }
+
+    tb = s->tb;
+    /* NOTE: we handle the case where the TB spans two pages here */
+    if (s->jmp_opt &&
+        ((pc & TARGET_PAGE_MASK) == (tb->pc & TARGET_PAGE_MASK) ||
+         (pc & TARGET_PAGE_MASK) == ((s->pc - 1) & TARGET_PAGE_MASK))) {
+        /* jump to same page: we can use a direct jump */
+        gen_update_cc_op(s);
+        gen_flush_tstates(s);
+        gen_loop_count(s, pc);
+        gen_check_deadline(pc);
+        tcg_gen_goto_tb(tb_num);
+        gen_jmp_im(pc);
+        tcg_gen_exit_tb((long)tb + tb_num);
+        s->is_jmp = 3;
+    } else {
+        /* jump to another page: currently not optimized */
+        gen_jmp_im(pc);
+        gen_eob(s);
+    }
+}
+
+/* branch to l1 if cc holds; Z, C and S are tested directly on the lazy
+   cc state, so that F is not materialized on the common paths */
+static inline void gen_cond_jump(DisasContext *s, int cc, int l1)
+{
+    int flag = cc_flags[cc >> 1];
+    int set = cc & 1;
+    TCGv tmp = tcg_temp_new();
+
+    if (flag == CC_C) {
+        gen_compute_carry(s, tmp);
+    } else if (flag != CC_P && s->cc_op != CC_OP_DYNAMIC &&
+               s->cc_op != CC_OP_FLAGS) {
+        if (flag == CC_Z) {
+            /* Z is set iff the 8-bit result is zero */
+            tcg_gen_andi_tl(tmp, cpu_cc_dst, 0xff);
+            set = !set;
+        } else {
+            tcg_gen_andi_tl(tmp, cpu_cc_dst, 0x80);
+        }
+    } else {
+        gen_compute_flags(s);
+        tcg_gen_andi_tl(tmp, cpu_F, flag);
+    }
+
+    tcg_gen_brcondi_tl(set ? TCG_COND_NE : TCG_COND_EQ, tmp, 0, l1);
+    tcg_temp_free(tmp);
+}
+
+/* the path of a conditional insn that does not branch: it leaves the
+   TB, or goes on with the next insn in a loop region.  Returns the label
+   to set once the other path is generated, or -1. */
+static inline int gen_not_taken(DisasContext *s, target_ulong next_pc)
+{
+    int l2 = -1;
+
+    if (s->loop) {
+        l2 = gen_new_label();
+        tcg_gen_br(l2);
+    } else {
+        gen_goto_tb(s, 0, next_pc);
+    }
+    return l2;
 }
 
 static inline void gen_jcc(DisasContext *s, int cc,
                            target_ulong val, target_ulong next_pc)
 {
     TranslationBlock *tb;
-    int l1;
+    int l1, l2;
 
     tb = s->tb;
 
     l1 = gen_new_label();
 
-    gen_cond_jump(cc, l1);
+    gen_cond_jump(s, cc, l1);
 
-    gen_goto_tb(s, 0, next_pc);
+    l2 = gen_not_taken(s, next_pc);
 
     gen_set_label(l1);
+    s->insn_tstates += s->insn->tstates_taken;
     gen_goto_tb(s, 1, val);
 
+    if (l2 >= 0) {
+        s->insn_tstates -= s->insn->tstates_taken;
+        gen_set_label(l2);
+    }
     s->is_jmp = 3;
 }
 
@@ -693,13 +1629,14 @@ static inline void gen_callcc(DisasContext *s, int cc,
 
     l1 = gen_new_label();
 
-    gen_cond_jump(cc, l1);
+    gen_cond_jump(s, cc, l1);
 
     gen_goto_tb(s, 0, next_pc);
 
     gen_set_label(l1);
+    s->insn_tstates += s->insn->tstates_taken;
     tcg_gen_movi_tl(cpu_T[0], next_pc);
-    gen_pushw(cpu_T[0]);
+    gen_pushw(s, cpu_T[0]);
     gen_goto_tb(s, 1, val);
 
     s->is_jmp = 3;
@@ -709,21 +1646,52 @@ static inline void gen_retcc(DisasContext *s, int cc,
                              target_ulong next_pc)
 {
     TranslationBlock *tb;
-    int l1;
+    int l1, l2;
 
     tb = s->tb;
 
     l1 = gen_new_label();
 
-    gen_cond_jump(cc, l1);
+    gen_cond_jump(s, cc, l1);
 
-    gen_goto_tb(s, 0, next_pc);
+    l2 = gen_not_taken(s, next_pc);
 
     gen_set_label(l1);
+    s->insn_tstates += s->insn->tstates_taken;
     gen_popw(cpu_T[0]);
     gen_helper_jmp_T0();
     gen_eob(s);
 
+    if (l2 >= 0) {
+        s->insn_tstates -= s->insn->tstates_taken;
+        gen_set_label(l2);
+    }
+    s->is_jmp = 3;
+}
+
+static inline void gen_djnz(DisasContext *s, target_ulong val,
+                            target_ulong next_pc)
+{
+    int l1, l2;
+
+    l1 = gen_new_label();
+
+    gen_movb_v_reg(cpu_T[0], OR_B);
+    tcg_gen_subi_tl(cpu_T[0], cpu_T[0], 1);
+    tcg_gen_andi_tl(cpu_T[0], cpu_T[0], 0xff);
+    gen_movb_reg_v(s, OR_B, cpu_T[0]);
+    tcg_gen_brcondi_tl(TCG_COND_NE, cpu_T[0], 0, l1);
+
+    l2 = gen_not_taken(s, next_pc);
+
+    gen_set_label(l1);
+    s->insn_tstates += s->insn->tstates_taken;
+    gen_goto_tb(s, 1, val);
+
+    if (l2 >= 0) {
+        s->insn_tstates -= s->insn->tstates_taken;
+        gen_set_label(l2);
+    }
     s->is_jmp = 3;
 }
 
@@ -739,8 +1707,6 @@ static inline void gen_ex(int regpair1, int regpair2)
     tcg_temp_free(tmp2);
 }
 
-/* TODO: condition code optimisation */
-
 /* micro-ops that modify condition codes should end in _cc */
 
 /* convert one instruction. s->is_jmp is set if the translation must
@@ -752,6 +1718,7 @@ static target_ulong disas_insn(DisasContext *s, target_ulong pc_start)
     int m;
 
     s->pc = pc_start;
+    s->insn_tstates = 0;
     prefixes = 0;
     s->override = -1;
     rex_w = -1;
@@ -777,6 +1744,9 @@ next_byte:
         b = ldub_code(s->pc);
         s->pc++;
 
+        s->insn = m == MODE_NORMAL ? &z80_insn_main[b] : &z80_insn_xd[b];
+        s->insn_tstates += s->insn->tstates;
+
         int x, y, z, p, q;
         int n, d;
         int r1, r2;
@@ -797,23 +1767,20 @@ next_byte:
                     zprintf("nop\n");
                     break;
                 case 1:
+                    gen_compute_flags(s);
                     gen_ex(OR2_AF, OR2_AFX);
                     zprintf("ex af,af'\n");
                     break;
                 case 2:
                     n = ldsb_code(s->pc);
                     s->pc++;
-                    gen_helper_djnz(tcg_const_tl(s->pc + n), tcg_const_tl(s->pc));
-                    gen_eob(s);
-                    s->is_jmp = 3;
+                    gen_djnz(s, s->pc + n, s->pc);
                     zprintf("djnz $%02x\n", n);
                     break;
                 case 3:
                     n = ldsb_code(s->pc);
                     s->pc++;
-                    gen_jmp_im(s->pc + n);
-                    gen_eob(s);
-                    s->is_jmp = 3;
+                    gen_goto_tb(s, 0, s->pc + n);
                     zprintf("jr $%02x\n", n);
                     break;
                 case 4:
@@ -831,9 +1798,7 @@ next_byte:
             case 1:
                 switch (q) {
                 case 0:
-                    n = lduw_code(s->pc);
-                    s->pc += 2;
-                    tcg_gen_movi_tl(cpu_T[0], n);
+                    n = gen_movw_v_imm(s, cpu_T[0]);
                     r1 = regpairmap(regpair[p], m);
                     gen_movw_reg_v(r1, cpu_T[0]);
                     zprintf("ld %s,$%04x\n", regpairnames[r1], n);
@@ -843,7 +1808,13 @@ next_byte:
                     r2 = regpairmap(OR2_HL, m);
                     gen_movw_v_reg(cpu_T[0], r1);
                     gen_movw_v_reg(cpu_T[1], r2);
-                    gen_helper_addw_T0_T1_cc();
+                    if (flags_dead(s)) {
+                        tcg_gen_add_tl(cpu_T[0], cpu_T[0], cpu_T[1]);
+                        tcg_gen_ext16u_tl(cpu_T[0], cpu_T[0]);
+                    } else {
+                        gen_prepare_flags(s);
+                        gen_addw_T0_T1();
+                    }
                     gen_movw_reg_v(r2, cpu_T[0]);
                     zprintf("add %s,%s\n", regpairnames[r2], regpairnames[r1]);
                     break;
@@ -857,29 +1828,29 @@ next_byte:
                     case 0:
                         gen_movb_v_A(cpu_T[0]);
                         gen_movw_v_BC(cpu_A0);
+                        gen_store_tstates(s, -1, 1);
                         tcg_gen_qemu_st8(cpu_T[0], cpu_A0, MEM_INDEX);
                         zprintf("ld (bc),a\n");
                         break;
                     case 1:
                         gen_movb_v_A(cpu_T[0]);
                         gen_movw_v_DE(cpu_A0);
+                        gen_store_tstates(s, -1, 1);
                         tcg_gen_qemu_st8(cpu_T[0], cpu_A0, MEM_INDEX);
                         zprintf("ld (de),a\n");
                         break;
                     case 2:
-                        n = lduw_code(s->pc);
-                        s->pc += 2;
+                        n = gen_movw_v_imm(s, cpu_A0);
                         r1 = regpairmap(OR2_HL, m);
                         gen_movw_v_reg(cpu_T[0], r1);
-                        tcg_gen_movi_i32(cpu_A0, n);
+                        gen_store_tstates(s, imm_store_addr(s, n), 2);
                         tcg_gen_qemu_st16(cpu_T[0], cpu_A0, MEM_INDEX);
                         zprintf("ld ($%04x),%s\n", n, regpairnames[r1]);
                         break;
                     case 3:
-                        n = lduw_code(s->pc);
-                        s->pc += 2;
+                        n = gen_movw_v_imm(s, cpu_A0);
                         gen_movb_v_A(cpu_T[0]);
-                        tcg_gen_movi_i32(cpu_A0, n);
+                        gen_store_tstates(s, imm_store_addr(s, n), 1);
                         tcg_gen_qemu_st8(cpu_T[0], cpu_A0, MEM_INDEX);
                         zprintf("ld ($%04x),a\n", n);
                         break;
@@ -900,18 +1871,14 @@ next_byte:
                         zprintf("ld a,(de)\n");
                         break;
                     case 2:
-                        n = lduw_code(s->pc);
-                        s->pc += 2;
+                        n = gen_movw_v_imm(s, cpu_A0);
                         r1 = regpairmap(OR2_HL, m);
-                        tcg_gen_movi_i32(cpu_A0, n);
                         tcg_gen_qemu_ld16u(cpu_T[0], cpu_A0, MEM_INDEX);
                         gen_movw_reg_v(r1, cpu_T[0]);
                         zprintf("ld %s,($%04x)\n", regpairnames[r1], n);
                         break;
                     case 3:
-                        n = lduw_code(s->pc);
-                        s->pc += 2;
-                        tcg_gen_movi_i32(cpu_A0, n);
+                        n = gen_movw_v_imm(s, cpu_A0);
                         tcg_gen_qemu_ld8u(cpu_T[0], cpu_A0, MEM_INDEX);
                         gen_movb_A_v(cpu_T[0]);
                         zprintf("ld a,($%04x)\n", n);
@@ -949,12 +1916,13 @@ next_byte:
                 } else {
                     gen_movb_v_reg(cpu_T[0], r1);
                 }
-                gen_helper_incb_T0_cc();
+                gen_incdec_T0(s, 0);
                 if (is_indexed(r1)) {
-                    gen_movb_idx_v(r1, cpu_T[0], d);
+                    gen_movb_idx_v(s, r1, cpu_T[0], d);
                 } else {
-                    gen_movb_reg_v(r1, cpu_T[0]);
+                    gen_movb_reg_v(s, r1, cpu_T[0]);
                 }
+                gen_incdec_cc(s, 0);
                 if (is_indexed(r1)) {
                     zprintf("inc (%s%c$%02x)\n", idxnames[r1], shexb(d));
                 } else {
@@ -971,12 +1939,13 @@ next_byte:
                 } else {
                     gen_movb_v_reg(cpu_T[0], r1);
                 }
-                gen_helper_decb_T0_cc();
+                gen_incdec_T0(s, 1);
                 if (is_indexed(r1)) {
-                    gen_movb_idx_v(r1, cpu_T[0], d);
+                    gen_movb_idx_v(s, r1, cpu_T[0], d);
                 } else {
-                    gen_movb_reg_v(r1, cpu_T[0]);
+                    gen_movb_reg_v(s, r1, cpu_T[0]);
                 }
+                gen_incdec_cc(s, 1);
                 if (is_indexed(r1)) {
                     zprintf("dec (%s%c$%02x)\n", idxnames[r1], shexb(d));
                 } else {
@@ -990,13 +1959,11 @@ next_byte:
                     d = ldsb_code(s->pc);
                     s->pc++;
                 }
-                n = ldub_code(s->pc);
-                s->pc++;
-                tcg_gen_movi_tl(cpu_T[0], n);
+                n = gen_movb_v_imm(s, cpu_T[0]);
                 if (is_indexed(r1)) {
-                    gen_movb_idx_v(r1, cpu_T[0], d);
+                    gen_movb_idx_v(s, r1, cpu_T[0], d);
                 } else {
-                    gen_movb_reg_v(r1, cpu_T[0]);
+                    gen_movb_reg_v(s, r1, cpu_T[0]);
                 }
                 if (is_indexed(r1)) {
                     zprintf("ld (%s%c$%02x),$%02x\n", idxnames[r1], shexb(d), n);
@@ -1006,21 +1973,44 @@ next_byte:
                 break;
 
             case 7:
+                gen_prepare_flags(s);
                 switch (y) {
                 case 0:
-                    gen_helper_rlca_cc();
+                    tcg_gen_shri_tl(cpu_T[0], cpu_A, 7);
+                    tcg_gen_shli_tl(cpu_A, cpu_A, 1);
+                    tcg_gen_or_tl(cpu_A, cpu_A, cpu_T[0]);
+                    tcg_gen_ext8u_tl(cpu_A, cpu_A);
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[0]);
                     zprintf("rlca\n");
                     break;
                 case 1:
-                    gen_helper_rrca_cc();
+                    tcg_gen_andi_tl(cpu_T[0], cpu_A, 0x01);
+                    tcg_gen_shri_tl(cpu_A, cpu_A, 1);
+                    tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 7);
+                    tcg_gen_or_tl(cpu_A, cpu_A, cpu_T[1]);
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[0]);
                     zprintf("rrca\n");
                     break;
                 case 2:
-                    gen_helper_rla_cc();
+                    tcg_gen_shri_tl(cpu_T[0], cpu_A, 7);
+                    tcg_gen_andi_tl(cpu_T[1], cpu_F, CC_C);
+                    tcg_gen_shli_tl(cpu_A, cpu_A, 1);
+                    tcg_gen_or_tl(cpu_A, cpu_A, cpu_T[1]);
+                    tcg_gen_ext8u_tl(cpu_A, cpu_A);
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[0]);
                     zprintf("rla\n");
                     break;
                 case 3:
-                    gen_helper_rra_cc();
+                    tcg_gen_andi_tl(cpu_T[0], cpu_A, 0x01);
+                    tcg_gen_andi_tl(cpu_T[1], cpu_F, CC_C);
+                    tcg_gen_shli_tl(cpu_T[1], cpu_T[1], 7);
+                    tcg_gen_shri_tl(cpu_A, cpu_A, 1);
+                    tcg_gen_or_tl(cpu_A, cpu_A, cpu_T[1]);
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[0]);
                     zprintf("rra\n");
                     break;
                 case 4:
@@ -1028,15 +2018,23 @@ next_byte:
                     zprintf("daa\n");
                     break;
                 case 5:
-                    gen_helper_cpl_cc();
+                    tcg_gen_xori_tl(cpu_A, cpu_A, 0xff);
+                    tcg_gen_ori_tl(cpu_F, cpu_F, CC_H | CC_N);
                     zprintf("cpl\n");
                     break;
                 case 6:
-                    gen_helper_scf_cc();
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_ori_tl(cpu_F, cpu_F, CC_C);
                     zprintf("scf\n");
                     break;
                 case 7:
-                    gen_helper_ccf_cc();
+                    /* H = old C, C = !C */
+                    tcg_gen_andi_tl(cpu_T[0], cpu_F, CC_C);
+                    tcg_gen_shli_tl(cpu_T[1], cpu_T[0], 4);
+                    tcg_gen_xori_tl(cpu_T[0], cpu_T[0], CC_C);
+                    tcg_gen_andi_tl(cpu_F, cpu_F, CC_S | CC_Z | CC_P);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[0]);
+                    tcg_gen_or_tl(cpu_F, cpu_F, cpu_T[1]);
                     zprintf("ccf\n");
                     break;
                 }
@@ -1047,6 +2045,8 @@ next_byte:
         case 1:
             if (z == 6 && y == 6) {
                 gen_jmp_im(s->pc);
+                gen_update_cc_op(s);
+                gen_flush_tstates(s);
                 gen_helper_halt();
                 zprintf("halt\n");
             } else {
@@ -1070,9 +2070,9 @@ next_byte:
                     gen_movb_v_reg(cpu_T[0], r1);
                 }
                 if (is_indexed(r2)) {
-                    gen_movb_idx_v(r2, cpu_T[0], d);
+                    gen_movb_idx_v(s, r2, cpu_T[0], d);
                 } else {
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(s, r2, cpu_T[0]);
                 }
                 if (is_indexed(r1)) {
                     zprintf("ld %s,(%s%c$%02x)\n", regnames[r2], idxnames[r1], shexb(d));
@@ -1093,7 +2093,7 @@ next_byte:
             } else {
                 gen_movb_v_reg(cpu_T[0], r1);
             }
-            gen_alu[y](); /* places output in A */
+            gen_alu_T0(s, y); /* places output in A */
             if (is_indexed(r1)) {
                 zprintf("%s(%s%c$%02x)\n", alu[y], idxnames[r1], shexb(d));
             } else {
@@ -1114,6 +2114,9 @@ next_byte:
                     r1 = regpairmap(regpair2[p], m);
                     gen_popw(cpu_T[0]);
                     gen_movw_reg_v(r1, cpu_T[0]);
+                    if (r1 == OR2_AF) {
+                        s->cc_op = CC_OP_FLAGS;
+                    }
                     zprintf("pop %s\n", regpairnames[r1]);
                     break;
                 case 1:
@@ -1163,10 +2166,8 @@ next_byte:
                 case 0:
                     n = lduw_code(s->pc);
                     s->pc += 2;
-                    gen_jmp_im(n);
+                    gen_goto_tb(s, 0, n);
                     zprintf("jp $%04x\n", n);
-                    gen_eob(s);
-                    s->is_jmp = 3;
                     break;
                 case 1:
                     zprintf("cb prefix\n");
@@ -1177,19 +2178,23 @@ next_byte:
                     n = ldub_code(s->pc);
                     s->pc++;
                     gen_movb_v_A(cpu_T[0]);
+                    gen_update_tstates(s);
+                    /* the board may log the PC of an OUT */
+                    gen_jmp_im(pc_start - s->cs_base);
                     if (use_icount) {
                         gen_io_start();
                     }
                     gen_helper_out_T0_im(tcg_const_tl(n));
-                    if (use_icount) {
-                        gen_io_end();
-                        gen_jmp_im(s->pc);
-                    }
+                    gen_out_eob(s);
                     zprintf("out ($%02x),a\n", n);
                     break;
                 case 3:
                     n = ldub_code(s->pc);
                     s->pc++;
+                    gen_update_tstates(s);
+                    /* the board may have the IN retried */
+                    gen_update_cc_op(s);
+                    gen_jmp_im(pc_start - s->cs_base);
                     if (use_icount) {
                         gen_io_start();
                     }
@@ -1205,7 +2210,7 @@ next_byte:
                     r1 = regpairmap(OR2_HL, m);
                     gen_popw(cpu_T[1]);
                     gen_movw_v_reg(cpu_T[0], r1);
-                    gen_pushw(cpu_T[0]);
+                    gen_pushw(s, cpu_T[0]);
                     gen_movw_reg_v(r1, cpu_T[1]);
                     zprintf("ex (sp),%s\n", regpairnames[r1]);
                     break;
@@ -1237,8 +2242,11 @@ next_byte:
                 switch (q) {
                 case 0:
                     r1 = regpairmap(regpair2[p], m);
+                    if (r1 == OR2_AF) {
+                        gen_compute_flags(s);
+                    }
                     gen_movw_v_reg(cpu_T[0], r1);
-                    gen_pushw(cpu_T[0]);
+                    gen_pushw(s, cpu_T[0]);
                     zprintf("push %s\n", regpairnames[r1]);
                     break;
                 case 1:
@@ -1247,11 +2255,9 @@ next_byte:
                         n = lduw_code(s->pc);
                         s->pc += 2;
                         tcg_gen_movi_tl(cpu_T[0], s->pc);
-                        gen_pushw(cpu_T[0]);
-                        gen_jmp_im(n);
+                        gen_pushw(s, cpu_T[0]);
+                        gen_goto_tb(s, 0, n);
                         zprintf("call $%04x\n", n);
-                        gen_eob(s);
-                        s->is_jmp = 3;
                         break;
                     case 1:
                         zprintf("dd prefix\n");
@@ -1274,20 +2280,16 @@ next_byte:
                 break;
 
             case 6:
-                n = ldub_code(s->pc);
-                s->pc++;
-                tcg_gen_movi_tl(cpu_T[0], n);
-                gen_alu[y](); /* places output in A */
+                n = gen_movb_v_imm(s, cpu_T[0]);
+                gen_alu_T0(s, y); /* places output in A */
                 zprintf("%s$%02x\n", alu[y], n);
                 break;
 
             case 7:
                 tcg_gen_movi_tl(cpu_T[0], s->pc);
-                gen_pushw(cpu_T[0]);
-                gen_jmp_im(y*8);
+                gen_pushw(s, cpu_T[0]);
+                gen_goto_tb(s, 0, y*8);
                 zprintf("rst $%02x\n", y*8);
-                gen_eob(s);
-                s->is_jmp = 3;
                 break;
             }
             break;
@@ -1313,6 +2315,9 @@ next_byte:
         p = y >> 1;
         q = y & 0x01;
 
+        s->insn = m == MODE_NORMAL ? &z80_insn_cb[b] : &z80_insn_xdcb[b];
+        s->insn_tstates += s->insn->tstates;
+
         if (m != MODE_NORMAL) {
             r1 = regmap(OR_HLmem, m);
             gen_movb_v_idx(cpu_T[0], r1, d);
@@ -1327,42 +2332,47 @@ next_byte:
         switch (x) {
         case 0:
             /* TODO: TST instead of SLL for R800 */
-            gen_rot_T0[y]();
+            gen_rot_T0(s, y);
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(s, r1, cpu_T[0], d);
                 if (z != 6) {
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(s, r2, cpu_T[0]);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(s, r1, cpu_T[0]);
             }
+            gen_rot_cc(s);
             zprintf("%s %s\n", rot[y], regnames[r1]);
             break;
         case 1:
-            gen_helper_bit_T0(tcg_const_tl(1 << y));
+            if (!flags_dead(s)) {
+                gen_kept_carry(s, cpu_cc_src);
+                tcg_gen_andi_tl(cpu_cc_dst, cpu_T[0], 1 << y);
+                s->cc_op = CC_OP_BITB;
+            }
             zprintf("bit %i,%s\n", y, regnames[r1]);
             break;
         case 2:
             tcg_gen_andi_tl(cpu_T[0], cpu_T[0], ~(1 << y));
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(s, r1, cpu_T[0], d);
                 if (z != 6) {
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(s, r2, cpu_T[0]);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(s, r1, cpu_T[0]);
             }
             zprintf("res %i,%s\n", y, regnames[r1]);
             break;
         case 3:
             tcg_gen_ori_tl(cpu_T[0], cpu_T[0], 1 << y);
             if (m != MODE_NORMAL) {
-                gen_movb_idx_v(r1, cpu_T[0], d);
+                gen_movb_idx_v(s, r1, cpu_T[0], d);
                 if (z != 6) {
-                    gen_movb_reg_v(r2, cpu_T[0]);
+                    gen_movb_reg_v(s, r2, cpu_T[0]);
                 }
             } else {
-                gen_movb_reg_v(r1, cpu_T[0]);
+                gen_movb_reg_v(s, r1, cpu_T[0]);
             }
             zprintf("set %i,%s\n", y, regnames[r1]);
             break;
@@ -1374,8 +2384,10 @@ next_byte:
         b = ldub_code(s->pc);
         s->pc++;
 
+        s->insn = &z80_insn_ed[b];
+        s->insn_tstates += s->insn->tstates;
+
         int x, y, z, p, q;
-        int n;
         int r1, r2;
 
         x = (b >> 6) & 0x03;
@@ -1422,13 +2434,17 @@ next_byte:
         case 1:
             switch (z) {
             case 0:
+                gen_update_tstates(s);
+                gen_update_cc_op(s);
+                gen_jmp_im(pc_start - s->cs_base);
                 if (use_icount) {
                     gen_io_start();
                 }
+                gen_compute_flags(s);
                 gen_helper_in_T0_bc_cc();
                 if (y != 6) {
                     r1 = regmap(reg[y], m);
-                    gen_movb_reg_v(r1, cpu_T[0]);
+                    gen_movb_reg_v(s, r1, cpu_T[0]);
                     zprintf("in %s,(c)\n", regnames[r1]);
                 } else {
                     zprintf("in (c)\n");
@@ -1447,20 +2463,20 @@ next_byte:
                     tcg_gen_movi_tl(cpu_T[0], 0);
                     zprintf("out (c),0\n");
                 }
+                gen_update_tstates(s);
+                gen_jmp_im(pc_start - s->cs_base);
                 if (use_icount) {
                     gen_io_start();
                 }
                 gen_helper_out_T0_bc();
-                if (use_icount) {
-                    gen_io_end();
-                    gen_jmp_im(s->pc);
-                }
+                gen_out_eob(s);
                 break;
             case 2:
                 r1 = regpairmap(OR2_HL, m);
                 r2 = regpairmap(regpair[p], m);
                 gen_movw_v_reg(cpu_T[0], r1);
                 gen_movw_v_reg(cpu_T[1], r2);
+                gen_compute_flags(s);
                 if (q == 0) {
                     zprintf("sbc %s,%s\n", regpairnames[r1], regpairnames[r2]);
                     gen_helper_sbcw_T0_T1_cc();
@@ -1470,25 +2486,37 @@ next_byte:
                 }
                 gen_movw_reg_v(r1, cpu_T[0]);
                 break;
-            case 3:
-                n = lduw_code(s->pc);
-                s->pc += 2;
+            case 3: {
+                /* the address, for the store timing */
+                int nn = gen_movw_v_imm(s, cpu_A0);
+
                 r1 = regpairmap(regpair[p], m);
                 if (q == 0) {
                     gen_movw_v_reg(cpu_T[0], r1);
-                    tcg_gen_movi_i32(cpu_A0, n);
+                    gen_store_tstates(s, imm_store_addr(s, nn), 2);
                     tcg_gen_qemu_st16(cpu_T[0], cpu_A0, MEM_INDEX);
-                    zprintf("ld ($%02x),%s\n", n, regpairnames[r1]);
+                    zprintf("ld ($%04x),%s\n", nn, regpairnames[r1]);
                 } else {
-                    tcg_gen_movi_i32(cpu_A0, n);
                     tcg_gen_qemu_ld16u(cpu_T[0], cpu_A0, MEM_INDEX);
                     gen_movw_reg_v(r1, cpu_T[0]);
-                    zprintf("ld %s,($%02x)\n", regpairnames[r1], n);
+                    zprintf("ld %s,($%04x)\n", regpairnames[r1], nn);
                 }
                 break;
+            }
             case 4:
                 zprintf("neg\n");
-                gen_helper_neg_cc();
+                /* a = 0 - a */
+                if (flags_dead(s)) {
+                    tcg_gen_neg_tl(cpu_A, cpu_A);
+                    tcg_gen_ext8u_tl(cpu_A, cpu_A);
+                    break;
+                }
+                gen_movb_v_A(cpu_cc_src);
+                tcg_gen_movi_tl(cpu_cc_src2, 0);
+                tcg_gen_neg_tl(cpu_cc_dst, cpu_cc_src);
+                tcg_gen_ext8u_tl(cpu_T[0], cpu_cc_dst);
+                gen_movb_A_v(cpu_T[0]);
+                s->cc_op = CC_OP_SUBB;
                 break;
             case 5:
                 /* FIXME */
@@ -1511,6 +2539,9 @@ next_byte:
 //              s->is_ei = 1;
                 break;
             case 7:
+                if (y >= 2 && y <= 5) {
+                    gen_prepare_flags(s);
+                }
                 switch (y) {
                 case 0:
                     gen_helper_ld_I_A();
@@ -1531,12 +2562,14 @@ next_byte:
                 case 4:
                     gen_movb_v_HLmem(cpu_T[0]);
                     gen_helper_rrd_cc();
+                    gen_store_tstates(s, -1, 1);
                     gen_movb_HLmem_v(cpu_T[0]);
                     zprintf("rrd\n");
                     break;
                 case 5:
                     gen_movb_v_HLmem(cpu_T[0]);
                     gen_helper_rld_cc();
+                    gen_store_tstates(s, -1, 1);
                     gen_movb_HLmem_v(cpu_T[0]);
                     zprintf("rld\n");
                     break;
@@ -1553,11 +2586,21 @@ next_byte:
         case 2:
             /* FIXME */
             if (y >= 4) {
+                gen_prepare_flags(s);
                 switch (z) {
                 case 0: /* ldi/ldd/ldir/lddr */
+                    if ((y & 2)) {
+                        gen_update_tstates(s);
+                        gen_helper_bli_ld_block(tcg_const_tl(s->pc),
+                                                tcg_const_tl(y & 1));
+                        gen_eob(s);
+                        s->is_jmp = 3;
+                        break;
+                    }
                     gen_movw_v_HL(cpu_A0);
                     tcg_gen_qemu_ld8u(cpu_T[0], cpu_A0, MEM_INDEX);
                     gen_movw_v_DE(cpu_A0);
+                    gen_store_tstates(s, -1, 1);
                     tcg_gen_qemu_st8(cpu_T[0], cpu_A0, MEM_INDEX);
 
                     if (!(y & 1)) {
@@ -1565,14 +2608,17 @@ next_byte:
                     } else {
                         gen_helper_bli_ld_dec_cc();
                     }
+                    break;
+
+                case 1: /* cpi/cpd/cpir/cpdr */
                     if ((y & 2)) {
-                        gen_helper_bli_ld_rep(tcg_const_tl(s->pc));
+                        gen_update_tstates(s);
+                        gen_helper_bli_cp_block(tcg_const_tl(s->pc),
+                                                tcg_const_tl(y & 1));
                         gen_eob(s);
                         s->is_jmp = 3;
+                        break;
                     }
-                    break;
-
-                case 1: /* cpi/cpd/cpir/cpdr */
                     gen_movw_v_HL(cpu_A0);
                     tcg_gen_qemu_ld8u(cpu_T[0], cpu_A0, MEM_INDEX);
                     gen_helper_bli_cp_cc();
@@ -1582,14 +2628,12 @@ next_byte:
                     } else {
                         gen_helper_bli_cp_dec_cc();
                     }
-                    if ((y & 2)) {
-                        gen_helper_bli_cp_rep(tcg_const_tl(s->pc));
-                        gen_eob(s);
-                        s->is_jmp = 3;
-                    }
                     break;
 
                 case 2: /* ini/ind/inir/indr */
+                    gen_update_tstates(s);
+                    gen_update_cc_op(s);
+                    gen_jmp_im(pc_start - s->cs_base);
                     if (use_icount) {
                         gen_io_start();
                     }
@@ -1598,6 +2642,7 @@ next_byte:
                         gen_io_end();
                     }
                     gen_movw_v_HL(cpu_A0);
+                    gen_store_tstates(s, -1, 1);
                     tcg_gen_qemu_st8(cpu_T[0], cpu_A0, MEM_INDEX);
                     if (!(y & 1)) {
                         gen_helper_bli_io_T0_inc(0);
@@ -1616,6 +2661,8 @@ next_byte:
                 case 3: /* outi/outd/otir/otdr */
                     gen_movw_v_HL(cpu_A0);
                     tcg_gen_qemu_ld8u(cpu_T[0], cpu_A0, MEM_INDEX);
+                    gen_update_tstates(s);
+                    gen_jmp_im(pc_start - s->cs_base);
                     if (use_icount) {
                         gen_io_start();
                     }
@@ -1628,13 +2675,13 @@ next_byte:
                     } else {
                         gen_helper_bli_io_T0_dec(1);
                     }
+                    /* the OUT ends the TB, see gen_out_eob() */
                     if ((y & 2)) {
                         gen_helper_bli_io_rep(tcg_const_tl(s->pc));
-                        gen_eob(s);
-                        s->is_jmp = 3;
-                    } else if (use_icount) {
+                    } else {
                         gen_jmp_im(s->pc);
                     }
+                    gen_eob(s);
                     break;
                 }
 
@@ -1664,6 +2711,8 @@ next_byte:
 
 void z80_translate_init(void)
 {
+    int i, j, p;
+
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
 
 #if TARGET_LONG_BITS > HOST_LONG_BITS
@@ -1674,6 +2723,47 @@ void z80_translate_init(void)
     cpu_T[1] = tcg_global_reg_new_i32(TCG_AREG2, "T1");
 #endif
     cpu_A0 = tcg_global_mem_new_i32(TCG_AREG0, offsetof(CPUState, a0), "A0");
+    cpu_A = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_A]), "A");
+    cpu_F = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_F]), "F");
+    cpu_BC = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_BC]), "BC");
+    cpu_DE = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_DE]), "DE");
+    cpu_HL = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_HL]), "HL");
+    cpu_IX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_IX]), "IX");
+    cpu_IY = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_IY]), "IY");
+    cpu_SP = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_SP]), "SP");
+    cpu_AX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_AX]), "AX");
+    cpu_FX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_FX]), "FX");
+    cpu_BCX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_BCX]),
+                                 "BCX");
+    cpu_DEX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_DEX]),
+                                 "DEX");
+    cpu_HLX = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, regs[R_HLX]),
+                                 "HLX");
+    cpu_cc_op = tcg_global_mem_new_i32(TCG_AREG0,
+                                       offsetof(CPUState, cc_op), "cc_op");
+    cpu_cc_src = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, cc_src),
+                                    "cc_src");
+    cpu_cc_src2 = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, cc_src2),
+                                     "cc_src2");
+    cpu_cc_dst = tcg_global_mem_new(TCG_AREG0, offsetof(CPUState, cc_dst),
+                                    "cc_dst");
+    cpu_tstates = tcg_global_mem_new_i64(TCG_AREG0,
+                                         offsetof(CPUState, tstates),
+                                         "tstates");
+
+    for (i = 0; i < 256; i++) {
+        p = 1;
+        for (j = 0; j < 8; j++) {
+            p ^= (i >> j) & 1;
+        }
+        szp_table[i] = (i & 0x80 ? CC_S : 0) | (i ? 0 : CC_Z) | (p ? CC_P : 0);
+        incb_table[i] = (szp_table[i] & (CC_S | CC_Z)) |
+                        ((i & 0x0f) == 0x00 ? CC_H : 0) |
+                        (i == 0x80 ? CC_P : 0);
+        decb_table[i] = (szp_table[i] & (CC_S | CC_Z)) |
+                        ((i & 0x0f) == 0x0f ? CC_H : 0) |
+                        (i == 0x7f ? CC_P : 0) | CC_N;
+    }
 
     /* register helpers */
 #define GEN_HELPER 2
@@ -1722,6 +2812,17 @@ static inline int gen_intermediate_code_internal(CPUState *env,
     pc_ptr = pc_start;
     lj = -1;
     dc->model = env->model;
+    dc->timed_stores = NULL;
+    for (j = 0; j < 8; j++) {
+        if (env->timed_stores[j]) {
+            dc->timed_stores = env->timed_stores;
+        }
+    }
+    dc->loop_heads = env->loop_heads;
+    dc->phys_pc = get_phys_addr_code(env, pc_start);
+    dc->cc_op = CC_OP_DYNAMIC;
+    dc->tstates = 0;
+    dc->insn_tstates = 0;
 
     num_insns = 0;
     max_insns = tb->cflags & CF_COUNT_MASK;
@@ -1729,7 +2830,46 @@ static inline int gen_intermediate_code_internal(CPUState *env,
         max_insns = CF_COUNT_MASK;
     }
 
+    /* the decision is kept in cflags, for the retranslation of
+       cpu_restore_state() */
+    dc->loop = 0;
+    if (cflags & CF_LOOP) {
+        dc->loop = loop_scan(dc, env);
+    } else if (!search_pc && cflags == 0 &&
+               cpu_z80_loop_state(dc->loop_heads,
+                                  dc->phys_pc) == Z80_LOOP_HOT &&
+               dc->jmp_opt && !singlestep && !use_icount &&
+               TAILQ_EMPTY(&env->breakpoints)) {
+        dc->loop = loop_scan(dc, env);
+        if (dc->loop) {
+            tb->cflags |= CF_LOOP;
+        } else {
+            cpu_z80_set_loop_state(dc->loop_heads, dc->phys_pc,
+                                   Z80_LOOP_REJECTED);
+        }
+    }
+
+    /* the insns after each one must be translated in this TB as well,
+       which is not known in a loop region or when stepping.  Breakpoints
+       and watchpoints may come and go while the TB lives, so the decision
+       is kept in cflags like the one above. */
+    dc->live_insns = 0;
+    if (search_pc) {
+        if (cflags & CF_LIVE) {
+            flags_liveness(dc, env, max_insns);
+        }
+    } else if (!dc->loop && !dc->singlestep_enabled && !singlestep &&
+               !(flags & HF_INHIBIT_IRQ_MASK) &&
+               TAILQ_EMPTY(&env->breakpoints) &&
+               TAILQ_EMPTY(&env->watchpoints)) {
+        flags_liveness(dc, env, max_insns);
+        tb->cflags |= CF_LIVE;
+    }
+
     gen_icount_start();
+    if (flags & HF_PROF_MASK) {
+        gen_prof_start(env, pc_start);
+    }
     for (;;) {
         if (unlikely(!TAILQ_EMPTY(&env->breakpoints))) {
             TAILQ_FOREACH(bp, &env->breakpoints, entry) {
@@ -1739,6 +2879,13 @@ static inline int gen_intermediate_code_internal(CPUState *env,
                 }
             }
         }
+        if (unlikely(env->trap_fn != NULL) && pc_ptr == env->trap_pc &&
+            dc->is_jmp == DISAS_NEXT) {
+            gen_trap(dc, pc_ptr - dc->cs_base);
+        }
+        if (dc->loop) {
+            gen_loop_label(dc, pc_ptr);
+        }
         if (search_pc) {
             j = gen_opc_ptr - gen_opc_buf;
             if (lj < j) {
@@ -1748,15 +2895,41 @@ static inline int gen_intermediate_code_internal(CPUState *env,
                 }
             }
             gen_opc_pc[lj] = pc_ptr;
+            gen_opc_cc_op[lj] = dc->cc_op;
+            gen_opc_tstates[lj] = dc->tstates;
             gen_opc_instr_start[lj] = 1;
             gen_opc_icount[lj] = num_insns;
         }
         if (num_insns + 1 == max_insns && (tb->cflags & CF_LAST_IO)) {
             gen_io_start();
         }
+        /* an insn may fill the op buffer and end the TB */
+        if (num_insns < dc->live_insns &&
+            gen_opc_ptr + MAX_OP_PER_INSTR < gen_opc_end) {
+            dc->live_flags = dc->live[num_insns];
+        } else {
+            dc->live_flags = 0xff;
+        }
 
         pc_ptr = disas_insn(dc, pc_ptr);
         num_insns++;
+        if (search_pc && dc->tstates == 0) {
+            /* the insn brought the counter up to date before its I/O */
+            gen_opc_tstates[lj] = 0;
+        }
+        dc->tstates += dc->insn_tstates;
+        dc->insn_tstates = 0;
+        if (dc->loop) {
+            /* branches are inline up to the end of the region */
+            if (pc_ptr - pc_start >= dc->loop_size ||
+                gen_opc_ptr >= gen_opc_end) {
+                gen_goto_tb(dc, 0, pc_ptr - dc->cs_base);
+                gen_loop_stubs(dc);
+                break;
+            }
+            dc->is_jmp = DISAS_NEXT;
+            continue;
+        }
         /* stop translation if indicated */
         if (dc->is_jmp) {
             break;
@@ -1772,10 +2945,15 @@ static inline int gen_intermediate_code_internal(CPUState *env,
             gen_eob(dc);
             break;
         }
-        /* if too long translation, stop generation too */
+        /* if too long translation, stop generation too; the operands
+           of a CF_SMC block must be within its first 64 bytes */
         if (gen_opc_ptr >= gen_opc_end ||
             (pc_ptr - pc_start) >= (TARGET_PAGE_SIZE - 32) ||
-            num_insns >= max_insns) {
+            ((cflags & CF_SMC) && (pc_ptr - pc_start) >= 60)) {
+            gen_goto_tb(dc, 0, pc_ptr - dc->cs_base);
+            break;
+        }
+        if (num_insns >= max_insns) {
             gen_jmp_im(pc_ptr - dc->cs_base);
             gen_eob(dc);
             break;
@@ -1789,6 +2967,9 @@ static inline int gen_intermediate_code_internal(CPUState *env,
     if (tb->cflags & CF_LAST_IO) {
         gen_io_end();
     }
+    if (flags & HF_PROF_MASK) {
+        gen_prof_end(pc_ptr - pc_start, num_insns);
+    }
     gen_icount_end(tb, num_insns);
     *gen_opc_ptr = INDEX_op_end;
     /* we don't forget to fill the last values */
@@ -1830,5 +3011,12 @@ void gen_intermediate_code_pc(CPUState *env, TranslationBlock *tb)
 void gen_pc_load(CPUState *env, TranslationBlock *tb,
                  unsigned long searched_pc, int pc_pos, void *puc)
 {
+    int cc_op;
+
     env->pc = gen_opc_pc[pc_pos];
+    env->tstates += gen_opc_tstates[pc_pos];
+    cc_op = gen_opc_cc_op[pc_pos];
+    if (cc_op != CC_OP_DYNAMIC) {
+        env->cc_op = cc_op;
+    }
 }
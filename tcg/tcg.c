@@ -93,6 +93,22 @@ static inline void tcg_out32(TCGContext *s, uint32_t v)
     s->code_ptr += 4;
 }
 
+/* record a placement dependent field at the current code position */
+static inline void tcg_out_code_reloc(TCGContext *s, int type)
+{
+    TCGCodeReloc *r;
+
+    if (s->nb_code_relocs < 0)
+        return;
+    if (s->nb_code_relocs >= TCG_MAX_CODE_RELOCS) {
+        s->nb_code_relocs = -1;
+        return;
+    }
+    r = &s->code_relocs[s->nb_code_relocs++];
+    r->offset = s->code_ptr - s->code_buf;
+    r->type = type;
+}
+
 /* label relocation processing */
 
 void tcg_out_reloc(TCGContext *s, uint8_t *code_ptr, int type, 
@@ -1911,6 +1927,7 @@ static inline int tcg_gen_code_common(TCGContext *s, uint8_t *gen_code_buf,
 
     s->code_buf = gen_code_buf;
     s->code_ptr = gen_code_buf;
+    s->nb_code_relocs = 0;
 
     args = gen_opparam_buf;
     op_index = 0;
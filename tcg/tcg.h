@@ -91,6 +91,8 @@ typedef struct TCGPool {
 
 #define TCG_MAX_TEMPS 512
 
+#define TCG_MAX_CODE_RELOCS 512
+
 /* when the size of the arguments of a called function is smaller than
    this value, they are statically allocated in the TB stack frame */
 #define TCG_STATIC_CALL_ARGS_SIZE 128
@@ -235,6 +237,17 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* host code fields which depend on where the code is placed: either
+   a pc-relative displacement to something outside the generated code,
+   or the absolute address of the TranslationBlock */
+#define TCG_CODE_RELOC_PCREL32 0
+#define TCG_CODE_RELOC_TB64    1
+
+typedef struct TCGCodeReloc {
+    uint16_t offset; /* from the start of the generated code */
+    uint16_t type;
+} TCGCodeReloc;
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -270,6 +283,11 @@ struct TCGContext {
     uint8_t *code_ptr;
     TCGTemp static_temps[TCG_MAX_TEMPS];
 
+    /* relocations of the last generated code, -1 if there were too
+       many of them */
+    TCGCodeReloc code_relocs[TCG_MAX_CODE_RELOCS];
+    int nb_code_relocs;
+
     TCGHelperInfo *helpers;
     int nb_helpers;
     int allocated_helpers;
@@ -559,6 +559,7 @@ static void tcg_out_qemu_ld(TCGContext *s, const TCGArg *args,
     /* XXX: move that code at the end of the TB */
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RSI, mem_index);
     tcg_out8(s, 0xe8);
+    tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32);
     tcg_out32(s, (tcg_target_long)qemu_ld_helpers[s_bits] - 
               (tcg_target_long)s->code_ptr - 4);
 
@@ -761,6 +762,7 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args,
     }
     tcg_out_movi(s, TCG_TYPE_I32, TCG_REG_RDX, mem_index);
     tcg_out8(s, 0xe8);
+    tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32);
     tcg_out32(s, (tcg_target_long)qemu_st_helpers[s_bits] - 
               (tcg_target_long)s->code_ptr - 4);
 
@@ -838,8 +840,18 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        if (args[0] & ~3) {
+            /* TB pointer: always use the 64 bit form so that the code
+               keeps its size when it is relocated */
+            tcg_out_opc(s, (0xb8 + TCG_REG_RAX) | P_REXW, 0, TCG_REG_RAX, 0);
+            tcg_out_code_reloc(s, TCG_CODE_RELOC_TB64);
+            tcg_out32(s, args[0]);
+            tcg_out32(s, args[0] >> 32);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_RAX, args[0]);
+        }
         tcg_out8(s, 0xe9); /* jmp tb_ret_addr */
+        tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32);
         tcg_out32(s, tb_ret_addr - s->code_ptr - 4);
         break;
     case INDEX_op_goto_tb:
@@ -860,6 +872,7 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     case INDEX_op_call:
         if (const_args[0]) {
             tcg_out8(s, 0xe8);
+            tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 2, args[0]);
@@ -868,6 +881,7 @@ static inline void tcg_out_op(TCGContext *s, int opc, const TCGArg *args,
     case INDEX_op_jmp:
         if (const_args[0]) {
             tcg_out8(s, 0xe9);
+            tcg_out_code_reloc(s, TCG_CODE_RELOC_PCREL32);
             tcg_out32(s, args[0] - (tcg_target_long)s->code_ptr - 4);
         } else {
             tcg_out_modrm(s, 0xff, 4, args[0]);
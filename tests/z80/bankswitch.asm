@@ -0,0 +1,85 @@
+; ZX Spectrum 128K bank switching benchmark
+;
+; Pages every RAM bank in at 0xc000 in turn, together with the other ROM
+; every second time, and calls a counter routine in the bank that was
+; just paged in.  The Makefile puts the same code in both halves of the
+; 128K ROM image, run it with:
+;
+;   qemu-system-z80 -M zxspec128 -bios bankswitch.rom
+;
+; When it finishes the border turns green and the CPU halts; the eight
+; bank counters are at 0x8000 (x /8hx 0x8000 in the monitor), each equal
+; to PASSES.  Compare the host CPU time used up to that point.
+
+PASSES  equ     65535
+COUNTER equ     0xc100
+
+        org     0
+
+start:  di
+        ld      sp,0x8000
+
+        ; put a copy of the counter routine in every bank
+        xor     a
+init:   ld      bc,0x7ffd
+        out     (c),a
+        ld      hl,bankcode
+        ld      de,0xc000
+        ld      bc,bankcode_end - bankcode
+        ldir
+        ld      hl,0
+        ld      (COUNTER),hl
+        inc     a
+        cp      8
+        jr      nz,init
+
+        ld      de,PASSES
+pass:   ld      hl,banks
+        ld      b,8
+switch: push    bc
+        ld      a,(hl)
+        ld      bc,0x7ffd
+        out     (c),a
+        call    0xc000
+        inc     hl
+        pop     bc
+        djnz    switch
+        dec     de
+        ld      a,d
+        or      e
+        jr      nz,pass
+
+        ; collect the counters
+        ld      ix,0x8000
+        xor     a
+collect:
+        ld      bc,0x7ffd
+        out     (c),a
+        ld      hl,(COUNTER)
+        ld      (ix+0),l
+        ld      (ix+1),h
+        inc     ix
+        inc     ix
+        inc     a
+        cp      8
+        jr      nz,collect
+
+        ld      a,4
+        out     (0xfe),a
+done:   di
+        halt
+        jr      done
+
+        ; bank numbers, with the 48K BASIC ROM selected for the odd ones
+banks:  defb    0x00,0x11,0x02,0x13,0x04,0x15,0x06,0x17
+
+bankcode:
+        push    hl
+        ld      hl,(COUNTER)
+        inc     hl
+        ld      (COUNTER),hl
+        pop     hl
+        ret
+bankcode_end:
+
+        defs    0x4000 - $
@@ -40,7 +40,7 @@ TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
 target_ulong gen_opc_pc[OPC_BUF_SIZE];
 uint16_t gen_opc_icount[OPC_BUF_SIZE];
 uint8_t gen_opc_instr_start[OPC_BUF_SIZE];
-#if defined(TARGET_I386)
+#if defined(TARGET_I386) || defined(TARGET_Z80)
 uint8_t gen_opc_cc_op[OPC_BUF_SIZE];
 #elif defined(TARGET_SPARC)
 target_ulong gen_opc_npc[OPC_BUF_SIZE];
@@ -48,6 +48,9 @@ target_ulong gen_opc_jump_pc[2];
 #elif defined(TARGET_MIPS) || defined(TARGET_SH4)
 uint32_t gen_opc_hflags[OPC_BUF_SIZE];
 #endif
+#if defined(TARGET_Z80)
+uint32_t gen_opc_tstates[OPC_BUF_SIZE];
+#endif
 
 /* XXX: suppress that */
 unsigned long code_gen_max_block_size(void)
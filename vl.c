@@ -195,8 +195,11 @@ int main(int argc, char **argv)
 static const char *data_dir;
 const char *bios_name = NULL;
 const char *io_input_file = NULL;
+const char *io_input_map_file = NULL;
 const char *io_output_file = NULL;
 const char *io_output_log_file = NULL;
+const char *tape_file = NULL;
+const char *tape_mode = NULL;
 static void *ioport_opaque[MAX_IOPORTS];
 static IOPortReadFunc *ioport_read_table[3][MAX_IOPORTS];
 static IOPortWriteFunc *ioport_write_table[3][MAX_IOPORTS];
@@ -250,6 +253,8 @@ int no_hpet = 0;
 int fd_bootchk = 1;
 int no_reboot = 0;
 int no_shutdown = 0;
+int idle_skip = 0;
+static const char *tb_cache_file;
 int cursor_hide = 1;
 int graphic_rotate = 0;
 #ifndef _WIN32
@@ -4389,6 +4394,27 @@ static int tcg_has_work(void)
     return 0;
 }
 
+/* With -idle-skip, CPUs that are all halted waiting for an interrupt
+   need not wait for the host clock: virtual time can jump straight to
+   the next vm_clock timer, which is what will wake them up.  */
+static int qemu_can_idle_skip(void)
+{
+    CPUState *env;
+
+    if (!idle_skip || !active_timers[QEMU_TIMER_VIRTUAL])
+        return 0;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->stopped)
+            continue;
+#if defined(TARGET_Z80)
+        /* HALT with interrupts disabled waits for an NMI */
+        if (!env->iff1)
+            return 0;
+#endif
+    }
+    return 1;
+}
+
 static int qemu_calculate_timeout(void)
 {
     int timeout;
@@ -4397,9 +4423,14 @@ static int qemu_calculate_timeout(void)
         timeout = 5000;
     else if (tcg_has_work())
         timeout = 0;
-    else if (!use_icount)
-        timeout = 5000;
-    else {
+    else if (!use_icount) {
+        if (qemu_can_idle_skip()) {
+            cpu_clock_offset += qemu_next_deadline();
+            timeout = 0;
+        } else {
+            timeout = 5000;
+        }
+    } else {
      /* XXX: use timeout computed from timers */
         int64_t add;
         int64_t delta;
@@ -4412,7 +4443,7 @@ static int qemu_calculate_timeout(void)
         } else {
             delta = cpu_get_icount() - cpu_get_clock();
         }
-        if (delta > 0) {
+        if (delta > 0 && !qemu_can_idle_skip()) {
             /* If virtual time is ahead of real time then just
                wait for IO.  */
             timeout = (delta / 1000000) + 1;
@@ -4430,7 +4461,7 @@ static int qemu_calculate_timeout(void)
                   >> icount_time_shift;
             qemu_icount += add;
             timeout = delta / 1000000;
-            if (timeout < 0)
+            if (timeout < 0 || qemu_can_idle_skip())
                 timeout = 0;
         }
     }
@@ -5660,6 +5691,12 @@ int main(int argc, char **argv, char **envp)
                     icount_time_shift = strtol(optarg, NULL, 0);
                 }
                 break;
+            case QEMU_OPTION_idle_skip:
+                idle_skip = 1;
+                break;
+            case QEMU_OPTION_tb_cache:
+                tb_cache_file = optarg;
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 break;
@@ -5688,6 +5725,9 @@ int main(int argc, char **argv, char **envp)
                 fprintf(stderr,
                         "io-input-file is %s\n", io_input_file);
                 break;
+            case QEMU_OPTION_io_input_map:
+                io_input_map_file = optarg;
+                break;
             case QEMU_OPTION_io_output_file:
                 io_output_file = optarg;
                 fprintf(stderr,
@@ -5698,6 +5738,12 @@ int main(int argc, char **argv, char **envp)
                 fprintf(stderr,
                         "io-output-log-file is %s\n", io_output_log_file);
                 break;
+            case QEMU_OPTION_tape:
+                tape_file = optarg;
+                break;
+            case QEMU_OPTION_tape_mode:
+                tape_mode = optarg;
+                break;
 
 #endif
             }
@@ -6064,6 +6110,8 @@ int main(int argc, char **argv, char **envp)
     machine->init(ram_size, boot_devices,
                   kernel_filename, kernel_cmdline, initrd_filename, cpu_model);
 
+    if (tb_cache_file)
+        tb_cache_init(tb_cache_file, machine->name, cpu_model);
 
     for (env = first_cpu; env != NULL; env = env->next_cpu) {
         for (i = 0; i < nb_numa_nodes; i++) {
@@ -0,0 +1,45 @@
+#!/usr/bin/perl -w
+#
+# Convert a binary Z80 -io-output-log-file log to text, one line per OUT
+# in the format the log was written in before:
+#
+#   OUT(0xFE):    0x07
+#
+# With -v, each line starts with the T-state and PC of the OUT.
+#
+# This code is licensed under the GPL version 2
+
+use strict;
+
+my $verbose = 0;
+if (@ARGV && $ARGV[0] eq '-v') {
+    $verbose = 1;
+    shift @ARGV;
+}
+if (@ARGV > 1) {
+    die "usage: z80-outlog.pl [-v] [log]\n";
+}
+
+my $in = \*STDIN;
+if (@ARGV) {
+    open($in, '<', $ARGV[0]) or die "$ARGV[0]: $!\n";
+}
+binmode $in;
+
+my $hdr;
+if (read($in, $hdr, 8) != 8 || substr($hdr, 0, 6) ne 'Z80OUT') {
+    die "not a Z80 OUT log\n";
+}
+my $version = unpack('v', substr($hdr, 6, 2));
+if ($version != 1) {
+    die "unknown log version $version\n";
+}
+
+my $rec;
+while (read($in, $rec, 16) == 16) {
+    my ($tlo, $thi, $pc, $port, $value) = unpack('VVvvC', $rec);
+    if ($verbose) {
+        printf("%.0f  PC=0x%04X  ", $thi * 4294967296 + $tlo, $pc);
+    }
+    printf("OUT(0x%02X):    0x%02X\r\n", $port & 0xff, $value);
+}